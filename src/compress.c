@@ -17,45 +17,336 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef HAVE_LZ4_ATTACH_DICTIONARY
+#  define LZ4_STATIC_LINKING_ONLY
+#endif
 #include <lz4.h>
 
 #include "compress.h"
 #include "encapsulate.h"
 #include "log.h"
 
+// 小包压缩收益很小, 直接跳过; 有字典时小包也能压缩
+#define COMPRESS_MIN 128
+#define DICT_MIN     32
+
+// 预训练的共享字典, 每个包都从载入字典后的状态开始压缩, 包之间没有依赖.
+// 全零的 LZ4_stream_t 就是初始化过的状态
+static char dict[DICT_MAX];
+static int dict_size;
+static LZ4_stream_t dict_stream;
+static LZ4_stream_t work_stream;
+
+// 按内层 5 元组统计压缩结果, 连续失败 FAIL_LIMIT 次后跳过一段包再重新尝试,
+// 每次再失败跳过的包数翻倍. 两路组相联, 冲突时优先替换没有状态的槽
+#define FLOWS      1024
+#define FAIL_LIMIT 4
+#define SKIP_MIN   16
+#define LEVEL_MAX  8
+
+typedef struct
+{
+    uint32_t key;
+    uint8_t fails;
+    uint8_t level;
+    uint16_t skip;
+} flow_t;
+
+static flow_t flows[FLOWS];
+
+// 每 SAMPLE 次压缩计时一次, 平滑后的每字节耗时 (ps) 估算跳过的包省下的时间
+#define SAMPLE 64
 
-void compress(pbuf_t *pbuf)
+static struct
 {
-    uint8_t out[2048];
-    int outlen = LZ4_compress_default(
-        (const char *)(pbuf->payload),
+    uint64_t tried;
+    uint64_t compressed;
+    uint64_t skipped;
+    uint64_t evicted;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint64_t byte_ps;
+    uint64_t saved_ns;
+} counters;
+
+
+static uint32_t hash(uint32_t h, const uint8_t *p, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+
+// 内层 IP 包的 5 元组哈希, 不是 IP 包时用前 20 字节
+static uint32_t flow_key(const uint8_t *in, int len)
+{
+    uint32_t h = 2166136261u;
+    int proto = -1;
+    int off = 0;
+    if ((len >= 20) && ((in[0] >> 4) == 4))
+    {
+        proto = in[9];
+        off = (in[0] & 0x0f) * 4;
+        h = hash(h, in + 12, 8);
+    }
+    else if ((len >= 40) && ((in[0] >> 4) == 6))
+    {
+        proto = in[6];
+        off = 40;
+        h = hash(h, in + 8, 32);
+    }
+    else
+    {
+        return hash(h, in, (len < 20) ? len : 20);
+    }
+    h = hash(h, (const uint8_t *)&proto, 1);
+    if (((proto == 6) || (proto == 17)) && (len >= off + 4))
+    {
+        h = hash(h, in + off, 4);
+    }
+    return h;
+}
+
+
+static void skip(int len)
+{
+    counters.skipped++;
+    counters.saved_ns += (uint64_t)len * counters.byte_ps / 1000;
+}
+
+
+static int flow_idle(const flow_t *flow)
+{
+    return (flow->fails == 0) && (flow->level == 0) && (flow->skip == 0);
+}
+
+
+static flow_t *flow_get(uint32_t key)
+{
+    flow_t *a = &flows[key % FLOWS];
+    flow_t *b = &flows[(key % FLOWS) ^ 1];
+    if (a->key == key)
+    {
+        return a;
+    }
+    if (b->key == key)
+    {
+        return b;
+    }
+    flow_t *flow = (flow_idle(a) || !flow_idle(b)) ? a : b;
+    if (!flow_idle(flow))
+    {
+        counters.evicted++;
+    }
+    memset(flow, 0, sizeof(flow_t));
+    flow->key = key;
+    return flow;
+}
+
+
+static int lz4(const uint8_t *in, int len, uint8_t *out)
+{
+    // out 至少有 LZ4_compressBound(len) 字节, LZ4 不用检查输出边界
+#ifdef HAVE_LZ4_ATTACH_DICTIONARY
+    // 静态链接 liblz4 时只引用字典的哈希表, 工作状态也只做快速重置
+    if (dict_size > 0)
+    {
+        LZ4_resetStream_fast(&work_stream);
+        LZ4_attach_dictionary(&work_stream, &dict_stream);
+        return LZ4_compress_fast_continue(
+            &work_stream,
+            (const char *)in,
+            (char *)out,
+            len,
+            LZ4_compressBound(len),
+            1);
+    }
+    return LZ4_compress_fast_extState_fastReset(
+        &work_stream,
+        (const char *)in,
         (char *)out,
-        pbuf->len,
-        sizeof(out));
-    if ((outlen > 0) && (outlen < pbuf->len))
+        len,
+        LZ4_compressBound(len),
+        1);
+#else
+    if (dict_size > 0)
     {
-        memcpy(pbuf->payload, out, outlen);
-        pbuf->len = outlen;
-        pbuf->flag |= FLAG_COMPRESS;
+        // 共享库没有导出 LZ4_attach_dictionary, 复制载入字典后的状态
+        memcpy(&work_stream, &dict_stream, sizeof(LZ4_stream_t));
+        return LZ4_compress_fast_continue(
+            &work_stream,
+            (const char *)in,
+            (char *)out,
+            len,
+            LZ4_compressBound(len),
+            1);
+    }
+    return LZ4_compress_default(
+        (const char *)in,
+        (char *)out,
+        len,
+        LZ4_compressBound(len));
+#endif
+}
+
+
+int compress(const uint8_t *in, int len, uint8_t *out, const uint8_t *pkt, int pkt_len)
+{
+    if (len < ((dict_size > 0) ? DICT_MIN : COMPRESS_MIN))
+    {
+        skip(len);
+        return 0;
+    }
+
+    flow_t *flow = flow_get(flow_key(pkt, pkt_len));
+    if (flow->skip > 0)
+    {
+        flow->skip--;
+        skip(len);
+        return 0;
+    }
+
+    int outlen;
+    counters.tried++;
+    if (counters.tried % SAMPLE == 0)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        outlen = lz4(in, len, out);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000
+                                 + (end.tv_nsec - start.tv_nsec));
+        // 被调度走的样本不可信, 超过 1ms 的丢弃
+        if (ns < 1000000)
+        {
+            uint64_t ps = ns * 1000 / (uint64_t)len;
+            counters.byte_ps = (counters.byte_ps == 0) ? ps
+                               : counters.byte_ps - counters.byte_ps / 8 + ps / 8;
+        }
+    }
+    else
+    {
+        outlen = lz4(in, len, out);
+    }
+
+    if ((outlen > 0) && (outlen < len))
+    {
+        flow->fails = 0;
+        flow->level = 0;
+        counters.compressed++;
+        counters.in_bytes += len;
+        counters.out_bytes += outlen;
+        return outlen;
+    }
+
+    // 失败: 连续失败多次后跳过, 重新尝试仍失败则加倍
+    if (flow->fails < FAIL_LIMIT)
+    {
+        flow->fails++;
+    }
+    if (flow->fails >= FAIL_LIMIT)
+    {
+        flow->skip = (uint16_t)(SKIP_MIN << flow->level);
+        if (flow->level < LEVEL_MAX)
+        {
+            flow->level++;
+        }
     }
+    return 0;
 }
 
 
-void decompress(pbuf_t *pbuf)
+void compress_stat(compress_stat_t *stat)
 {
-    if (pbuf->flag & FLAG_COMPRESS)
+    stat->tried = counters.tried;
+    stat->skipped = counters.skipped;
+    stat->evicted = counters.evicted;
+    stat->ratio = (counters.in_bytes > 0) ? (int)(counters.out_bytes * 100 / counters.in_bytes) : 100;
+    stat->saved_us = counters.saved_ns / 1000;
+}
+
+
+int decompress(const uint8_t *in, int len, uint8_t *out, int size, int use_dict)
+{
+    int outlen;
+    if (use_dict)
+    {
+        // 对端用了字典, 本端没有载入字典时无法解压
+        if (dict_size == 0)
+        {
+            return -1;
+        }
+        outlen = LZ4_decompress_safe_usingDict(
+            (const char *)in,
+            (char *)out,
+            len,
+            size,
+            dict,
+            dict_size);
+    }
+    else
     {
-        uint8_t out[2048];
-        int outlen = LZ4_decompress_safe(
-            (const char *)(pbuf->payload),
+        outlen = LZ4_decompress_safe(
+            (const char *)in,
             (char *)out,
-            pbuf->len,
-            sizeof(out));
-        assert(outlen > 0);
-        memcpy(pbuf->payload, out, outlen);
-        pbuf->len = outlen;
+            len,
+            size);
+    }
+    return (outlen > 0) ? outlen : -1;
+}
+
+
+int compress_dict(const char *path, uint32_t *id)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        ERROR("fopen");
+        return -1;
+    }
+    // 超过 DICT_MAX 时只用文件末尾, 训练工具把最常见的内容放在末尾
+    if (fseek(f, 0, SEEK_END) != 0)
+    {
+        ERROR("fseek");
+        fclose(f);
+        return -1;
+    }
+    long total = ftell(f);
+    if ((total < 0) || (fseek(f, (total > DICT_MAX) ? total - DICT_MAX : 0, SEEK_SET) != 0))
+    {
+        ERROR("fseek");
+        fclose(f);
+        return -1;
+    }
+    int size = (int)fread(dict, 1, sizeof(dict), f);
+    fclose(f);
+    if (size == 0)
+    {
+        LOG("dictionary %s is empty", path);
+        return -1;
     }
+
+    memset(&dict_stream, 0, sizeof(LZ4_stream_t));
+    LZ4_loadDict(&dict_stream, dict, size);
+    dict_size = size;
+    *id = hash(2166136261u, (const uint8_t *)dict, size);
+    return size;
+}
+
+
+int compress_dict_loaded(void)
+{
+    return dict_size > 0;
 }
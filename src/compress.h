@@ -22,9 +22,35 @@
 
 #include "encapsulate.h"
 
+// LZ4 只使用最后 64KB 的字典
+#define DICT_MAX 65536
 
-extern void compress(pbuf_t *pbuf);
-extern void decompress(pbuf_t *pbuf);
+typedef struct
+{
+    // packets passed to LZ4, and skipped (small or on a failing flow)
+    uint64_t tried;
+    uint64_t skipped;
+    // flows with skip state replaced by another flow
+    uint64_t evicted;
+    // compressed size of the packets that got smaller, in percent
+    int ratio;
+    // estimated LZ4 time saved by skipping
+    uint64_t saved_us;
+} compress_stat_t;
+
+// compress len bytes into out (LZ4_compressBound(len) bytes),
+// return compressed length, 0 if not smaller or skipped.
+// pkt is the inner packet before header compression, it keys per flow state
+extern int compress(const uint8_t *in, int len, uint8_t *out, const uint8_t *pkt, int pkt_len);
+// decompress into out (size bytes), return decompressed length, -1 on error
+extern int decompress(const uint8_t *in, int len, uint8_t *out, int size, int use_dict);
+
+// load a shared dictionary used by compress() from now on,
+// return its size and a fingerprint in id, -1 on error
+extern int compress_dict(const char *path, uint32_t *id);
+extern int compress_dict_loaded(void);
+
+extern void compress_stat(compress_stat_t *stat);
 
 
 #endif
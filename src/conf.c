@@ -23,6 +23,7 @@
 #include <string.h>
 #include "conf.h"
 #include "encapsulate.h"
+#include "fec.h"
 
 #ifdef HAVE_CONFIG_H
 #  include "config.h"
@@ -198,13 +199,387 @@ int read_conf(const char *file, conf_t *conf)
                 fclose(f);
                 return -1;
             }
-            else if (conf->mtu > PAYLOAD_MAX)
+            else if (conf->mtu > PAYLOAD_MAX - CRYPTO_TAG_LEN - SEQ_LEN - FEC_HEADER_LEN)
             {
                 fprintf(stderr, "line %d: mtu too large\n", line_num);
                 fclose(f);
                 return -1;
             }
         }
+        else if (strcmp(key, "batch") == 0)
+        {
+            conf->batch = atoi(value);
+            if ((conf->batch < 1) || (conf->batch > BATCH_MAX))
+            {
+                fprintf(stderr, "line %d: batch must be 1-%d\n", line_num, BATCH_MAX);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "gso") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->gso = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->gso = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: gso must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "offload") == 0)
+        {
+#ifdef TARGET_LINUX
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->offload = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->offload = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: offload must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+#else
+            fprintf(stderr, "line %d: offload is only supported on Linux\n", line_num);
+            fclose(f);
+            return -1;
+#endif
+        }
+        else if (strcmp(key, "io") == 0)
+        {
+            if (strcmp(value, "poll") == 0)
+            {
+                conf->io = IO_POLL;
+            }
+            else if (strcmp(value, "uring") == 0)
+            {
+#ifdef HAVE_LINUX_IO_URING_H
+                conf->io = IO_URING;
+#else
+                fprintf(stderr, "line %d: io_uring support not compiled in\n", line_num);
+                fclose(f);
+                return -1;
+#endif
+            }
+            else
+            {
+                fprintf(stderr, "line %d: io must be poll/uring\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "xdp") == 0)
+        {
+#ifdef TARGET_LINUX
+            my_strcpy(conf->xdp, value);
+#else
+            fprintf(stderr, "line %d: xdp is only supported on Linux\n", line_num);
+            fclose(f);
+            return -1;
+#endif
+        }
+        else if (strcmp(key, "steer") == 0)
+        {
+#ifdef TARGET_LINUX
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->steer = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->steer = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: steer must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+#else
+            fprintf(stderr, "line %d: steer is only supported on Linux\n", line_num);
+            fclose(f);
+            return -1;
+#endif
+        }
+        else if (strcmp(key, "tproxy") == 0)
+        {
+#ifdef TARGET_LINUX
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->tproxy = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->tproxy = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: tproxy must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+#else
+            fprintf(stderr, "line %d: tproxy is only supported on Linux\n", line_num);
+            fclose(f);
+            return -1;
+#endif
+        }
+        else if (strcmp(key, "hop") == 0)
+        {
+            if (strcmp(value, "rebind") == 0)
+            {
+                conf->hop = HOP_REBIND;
+            }
+            else if (strcmp(value, "reuse") == 0)
+            {
+                conf->hop = HOP_REUSE;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: hop must be rebind/reuse\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "scheduler") == 0)
+        {
+            if (strcmp(value, "rr") == 0)
+            {
+                conf->scheduler = SCHED_RR;
+            }
+            else if (strcmp(value, "minrtt") == 0)
+            {
+                conf->scheduler = SCHED_MINRTT;
+            }
+            else if (strcmp(value, "weighted") == 0)
+            {
+                conf->scheduler = SCHED_WEIGHTED;
+            }
+            else if (strcmp(value, "lowloss") == 0)
+            {
+                conf->scheduler = SCHED_LOWLOSS;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: scheduler must be rr/minrtt/weighted/lowloss\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "cipher") == 0)
+        {
+            if (strcmp(value, "auto") == 0)
+            {
+                conf->cipher = CIPHER_AUTO;
+            }
+            else if (strcmp(value, "chacha20poly1305") == 0)
+            {
+                conf->cipher = CIPHER_CHACHA20POLY1305;
+            }
+            else if (strcmp(value, "aes256gcm") == 0)
+            {
+                conf->cipher = CIPHER_AES256GCM;
+            }
+            else if (strcmp(value, "legacy") == 0)
+            {
+                conf->cipher = CIPHER_LEGACY;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: cipher must be auto/chacha20poly1305/aes256gcm/legacy\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if ((strcmp(key, "obfs") == 0) || (strcmp(key, "obfs_dist") == 0))
+        {
+            // server 之后的 obfs 只作用于这个 server
+            obfs_t *obfs = &conf->obfs;
+            if (conf->path_count > 0)
+            {
+                obfs = &conf->paths[conf->path_count - 1].obfs;
+                if (!conf->paths[conf->path_count - 1].obfs_set)
+                {
+                    *obfs = conf->obfs;
+                    conf->paths[conf->path_count - 1].obfs_set = 1;
+                }
+            }
+            if (strcmp(key, "obfs_dist") == 0)
+            {
+                if (obfs_parse(obfs, value) != 0)
+                {
+                    fprintf(stderr, "line %d: obfs_dist must be size:weight,... with ascending sizes\n", line_num);
+                    fclose(f);
+                    return -1;
+                }
+                obfs->profile = OBFS_DISTRIBUTION;
+            }
+            else if (strcmp(value, "off") == 0)
+            {
+                obfs->profile = OBFS_OFF;
+            }
+            else if (strcmp(value, "bucket") == 0)
+            {
+                obfs->profile = OBFS_BUCKET;
+            }
+            else if (strcmp(value, "random") == 0)
+            {
+                obfs->profile = OBFS_RANDOM;
+            }
+            else if (strcmp(value, "distribution") == 0)
+            {
+                obfs->profile = OBFS_DISTRIBUTION;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: obfs must be off/bucket/random/distribution\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "hc") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->hc = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->hc = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: hc must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "session") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->session = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->session = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: session must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "fec") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->fec = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->fec = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: fec must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "reorder") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->reorder = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->reorder = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: reorder must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "sessions") == 0)
+        {
+            conf->sessions = atoi(value);
+            if ((conf->sessions < 1) || (conf->sessions > SESSION_MAX))
+            {
+                fprintf(stderr, "line %d: sessions must be 1-%d\n", line_num, SESSION_MAX);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "dict") == 0)
+        {
+            my_strcpy(conf->dict, value);
+        }
+        else if (strcmp(key, "legacy") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->legacy = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->legacy = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: legacy must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "hugepages") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+            {
+                conf->hugepages = 1;
+            }
+            else if (strcmp(value, "no") == 0)
+            {
+                conf->hugepages = 0;
+            }
+            else
+            {
+                fprintf(stderr, "line %d: hugepages must be yes/no\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "workers") == 0)
+        {
+#ifdef TARGET_LINUX
+            conf->workers = atoi(value);
+            if ((conf->workers < 1) || (conf->workers > WORKER_MAX))
+            {
+                fprintf(stderr, "line %d: workers must be 1-%d\n", line_num, WORKER_MAX);
+                fclose(f);
+                return -1;
+            }
+#else
+            fprintf(stderr, "line %d: workers is only supported on Linux\n", line_num);
+            fclose(f);
+            return -1;
+#endif
+        }
         else if (strcmp(key, "address") == 0)
         {
             my_strcpy(conf->address, value);
@@ -264,6 +639,9 @@ int parse_args(int argc, char **argv, conf_t *conf)
     const char *conf_file = NULL;
 
     memset(conf, 0, sizeof(conf_t));
+    conf->gso = 1;
+    conf->cipher = CIPHER_AUTO;
+    conf->legacy = 1;
 
     for (int i = 1; i < argc; i++)
     {
@@ -383,6 +761,111 @@ int parse_args(int argc, char **argv, conf_t *conf)
         fprintf(stderr, "mtu not set in config file\n");
         return -1;
     }
+    if (conf->batch == 0)
+    {
+        // offload 和 io_uring 依赖批量收发
+        conf->batch = (conf->offload || (conf->io == IO_URING)) ? BATCH_MAX : 1;
+    }
+    else if ((conf->offload) && (conf->batch == 1))
+    {
+        fprintf(stderr, "offload requires batch > 1\n");
+        return -1;
+    }
+    else if ((conf->io == IO_URING) && (conf->batch == 1))
+    {
+        fprintf(stderr, "io=uring requires batch > 1\n");
+        return -1;
+    }
+    if (conf->workers == 0)
+    {
+        conf->workers = 1;
+    }
+    if ((conf->xdp[0] != '\0') && (conf->mode != MODE_SERVER))
+    {
+        fprintf(stderr, "xdp is only supported in server mode\n");
+        return -1;
+    }
+    if ((conf->steer) && (conf->mode != MODE_SERVER))
+    {
+        fprintf(stderr, "steer is only supported in server mode\n");
+        return -1;
+    }
+    if ((conf->tproxy) && (conf->mode != MODE_SERVER))
+    {
+        fprintf(stderr, "tproxy is only supported in server mode\n");
+        return -1;
+    }
+    if ((conf->tproxy) && (conf->steer))
+    {
+        fprintf(stderr, "tproxy and steer can not be used together\n");
+        return -1;
+    }
+    if ((conf->cipher == CIPHER_LEGACY) && !conf->legacy)
+    {
+        fprintf(stderr, "cipher=legacy needs legacy=yes\n");
+        return -1;
+    }
+    for (int i = 0; i < conf->path_count; i++)
+    {
+        obfs_t *obfs = &conf->paths[i].obfs;
+        if (!conf->paths[i].obfs_set)
+        {
+            *obfs = conf->obfs;
+        }
+        if ((obfs->profile == OBFS_DISTRIBUTION) && (obfs->count == 0))
+        {
+            obfs_parse(obfs, OBFS_DIST_DEFAULT);
+        }
+    }
+    if ((conf->hc) && (conf->workers > 1))
+    {
+        // 上下文在每个 worker 中, 同一个流的包可能由不同的 worker 收到
+        fprintf(stderr, "hc requires workers=1\n");
+        return -1;
+    }
+    if ((conf->hc) && (conf->session))
+    {
+        // 上下文不区分客户端
+        fprintf(stderr, "hc can not be used with session\n");
+        return -1;
+    }
+    if ((conf->reorder) && (conf->workers > 1))
+    {
+        // 序号和重排缓冲区都在 worker 自己的进程里
+        fprintf(stderr, "reorder requires workers=1\n");
+        return -1;
+    }
+    if ((conf->reorder) && (conf->session))
+    {
+        // 每个客户端要有自己的序号
+        fprintf(stderr, "reorder can not be used with session\n");
+        return -1;
+    }
+    if ((conf->fec) && (conf->workers > 1))
+    {
+        // 和 reorder 一样要用序号
+        fprintf(stderr, "fec requires workers=1\n");
+        return -1;
+    }
+    if ((conf->fec) && (conf->session))
+    {
+        fprintf(stderr, "fec can not be used with session\n");
+        return -1;
+    }
+    if ((conf->sessions > 0) && (!conf->session || (conf->mode != MODE_SERVER)))
+    {
+        fprintf(stderr, "sessions needs session=yes in server mode\n");
+        return -1;
+    }
+    if ((conf->session) && (conf->mode == MODE_SERVER) && (conf->sessions == 0))
+    {
+        conf->sessions = SESSION_DEFAULT;
+    }
+    if ((conf->hop == HOP_REUSE) && (conf->mode != MODE_CLIENT))
+    {
+        fprintf(stderr, "hop=reuse is only supported in client mode\n");
+        return -1;
+    }
     if ((conf->address[0] == '\0') && (conf->address6[0] == '\0'))
     {
         fprintf(stderr, "address/address6 not set in config file\n");
@@ -24,9 +24,31 @@
 #  include "config.h"
 #endif
 
+#include "encapsulate.h"
+
 #define MODE_SERVER 1
 #define MODE_CLIENT 2
 #define PATH_MAX_COUNT 8
+#define BATCH_MAX 64
+#define WORKER_MAX 64
+#define SESSION_DEFAULT 4096
+#define SESSION_MAX 65536
+
+#define IO_POLL  0
+#define IO_URING 1
+
+#define CIPHER_LEGACY           0
+#define CIPHER_CHACHA20POLY1305 1
+#define CIPHER_AES256GCM        2
+#define CIPHER_AUTO             3
+
+#define HOP_REBIND 0
+#define HOP_REUSE  1
+
+#define SCHED_RR       0
+#define SCHED_MINRTT   1
+#define SCHED_WEIGHTED 2
+#define SCHED_LOWLOSS  3
 
 typedef struct
 {
@@ -35,12 +57,39 @@ typedef struct
     int mtu;
     int route;
     int nat;
+    int batch;
+    int gso;
+    int offload;
+    int io;
+    int workers;
+    int steer;
+    int tproxy;
+    int hop;
+    int scheduler;
+    int cipher;
+    int legacy;
+    int hc;
+    // 服务器按内层地址区分多个客户端, 客户端在心跳包里带上自己的地址
+    int session;
+    // 服务器会话表的大小
+    int sessions;
+    // 收到的包按发送顺序写入 tun
+    int reorder;
+    // 按丢包率发送校验包, 重建丢失的包
+    int fec;
+    int hugepages;
     char pidfile[64];
     char logfile[64];
     char user[16];
+    char xdp[16];
+    char dict[128];
+    // obfs of paths that do not set their own
+    obfs_t obfs;
     struct {
         char server[64];
         int port[2];
+        obfs_t obfs;
+        int obfs_set;
     } paths[PATH_MAX_COUNT];
     int path_count;
     char key[128];
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include <sodium.h>
 
@@ -30,6 +31,36 @@
 
 static uint8_t key[32];
 
+// 以 key 为密钥的 blake2b 初始状态, 每次只复制, 省去一次密钥块压缩
+static crypto_generichash_blake2b_state mac_state;
+
+// token 对应的一次性密钥, 按 token 直接映射
+#define KEY_CACHE 256
+static struct
+{
+    int token;
+    uint8_t key[32];
+    // v2 使用单独派生的密钥, 不和 v1 的 keystream 重叠
+    uint8_t aead_key[32];
+    crypto_aead_aes256gcm_state aes;
+} keys[KEY_CACHE];
+
+#define HEADER_LEN (offsetof(pbuf_t, payload) - offsetof(pbuf_t, chksum))
+#define AEAD_HEADER_LEN (offsetof(pbuf_t, payload) - offsetof(pbuf_t, ack))
+#define AEAD_START(pbuf) ((uint8_t *)&((pbuf)->ack))
+
+// 发送使用的格式
+static int cipher = CIPHER_CHACHA20POLY1305;
+// 是否接受 v1 格式
+static int legacy = 1;
+static int aes_ok = 0;
+
+// v2 nonce 第一个字节的最低位标明 AEAD 算法, 收到的包只需校验一次 MAC
+#define NONCE_AES 0x01
+
+// AES-GCM 不能只校验不解密, 先解密到这里
+static uint8_t plain[sizeof(((pbuf_t *)0)->payload)];
+
 
 int crypto_init(const void *k)
 {
@@ -37,6 +68,12 @@ int crypto_init(const void *k)
         return -1;
     }
     crypto_generichash_blake2b(key, sizeof(key), k, strlen(k), NULL, 0);
+    crypto_generichash_blake2b_init(&mac_state, key, sizeof(key), 16);
+    for (int i = 0; i < KEY_CACHE; i++)
+    {
+        keys[i].token = -1;
+    }
+    aes_ok = crypto_aead_aes256gcm_is_available();
     randombytes_set_implementation(&randombytes_salsa20_implementation);
     randombytes_stir();
     return 0;
@@ -45,70 +82,379 @@ int crypto_init(const void *k)
 
 void hmac(void *out, const void *in, size_t inlen)
 {
-    crypto_generichash_blake2b(out, 16, in, inlen, key, sizeof(key));
+    crypto_generichash_blake2b_state state = mac_state;
+    crypto_generichash_blake2b_update(&state, in, inlen);
+    crypto_generichash_blake2b_final(&state, out, 16);
 }
 
 
-static void crypto_hmac(pbuf_t *pbuf)
+static uint32_t crypto_hmac(const uint8_t *payload, int len)
 {
     uint8_t mac[16];
-    crypto_generichash_blake2b(mac, sizeof(mac), pbuf->payload, pbuf->len, key, sizeof(key));
-    memcpy(&(pbuf->chksum), mac, sizeof(pbuf->chksum));
+    uint32_t chksum;
+    hmac(mac, payload, len);
+    memcpy(&chksum, mac, sizeof(chksum));
+    return chksum;
 }
 
 
-void crypto_encrypt(int token, pbuf_t *pbuf)
+// 派生 token 的一次性密钥, 返回缓存下标
+static int key_slot(int token)
 {
+    int i = token % KEY_CACHE;
+    if (keys[i].token != token)
+    {
+        uint8_t factor[3] = { token & 0xffu, (token >> 8) & 0xffu, 2 };
+        crypto_generichash_blake2b(keys[i].key, sizeof(keys[i].key), key, sizeof(key),
+                                   factor, 2);
+        crypto_generichash_blake2b(keys[i].aead_key, sizeof(keys[i].aead_key), key, sizeof(key),
+                                   factor, sizeof(factor));
+        if (aes_ok)
+        {
+            crypto_aead_aes256gcm_beforenm(&keys[i].aes, keys[i].aead_key);
+        }
+        keys[i].token = token;
+    }
+    return i;
+}
+
+
+void crypto_prepare(const int *tokens, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        key_slot(tokens[i]);
+    }
+}
+
+
+// 头部原地加解密, payload 从 src 写到 dst, keystream 只生成一遍
+static void stream_xor(pbuf_t *pbuf, uint8_t *dst, const uint8_t *src, size_t len,
+                       const uint8_t *k)
+{
+    uint8_t block[64];
+    size_t n = (len < sizeof(block) - HEADER_LEN) ? len : sizeof(block) - HEADER_LEN;
+    memcpy(block, CRYPTO_START(pbuf), HEADER_LEN);
+    memcpy(block + HEADER_LEN, src, n);
+    crypto_stream_chacha20_xor_ic(block, block, HEADER_LEN + n, pbuf->nonce, 0, k);
+    memcpy(CRYPTO_START(pbuf), block, HEADER_LEN);
+    memcpy(dst, block + HEADER_LEN, n);
+    if (len > n)
+    {
+        crypto_stream_chacha20_xor_ic(dst + n, src + n, len - n, pbuf->nonce, 1, k);
+    }
+}
+
+
+// v1: chacha20 + 截断到 4 字节的 blake2b
+static int legacy_encrypt(int slot, pbuf_t *pbuf, const uint8_t *payload)
+{
+    const uint8_t *k = keys[slot].key;
+
     // fill nonce
     randombytes_buf(pbuf->nonce, sizeof(pbuf->nonce));
 
     // calc hash
-    crypto_hmac(pbuf);
+    pbuf->chksum = crypto_hmac(payload, pbuf->len);
 
-    int len = CRYPTO_LEN(pbuf);
+    int len = pbuf->len + pbuf->padding;
 
     pbuf->flag = htons(pbuf->flag);
     pbuf->len = htons(pbuf->len);
 
-    uint8_t onetimekey[32];
-    uint8_t factor[2] = { token & 0xffu, (token >> 8) & 0xffu };
-    crypto_generichash_blake2b(onetimekey, sizeof(onetimekey), key, sizeof(key), factor, sizeof(factor));
-
     // encrypt
-    crypto_stream_chacha20_xor(
-        (void *)CRYPTO_START(pbuf),
-        (void *)CRYPTO_START(pbuf),
-        len,
-        pbuf->nonce,
-        onetimekey);
+    if (payload == pbuf->payload)
+    {
+        crypto_stream_chacha20_xor(
+            (void *)CRYPTO_START(pbuf),
+            (void *)CRYPTO_START(pbuf),
+            HEADER_LEN + len,
+            pbuf->nonce,
+            k);
+    }
+    else
+    {
+        // 加密时直接从压缩缓冲区写回 pbuf, 省去一次拷贝
+        stream_xor(pbuf, pbuf->payload, payload, len, k);
+    }
+    return PAYLOAD_OFFSET + len;
 }
 
 
-int crypto_decrypt(int token, pbuf_t *pbuf, size_t len)
+// 只处理 payload 部分的 keystream, 用于校验失败后把 pbuf 还原成密文
+static void payload_xor(uint8_t *buf, size_t len, const uint8_t *nonce, const uint8_t *k)
 {
-    uint8_t onetimekey[32];
-    uint8_t factor[2] = { token & 0xff, (token >> 8) & 0xff };
-    crypto_generichash_blake2b(onetimekey, sizeof(onetimekey), key, sizeof(key), factor, sizeof(factor));
+    uint8_t block[64];
+    size_t n = (len < sizeof(block) - HEADER_LEN) ? len : sizeof(block) - HEADER_LEN;
+    memset(block, 0, HEADER_LEN);
+    memcpy(block + HEADER_LEN, buf, n);
+    crypto_stream_chacha20_xor_ic(block, block, HEADER_LEN + n, nonce, 0, k);
+    memcpy(buf, block + HEADER_LEN, n);
+    if (len > n)
+    {
+        crypto_stream_chacha20_xor_ic(buf + n, buf + n, len - n, nonce, 1, k);
+    }
+}
+
 
-    // decrypt
-    crypto_stream_chacha20_xor(
-        (void *)CRYPTO_START(pbuf),
-        (void *)CRYPTO_START(pbuf),
-        len - CRYPTO_NONCE_LEN,
-        pbuf->nonce,
-        onetimekey);
+// 失败时还原 pbuf, 可以接着尝试其他格式
+static int legacy_decrypt(int slot, pbuf_t *pbuf, size_t len, uint8_t *compressed)
+{
+    const uint8_t *k = keys[slot].key;
+    uint8_t saved[HEADER_LEN];
+    memcpy(saved, CRYPTO_START(pbuf), HEADER_LEN);
+
+    // decrypt header and the rest of the first block
+    uint8_t block[64];
+    size_t n = len - PAYLOAD_OFFSET;
+    n = (n < sizeof(block) - HEADER_LEN) ? n : sizeof(block) - HEADER_LEN;
+    memcpy(block, CRYPTO_START(pbuf), HEADER_LEN + n);
+    crypto_stream_chacha20_xor_ic(block, block, HEADER_LEN + n, pbuf->nonce, 0, k);
+    memcpy(CRYPTO_START(pbuf), block, HEADER_LEN);
 
     pbuf->flag = ntohs(pbuf->flag);
     pbuf->len = ntohs(pbuf->len);
 
-    // check pbuf->len
-    if (pbuf->len > sizeof(pbuf->payload))
+    // check pbuf->len and flag, 随机数据在这里就被丢弃, 不用解密整个包
+    if ((pbuf->len > sizeof(pbuf->payload)) || (pbuf->len > len - PAYLOAD_OFFSET)
+        || (pbuf->flag & ~FLAG_MASK))
     {
+        memcpy(CRYPTO_START(pbuf), saved, HEADER_LEN);
         return -1;
     }
 
+    // decrypt payload, 压缩过的数据直接解密到 compressed, 解压时写回 pbuf
+    uint8_t *payload = pbuf->payload;
+    if ((compressed != NULL) && (pbuf->flag & FLAG_COMPRESS))
+    {
+        payload = compressed;
+    }
+    n = (pbuf->len < n) ? pbuf->len : n;
+    memcpy(payload, block + HEADER_LEN, n);
+    if (pbuf->len > n)
+    {
+        crypto_stream_chacha20_xor_ic(payload + n, pbuf->payload + n, pbuf->len - n,
+                                      pbuf->nonce, 1, k);
+    }
+
     // check if chksum is valid
-    uint32_t chksum = pbuf->chksum;
-    crypto_hmac(pbuf);
-    return (chksum == pbuf->chksum) ? 0 : -1;
+    if (pbuf->chksum != crypto_hmac(payload, pbuf->len))
+    {
+        if (payload == pbuf->payload)
+        {
+            payload_xor(pbuf->payload, pbuf->len, pbuf->nonce, k);
+        }
+        memcpy(CRYPTO_START(pbuf), saved, HEADER_LEN);
+        return -1;
+    }
+    return 0;
+}
+
+
+// v2: nonce 和 chksum 两个字段合成 12 字节 nonce, 从 ack 开始整体 AEAD 加密,
+// tag 附在 padding 之后
+static int aead_encrypt(int slot, int c, pbuf_t *pbuf, const uint8_t *payload)
+{
+    randombytes_buf(pbuf->nonce, crypto_aead_chacha20poly1305_ietf_NPUBBYTES);
+    pbuf->nonce[0] = (uint8_t)((pbuf->nonce[0] & ~NONCE_AES) | ((c == CIPHER_AES256GCM) ? NONCE_AES : 0));
+
+    // 压缩过的包不加 padding, 拷贝的数据比原包少
+    if (payload != pbuf->payload)
+    {
+        memcpy(pbuf->payload, payload, pbuf->len);
+    }
+
+    int len = pbuf->len + pbuf->padding;
+
+    pbuf->flag = htons(pbuf->flag);
+    pbuf->len = htons(pbuf->len);
+
+    uint8_t *m = AEAD_START(pbuf);
+    uint8_t *mac = pbuf->payload + len;
+    if (c == CIPHER_AES256GCM)
+    {
+        crypto_aead_aes256gcm_encrypt_detached_afternm(m, mac, NULL, m, AEAD_HEADER_LEN + len,
+                                                       NULL, 0, NULL, pbuf->nonce, &keys[slot].aes);
+    }
+    else
+    {
+        crypto_aead_chacha20poly1305_ietf_encrypt_detached(m, mac, NULL, m, AEAD_HEADER_LEN + len,
+                                                           NULL, 0, NULL, pbuf->nonce,
+                                                           keys[slot].aead_key);
+    }
+    return PAYLOAD_OFFSET + len + CRYPTO_TAG_LEN;
+}
+
+
+// 校验失败时不修改 pbuf, 可以接着尝试其他格式
+static int aead_decrypt(int slot, int c, pbuf_t *pbuf, size_t len, uint8_t *compressed)
+{
+    if (len < (size_t)(PAYLOAD_OFFSET + CRYPTO_TAG_LEN))
+    {
+        return -1;
+    }
+    size_t clen = len - (PAYLOAD_OFFSET + CRYPTO_TAG_LEN) + AEAD_HEADER_LEN;
+    if (clen > sizeof(plain))
+    {
+        return -1;
+    }
+    uint8_t *m = AEAD_START(pbuf);
+    const uint8_t *mac = m + clen;
+
+    uint8_t block[64];
+    size_t n = (clen < sizeof(block)) ? clen : sizeof(block);
+    const uint8_t *src;
+    if (c == CIPHER_AES256GCM)
+    {
+        if (!aes_ok || (crypto_aead_aes256gcm_decrypt_detached_afternm(
+                            plain, NULL, m, clen, mac, NULL, 0, pbuf->nonce, &keys[slot].aes) != 0))
+        {
+            return -1;
+        }
+        memcpy(block, plain, n);
+        src = plain;
+    }
+    else
+    {
+        // 只校验, 通过后再解密 (和 libsodium 内部的顺序一样)
+        const uint8_t *k = keys[slot].aead_key;
+        if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(
+                NULL, NULL, m, clen, mac, NULL, 0, pbuf->nonce, k) != 0)
+        {
+            return -1;
+        }
+        crypto_stream_chacha20_ietf_xor_ic(block, m, n, pbuf->nonce, 1, k);
+        src = NULL;
+    }
+
+    memcpy(m, block, AEAD_HEADER_LEN);
+    pbuf->flag = ntohs(pbuf->flag);
+    pbuf->len = ntohs(pbuf->len);
+    if (pbuf->len > clen - AEAD_HEADER_LEN)
+    {
+        return -1;
+    }
+
+    // 压缩过的数据直接解密到 compressed
+    uint8_t *payload = pbuf->payload;
+    if ((compressed != NULL) && (pbuf->flag & FLAG_COMPRESS))
+    {
+        payload = compressed;
+    }
+    n = n - AEAD_HEADER_LEN;
+    n = (pbuf->len < n) ? pbuf->len : n;
+    memcpy(payload, block + AEAD_HEADER_LEN, n);
+    if (pbuf->len > n)
+    {
+        if (src != NULL)
+        {
+            memcpy(payload + n, src + AEAD_HEADER_LEN + n, pbuf->len - n);
+        }
+        else
+        {
+            // keystream block 1 是 block 0 之后的第一个 64 字节
+            crypto_stream_chacha20_ietf_xor_ic(payload + n, pbuf->payload + n, pbuf->len - n,
+                                               pbuf->nonce, 2, keys[slot].aead_key);
+        }
+    }
+    return 0;
+}
+
+
+int crypto_encrypt(int token, int c, pbuf_t *pbuf, const uint8_t *payload)
+{
+    int slot = key_slot(token);
+    if ((c == CIPHER_AUTO) || ((c == CIPHER_AES256GCM) && !aes_ok))
+    {
+        c = cipher;
+    }
+    if (c == CIPHER_LEGACY)
+    {
+        return legacy_encrypt(slot, pbuf, payload);
+    }
+    return aead_encrypt(slot, c, pbuf, payload);
+}
+
+
+int crypto_decrypt(int token, pbuf_t *pbuf, size_t len, uint8_t *compressed)
+{
+    if (len < (size_t)PAYLOAD_OFFSET)
+    {
+        return -1;
+    }
+    int slot = key_slot(token);
+
+    // v1 没有版本字段, 按 nonce 里的标记试一次 v2, 再试 v1. 两者的对端可以同时存在;
+    // 伪造的包只花一次 MAC 和一个 block 的 v1 解密 (长度和 flag 不对就丢弃).
+    // 失败时 pbuf 不变, 先试自己发送的格式
+    int aead = (pbuf->nonce[0] & NONCE_AES) ? CIPHER_AES256GCM : CIPHER_CHACHA20POLY1305;
+    for (int i = 0; i < 2; i++)
+    {
+        int v1 = (i == 0) == (cipher == CIPHER_LEGACY);
+        if (v1 && legacy && (legacy_decrypt(slot, pbuf, len, compressed) == 0))
+        {
+            pbuf->cipher = CIPHER_LEGACY;
+            return 0;
+        }
+        if (!v1 && (aead_decrypt(slot, aead, pbuf, len, compressed) == 0))
+        {
+            pbuf->cipher = aead;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+static int64_t bench(int c)
+{
+    static pbuf_t pbuf;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 2000; i++)
+    {
+        pbuf.len = 1400;
+        pbuf.flag = 0;
+        pbuf.padding = 0;
+        crypto_encrypt(0, c, &pbuf, pbuf.payload);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+}
+
+
+int crypto_setup(int c, int accept_legacy)
+{
+    if ((c == CIPHER_AES256GCM) && !aes_ok)
+    {
+        return -1;
+    }
+    if (c == CIPHER_AUTO)
+    {
+        // 没有 AES-NI 时只能用 chacha20, 否则两者都测一下
+        c = CIPHER_CHACHA20POLY1305;
+        if (aes_ok && (bench(CIPHER_AES256GCM) < bench(CIPHER_CHACHA20POLY1305)))
+        {
+            c = CIPHER_AES256GCM;
+        }
+    }
+    cipher = c;
+    legacy = accept_legacy;
+    return c;
+}
+
+
+const char *crypto_name(int c)
+{
+    switch (c)
+    {
+    case CIPHER_LEGACY:
+        return "legacy";
+    case CIPHER_CHACHA20POLY1305:
+        return "chacha20poly1305";
+    case CIPHER_AES256GCM:
+        return "aes256gcm";
+    default:
+        return "auto";
+    }
 }
@@ -21,13 +21,25 @@
 #define CRYPTO_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "encapsulate.h"
 
 
 extern int crypto_init(const void *psk);
+// choose the default format of sent packets (CIPHER_*) and whether v1 packets
+// are accepted. return the chosen cipher, -1 if it is not available
+extern int crypto_setup(int cipher, int legacy);
+extern const char *crypto_name(int cipher);
 extern void hmac(void *out, const void *in, size_t inlen);
-extern void crypto_encrypt(int token, pbuf_t *pbuf);
-extern int  crypto_decrypt(int token, pbuf_t *pbuf, size_t len);
+// derive one-time keys of the valid token window ahead of the packets
+extern void crypto_prepare(const int *tokens, int count);
+// payload: pbuf->payload, or a separate buffer holding pbuf->len bytes
+// cipher: format of the peer (pbuf->cipher of its packets), CIPHER_AUTO for
+// the default. return length on the wire
+extern int  crypto_encrypt(int token, int cipher, pbuf_t *pbuf, const uint8_t *payload);
+// compressed payload is decrypted into compressed if not NULL,
+// the format of the packet is stored in pbuf->cipher
+extern int  crypto_decrypt(int token, pbuf_t *pbuf, size_t len, uint8_t *compressed);
 
 
 #endif // CRYPTO_H
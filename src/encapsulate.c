@@ -20,6 +20,8 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <sodium.h>
@@ -27,66 +29,203 @@
 #include "compress.h"
 #include "crypto.h"
 #include "encapsulate.h"
+#include "hc.h"
+
+// 压缩结果, 加密时直接写回 pbuf; 解密时压缩数据先解密到这里
+static uint8_t scratch[sizeof(((pbuf_t *)0)->payload)];
+// 头部压缩结果
+static uint8_t headers[sizeof(((pbuf_t *)0)->payload) + HC_OVERHEAD];
+
+// padding 长度用的随机数, 批量生成, 每个包只取 4 字节
+static uint8_t rand_pool[256];
+static int rand_left;
+
+static uint32_t rand_below(uint32_t n)
+{
+    if (rand_left < 4)
+    {
+        randombytes_buf(rand_pool, sizeof(rand_pool));
+        rand_left = sizeof(rand_pool);
+    }
+    rand_left -= 4;
+    uint32_t r;
+    memcpy(&r, rand_pool + rand_left, 4);
+    return (uint32_t)(((uint64_t)r * n) >> 32);
+}
+
+
+int obfs_parse(obfs_t *obfs, const char *dist)
+{
+    int count = 0;
+    uint32_t total = 0;
+    const char *p = dist;
+    while (*p != '\0')
+    {
+        char *end;
+        long size = strtol(p, &end, 10);
+        if ((end == p) || (*end != ':') || (size < 1) || (size > PAYLOAD_MAX)
+            || ((count > 0) && (size <= obfs->sizes[count - 1])) || (count >= OBFS_DIST_MAX))
+        {
+            return -1;
+        }
+        p = end + 1;
+        long weight = strtol(p, &end, 10);
+        if ((end == p) || ((*end != ',') && (*end != '\0')) || (weight < 1) || (weight > 1000000))
+        {
+            return -1;
+        }
+        total += (uint32_t)weight;
+        obfs->sizes[count] = (int)size;
+        obfs->weights[count] = total;
+        count++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    if (count == 0)
+    {
+        return -1;
+    }
+    obfs->count = count;
+    return 0;
+}
+
+
+// 在不小于 len 的尺寸中按权重抽取
+static int sample(const obfs_t *obfs, int len)
+{
+    int i = 0;
+    while ((i < obfs->count) && (obfs->sizes[i] < len))
+    {
+        i++;
+    }
+    if (i == obfs->count)
+    {
+        return len;
+    }
+    uint32_t base = (i > 0) ? obfs->weights[i - 1] : 0;
+    uint32_t r = base + rand_below(obfs->weights[obfs->count - 1] - base);
+    while (obfs->weights[i] <= r)
+    {
+        i++;
+    }
+    return obfs->sizes[i];
+}
 
 
 // naïve obfuscation
-static void obfuscate(pbuf_t *pbuf, int mtu)
+static void obfuscate(pbuf_t *pbuf, int mtu, const obfs_t *obfs)
 {
     assert(pbuf != NULL);
 
-    // random padding
-    if (pbuf->len < mtu)
+    int len = pbuf->len;
+    int target = len;
+    int profile = (obfs != NULL) ? obfs->profile : OBFS_RANDOM;
+    if (profile == OBFS_BUCKET)
+    {
+        // 心跳包也补到第一档
+        target = (len > 0) ? (len + OBFS_BUCKET_SIZE - 1) / OBFS_BUCKET_SIZE * OBFS_BUCKET_SIZE
+                 : OBFS_BUCKET_SIZE;
+    }
+    else if (profile == OBFS_DISTRIBUTION)
+    {
+        target = sample(obfs, len);
+    }
+    else if ((profile == OBFS_RANDOM) && (len < mtu))
     {
-        int max = mtu - pbuf->len;
+        // random padding
+        int max = mtu - len;
         if (max > 897)
         {
-            pbuf->padding = randombytes_uniform(554);
+            target = len + (int)rand_below(554);
         }
         else if (max > 554)
         {
-            pbuf->padding = randombytes_uniform(342);
+            target = len + (int)rand_below(342);
         }
         else if (max > 342)
         {
-            pbuf->padding = randombytes_uniform(211);
+            target = len + (int)rand_below(211);
         }
         else
         {
-            pbuf->padding = randombytes_uniform(130);
-            if (pbuf->padding > max)
-            {
-                pbuf->padding = max;
-            }
+            target = len + (int)rand_below(130);
         }
-        randombytes_buf(pbuf->payload + pbuf->len, pbuf->padding);
     }
-    else
+    if (target > mtu)
     {
-        pbuf->padding = 0;
+        target = mtu;
     }
+    pbuf->padding = (target > len) ? target - len : 0;
 }
 
 
 // 封装
-int encapsulate(int token, pbuf_t *pbuf, int mtu)
+int encapsulate(int token, int cipher, pbuf_t *pbuf, int mtu, const obfs_t *obfs)
 {
     assert(pbuf != NULL);
 
+    // 头部压缩
+    uint8_t *payload = pbuf->payload;
+    int len = hc_compress(pbuf->payload, pbuf->len, headers, mtu);
+    if (len > 0)
+    {
+        payload = headers;
+        pbuf->flag |= FLAG_HC;
+    }
+    else
+    {
+        len = pbuf->len;
+    }
+
     // 压缩
-    compress(pbuf);
+    int clen = compress(payload, len, scratch, pbuf->payload, pbuf->len);
+    if (clen > 0)
+    {
+        len = clen;
+        pbuf->flag |= FLAG_COMPRESS;
+        if (compress_dict_loaded())
+        {
+            pbuf->flag |= FLAG_DICT;
+        }
+        payload = scratch;
+    }
 
-    // 混淆
+    // 序号接在 payload 之后, 一起加密
+    if (pbuf->flag & FLAG_SEQ)
+    {
+        payload[len] = (uint8_t)(pbuf->seq >> 24);
+        payload[len + 1] = (uint8_t)(pbuf->seq >> 16);
+        payload[len + 2] = (uint8_t)(pbuf->seq >> 8);
+        payload[len + 3] = (uint8_t)pbuf->seq;
+        len += SEQ_LEN;
+    }
+    // 头部压缩的反馈可以搭任何包, 包括心跳
+    int fb_len = hc_feedback(payload + len, mtu - len);
+    if (fb_len > 0)
+    {
+        len += fb_len;
+        pbuf->flag |= FLAG_HC_FEEDBACK;
+    }
+    pbuf->len = (uint16_t)len;
+
+    // 混淆, random 不处理压缩过的包
     pbuf->padding = 0;
-    if (!(pbuf->flag & FLAG_COMPRESS))
+    if (!(pbuf->flag & FLAG_COMPRESS) || ((obfs != NULL) && (obfs->profile != OBFS_RANDOM)))
     {
-        obfuscate(pbuf, mtu);
+        obfuscate(pbuf, mtu, obfs);
+    }
+    if (pbuf->padding > 0)
+    {
+        // padding 会被加密, 填 0 即可; 不能带出缓冲区里之前的数据
+        if (payload != pbuf->payload)
+        {
+            memcpy(pbuf->payload, payload, pbuf->len);
+            payload = pbuf->payload;
+        }
+        memset(pbuf->payload + pbuf->len, 0, pbuf->padding);
     }
 
     // 加密
-    ssize_t n = PAYLOAD_OFFSET + pbuf->len + pbuf->padding;
-    crypto_encrypt(token, pbuf);
-
-    return (int)n;
+    return crypto_encrypt(token, cipher, pbuf, payload);
 }
 
 
@@ -96,36 +235,77 @@ int decapsulate(int token, pbuf_t *pbuf, int n)
     assert(pbuf != NULL);
 
     // 解密
-    int invalid = crypto_decrypt(token, pbuf, n);
+    int invalid = crypto_decrypt(token, pbuf, n, scratch);
     if (invalid)
     {
         return -1;
     }
 
+    if (pbuf->len > sizeof(pbuf->payload))
+    {
+        // 忽略错误的长度
+        return -1;
+    }
+
+    // 最后是头部压缩的反馈
+    if (pbuf->flag & FLAG_HC_FEEDBACK)
+    {
+        int fb_len = hc_feedback_input((pbuf->flag & FLAG_COMPRESS) ? scratch : pbuf->payload,
+                                       pbuf->len);
+        if (fb_len < 0)
+        {
+            return -1;
+        }
+        pbuf->len -= (uint16_t)fb_len;
+    }
+
     if (pbuf->len == 0)
     {
         // 忽略心跳包
         return 0;
     }
-    else if (pbuf->len > sizeof(pbuf->payload))
+
+    // 取出序号, 压缩数据在 scratch 里
+    if (pbuf->flag & FLAG_SEQ)
     {
-        // 忽略错误的长度
-        return -1;
+        if (pbuf->len < SEQ_LEN)
+        {
+            return -1;
+        }
+        pbuf->len -= SEQ_LEN;
+        const uint8_t *p = ((pbuf->flag & FLAG_COMPRESS) ? scratch : pbuf->payload) + pbuf->len;
+        pbuf->seq = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
     }
 
     // 解压缩
-    decompress(pbuf);
+    if (pbuf->flag & FLAG_COMPRESS)
+    {
+        int len = decompress(scratch, pbuf->len, pbuf->payload, sizeof(pbuf->payload),
+                             pbuf->flag & FLAG_DICT);
+        if (len < 0)
+        {
+            return -1;
+        }
+        pbuf->len = (uint16_t)len;
+    }
 
-    // 忽略 ack 包
-    if (pbuf->flag & 0x0002)
+    // 恢复头部
+    if (pbuf->flag & FLAG_HC)
     {
-        return 0;
+        int len = hc_decompress(pbuf->payload, pbuf->len, sizeof(pbuf->payload));
+        if (len < 0)
+        {
+            return -1;
+        }
+        pbuf->len = (uint16_t)len;
     }
 
-    if (pbuf->flag & 0x0001)
+    // 忽略 ack 包
+    if (pbuf->flag & 0x0002)
     {
-        // 暂不处理 ack flag
+        return 0;
     }
 
+    // FLAG_TS 和 FLAG_ECHO 的 ack 字段由调用者处理
     return (int)(pbuf->len);
 }
@@ -31,6 +31,25 @@
 
  Flag
    bit0 - compress
+   bit1 - ack
+   bit2 - compressed with the shared dictionary
+   bit3 - inner headers compressed, see hc.h
+   bit4 - heartbeat carrying the inner addresses of the client, see session.h
+   bit5 - ACK is the send time, echo it, see probe.h
+   bit6 - echo, ACK is the send time of a probe
+   bit7 - a 4 byte sequence number follows the payload, see reorder.h
+   bit8 - parity of a group of numbered packets, see fec.h
+   bit9 - header compression feedback follows the sequence number, see hc.h
+
+ v1: CHKSUM is a truncated BLAKE2b of the payload, everything after Nonce
+     is encrypted with ChaCha20.
+
+ v2: Nonce and CHKSUM together are the 12 byte nonce of an AEAD
+     (ChaCha20-Poly1305 or AES-256-GCM), which encrypts everything from ACK
+     to Padding and appends a 16 byte tag. The lowest bit of the first Nonce
+     byte is 1 for AES-256-GCM, 0 for ChaCha20-Poly1305. There is no version
+     field, the receiver tries v2 with that cipher and v1, so every peer can
+     use its own format.
 
 */
 typedef struct
@@ -43,6 +62,10 @@ typedef struct
     uint8_t  payload[2048];
     // not send to network
     int padding;
+    // sequence number of FLAG_SEQ
+    uint32_t seq;
+    // format of a decapsulated packet, CIPHER_*
+    int cipher;
 } pbuf_t;
 
 #define PAYLOAD_OFFSET ((int)(offsetof(pbuf_t, payload)))
@@ -50,10 +73,52 @@ typedef struct
 #define CRYPTO_START(pbuf) (&((pbuf)->chksum))
 #define CRYPTO_LEN(pbuf) (offsetof(pbuf_t, payload) - offsetof(pbuf_t, chksum) + (pbuf)->len + (pbuf)->padding)
 #define CRYPTO_NONCE_LEN ((int)(offsetof(pbuf_t, chksum) - offsetof(pbuf_t, nonce)))
+// authentication tag appended by v2
+#define CRYPTO_TAG_LEN 16
+// sequence number appended by FLAG_SEQ
+#define SEQ_LEN 4
 
 #define FLAG_COMPRESS 0x01
+#define FLAG_ACK      0x02
+// compressed with the shared dictionary
+#define FLAG_DICT     0x04
+#define FLAG_HC       0x08
+#define FLAG_IDENT    0x10
+#define FLAG_TS       0x20
+#define FLAG_ECHO     0x40
+#define FLAG_SEQ      0x80
+#define FLAG_FEC      0x100
+#define FLAG_HC_FEEDBACK 0x200
+// flags a valid packet may carry, anything else is rejected before the MAC
+#define FLAG_MASK     (FLAG_COMPRESS | FLAG_ACK | FLAG_DICT | FLAG_HC | FLAG_IDENT \
+                       | FLAG_TS | FLAG_ECHO | FLAG_SEQ | FLAG_FEC | FLAG_HC_FEEDBACK)
+
+// obfuscation profiles, how much padding uncompressed packets get
+#define OBFS_RANDOM       0
+#define OBFS_OFF          1
+#define OBFS_BUCKET       2
+#define OBFS_DISTRIBUTION 3
+// bucket: payload + padding rounded up to a multiple of this
+#define OBFS_BUCKET_SIZE  128
+#define OBFS_DIST_MAX     16
+// sizes of web traffic: mostly small packets and full ones
+#define OBFS_DIST_DEFAULT "100:30,300:10,600:10,1000:10,1400:40"
+
+typedef struct
+{
+    int profile;
+    // distribution: sizes of payload + padding, ascending, and cumulative weights
+    int count;
+    int sizes[OBFS_DIST_MAX];
+    uint32_t weights[OBFS_DIST_MAX];
+} obfs_t;
+
+// parse "size:weight,size:weight,...", return -1 if invalid
+extern int obfs_parse(obfs_t *obfs, const char *dist);
 
-extern int encapsulate(int token, pbuf_t *pbuf, int mtu);
+// obfs NULL: OBFS_RANDOM
+// cipher: format of the peer, CIPHER_AUTO for the configured one
+extern int encapsulate(int token, int cipher, pbuf_t *pbuf, int mtu, const obfs_t *obfs);
 extern int decapsulate(int token, pbuf_t *pbuf, int n);
 
 #endif
@@ -0,0 +1,367 @@
+/*
+ * fec.c - rebuild lost packets from parity packets
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encapsulate.h"
+#include "fec.h"
+
+static void (*output)(const uint8_t *pkt, int len, uint32_t seq);
+static int mtu;
+static int group;
+
+// 发送端正在累积的组
+static struct
+{
+    uint8_t *xor;
+    // 最长的包
+    int len;
+    uint16_t lens;
+    uint32_t first;
+    int count;
+    int64_t start;
+} tx;
+// 序号不连续时提前结束的组, 下次 fec_parity 先发送它
+static pbuf_t closed;
+static int closed_ready;
+
+// 接收端最近的包, 按序号存放
+static struct
+{
+    uint32_t seq;
+    int len;
+} rx[FEC_SLOTS];
+static uint8_t *rx_bufs;
+// 收到过的最大序号 + 1, 比它小 FEC_SLOTS 以上的包已经移出了窗口
+static uint32_t rx_next;
+
+// 还在等数据包的校验包, 按组的第一个序号存放, count 为 0 表示空
+static struct
+{
+    uint32_t first;
+    int count;
+    int len;
+    uint16_t lens;
+} parities[FEC_SLOTS];
+static uint8_t *parity_bufs;
+// 收到过的最大的组
+static int rx_group;
+
+static fec_stat_t stat;
+
+
+// 简单的循环, -O3 时编译器会向量化
+static void xor(uint8_t *restrict dst, const uint8_t *restrict src, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+
+int fec_init(int size, void (*fn)(const uint8_t *pkt, int len, uint32_t seq))
+{
+    free(tx.xor);
+    free(rx_bufs);
+    free(parity_bufs);
+    tx.xor = (uint8_t *)calloc((size_t)size, 1);
+    rx_bufs = (uint8_t *)malloc((size_t)size * FEC_SLOTS);
+    parity_bufs = (uint8_t *)malloc((size_t)size * FEC_SLOTS);
+    if ((tx.xor == NULL) || (rx_bufs == NULL) || (parity_bufs == NULL))
+    {
+        return -1;
+    }
+    mtu = size;
+    output = fn;
+    group = 0;
+    tx.len = 0;
+    tx.lens = 0;
+    tx.count = 0;
+    closed_ready = 0;
+    memset(rx, 0, sizeof(rx));
+    rx_next = 0;
+    memset(parities, 0, sizeof(parities));
+    rx_group = 0;
+    memset(&stat, 0, sizeof(stat));
+    return 0;
+}
+
+
+void fec_tune(int loss)
+{
+    if (loss < FEC_LOSS_MIN)
+    {
+        group = 0;
+        return;
+    }
+    group = 250 / loss;
+    if (group < FEC_GROUP_MIN)
+    {
+        group = FEC_GROUP_MIN;
+    }
+    else if (group > FEC_GROUP_MAX)
+    {
+        group = FEC_GROUP_MAX;
+    }
+}
+
+
+// 生成当前组的校验包, 结束这一组
+static void close_group(pbuf_t *pbuf)
+{
+    pbuf->payload[0] = (uint8_t)tx.count;
+    pbuf->payload[1] = 0;
+    pbuf->payload[2] = (uint8_t)(tx.lens >> 8);
+    pbuf->payload[3] = (uint8_t)tx.lens;
+    memcpy(pbuf->payload + FEC_HEADER_LEN, tx.xor, tx.len);
+    pbuf->len = (uint16_t)(FEC_HEADER_LEN + tx.len);
+    pbuf->flag = FLAG_FEC | FLAG_SEQ;
+    pbuf->ack = 0;
+    pbuf->seq = tx.first;
+
+    memset(tx.xor, 0, tx.len);
+    tx.len = 0;
+    tx.lens = 0;
+    tx.count = 0;
+}
+
+
+int fec_encode(const uint8_t *pkt, int len, uint32_t seq, int64_t t)
+{
+    int due = 0;
+    if ((tx.count > 0) && (seq != tx.first + (uint32_t)tx.count))
+    {
+        // 有包没有加入这一组 (比如刚关闭了 FEC), 先结束它, 这个包开始新的一组;
+        // 调用者每次都取走校验包, 这里不会有还没发出去的组
+        close_group(&closed);
+        closed_ready = 1;
+        due = 1;
+    }
+    if ((group == 0) || (len > mtu))
+    {
+        return due;
+    }
+    if (tx.count == 0)
+    {
+        tx.first = seq;
+        tx.start = t;
+    }
+    xor(tx.xor, pkt, len);
+    if (len > tx.len)
+    {
+        tx.len = len;
+    }
+    tx.lens ^= (uint16_t)len;
+    tx.count++;
+    return due || (tx.count >= group);
+}
+
+
+int fec_due(int64_t t)
+{
+    return closed_ready || ((tx.count > 0) && (t - tx.start >= FEC_DELAY));
+}
+
+
+int fec_parity(pbuf_t *pbuf)
+{
+    if (closed_ready)
+    {
+        memcpy(pbuf->payload, closed.payload, closed.len);
+        pbuf->len = closed.len;
+        pbuf->flag = closed.flag;
+        pbuf->ack = closed.ack;
+        pbuf->seq = closed.seq;
+        closed_ready = 0;
+    }
+    else if (tx.count > 0)
+    {
+        close_group(pbuf);
+    }
+    else
+    {
+        return 0;
+    }
+    stat.parity_sent++;
+    return 1;
+}
+
+
+static int have(uint32_t seq)
+{
+    int i = seq % FEC_SLOTS;
+    return (rx[i].len > 0) && (rx[i].seq == seq);
+}
+
+
+// 组里只缺一个包时重建它
+static int rebuild(int p)
+{
+    uint32_t first = parities[p].first;
+    int count = parities[p].count;
+    int missing = 0;
+    uint32_t lost = 0;
+    for (int k = 0; k < count; k++)
+    {
+        if (!have(first + (uint32_t)k))
+        {
+            missing++;
+            lost = first + (uint32_t)k;
+        }
+    }
+    if (missing > 1)
+    {
+        return 0;
+    }
+    parities[p].count = 0;
+    if (missing == 0)
+    {
+        return 0;
+    }
+
+    int i = lost % FEC_SLOTS;
+    uint8_t *buf = rx_bufs + (size_t)i * mtu;
+    memcpy(buf, parity_bufs + (size_t)p * mtu, parities[p].len);
+    int len = parities[p].lens;
+    for (int k = 0; k < count; k++)
+    {
+        uint32_t seq = first + (uint32_t)k;
+        if (seq != lost)
+        {
+            int j = seq % FEC_SLOTS;
+            xor(buf, rx_bufs + (size_t)j * mtu, rx[j].len);
+            len ^= rx[j].len;
+        }
+    }
+    if ((len == 0) || (len > parities[p].len))
+    {
+        return 0;
+    }
+    rx[i].seq = lost;
+    rx[i].len = len;
+    stat.recovered++;
+    output(buf, len, lost);
+    return 1;
+}
+
+
+// 组的第一个包最先移出窗口, 之后这一组不可能再重建了
+static void expire(uint32_t seq)
+{
+    int p = seq % FEC_SLOTS;
+    if ((parities[p].count > 0) && (parities[p].first == seq))
+    {
+        parities[p].count = 0;
+        stat.unrecoverable++;
+    }
+}
+
+
+int fec_input(const uint8_t *pkt, int len, uint32_t seq)
+{
+    if ((len <= 0) || (len > mtu))
+    {
+        return 0;
+    }
+    int32_t ahead = (int32_t)(seq - rx_next);
+    if (ahead < -(FEC_SLOTS * 16))
+    {
+        // 对端重启了, 重新开始
+        rx_next = seq + 1;
+    }
+    else if (ahead >= 0)
+    {
+        // 新的包把最老的包挤出窗口, 一次最多挤出整个窗口
+        uint32_t from = (ahead >= FEC_SLOTS) ? seq + 1 - 2 * FEC_SLOTS : rx_next - FEC_SLOTS;
+        for (uint32_t old = from; old != seq + 1 - FEC_SLOTS; old++)
+        {
+            expire(old);
+        }
+        rx_next = seq + 1;
+    }
+    int i = seq % FEC_SLOTS;
+    if ((rx[i].len > 0) && (rx[i].seq == seq))
+    {
+        stat.duplicates++;
+        return -1;
+    }
+    memcpy(rx_bufs + (size_t)i * mtu, pkt, len);
+    rx[i].seq = seq;
+    rx[i].len = len;
+
+    // 校验包可能比数据包先到
+    int rebuilt = 0;
+    for (int back = 0; back < rx_group; back++)
+    {
+        int p = (seq - (uint32_t)back) % FEC_SLOTS;
+        if ((parities[p].count > back) && (parities[p].first == seq - (uint32_t)back))
+        {
+            rebuilt += rebuild(p);
+        }
+    }
+    return rebuilt;
+}
+
+
+int fec_repair(const uint8_t *payload, int len, uint32_t first)
+{
+    if (len < FEC_HEADER_LEN)
+    {
+        return -1;
+    }
+    int count = payload[0];
+    int size = len - FEC_HEADER_LEN;
+    if ((count < 1) || (count > FEC_GROUP_MAX) || (size > mtu))
+    {
+        return -1;
+    }
+    stat.parity_received++;
+    if (count > rx_group)
+    {
+        rx_group = count;
+    }
+
+    if ((int32_t)(rx_next - FEC_SLOTS - first) > 0)
+    {
+        // 组里的包已经移出了窗口, 重建会覆盖新的包
+        return 0;
+    }
+    int p = first % FEC_SLOTS;
+    if (parities[p].count > 0)
+    {
+        // 过了 FEC_SLOTS 个包还缺不止一个
+        stat.unrecoverable++;
+    }
+    parities[p].first = first;
+    parities[p].count = count;
+    parities[p].len = size;
+    parities[p].lens = (uint16_t)((payload[2] << 8) | payload[3]);
+    memcpy(parity_bufs + (size_t)p * mtu, payload + FEC_HEADER_LEN, size);
+    return rebuild(p);
+}
+
+
+void fec_stat(fec_stat_t *s)
+{
+    *s = stat;
+    s->group = group;
+}
@@ -0,0 +1,93 @@
+/*
+ * fec.h - rebuild lost packets from parity packets
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+#include "encapsulate.h"
+
+/*
+ Data packets are numbered with FLAG_SEQ. After every group of consecutive
+ data packets, or when a group has been open for FEC_DELAY, the sender adds
+ a parity packet with FLAG_FEC | FLAG_SEQ. Its sequence number is the first
+ of the group and its payload is
+
+ +---------+----------+------------+---------------------------------+
+ |  Count  | Reserved | Length XOR |   XOR of the inner packets      |
+ +---------+----------+------------+---------------------------------+
+     1B         1B          2B        longest packet of the group
+
+ The receiver keeps the last FEC_SLOTS packets and rebuilds the one missing
+ packet of a group. The group size follows the loss rate: no parity below
+ FEC_LOSS_MIN, then 250 / loss (per mille) packets, FEC_GROUP_MIN to
+ FEC_GROUP_MAX, so two losses in one group stay rare.
+*/
+
+#define FEC_HEADER_LEN 4
+#define FEC_GROUP_MIN  2
+#define FEC_GROUP_MAX  32
+#define FEC_SLOTS      256
+// per mille
+#define FEC_LOSS_MIN   2
+// ms
+#define FEC_DELAY      10
+
+typedef struct
+{
+    uint64_t parity_sent;
+    uint64_t parity_received;
+    // packets rebuilt from parity
+    uint64_t recovered;
+    // groups that lost more than one packet, counted when one of their
+    // packets leaves the last FEC_SLOTS
+    uint64_t unrecoverable;
+    // packets that arrived twice, or after they were rebuilt
+    uint64_t duplicates;
+    // data packets per parity, 0 if off
+    int group;
+} fec_stat_t;
+
+// output delivers rebuilt packets, packets are at most mtu bytes
+extern int fec_init(int mtu, void (*output)(const uint8_t *pkt, int len, uint32_t seq));
+
+// loss rate of the paths, per mille
+extern void fec_tune(int loss);
+
+// add a data packet to the open group, return 1 if a parity is due; a packet
+// that does not follow the open group closes it and opens the next one
+extern int fec_encode(const uint8_t *pkt, int len, uint32_t seq, int64_t t);
+
+// whether the open group has waited FEC_DELAY for its parity
+extern int fec_due(int64_t t);
+
+// fill pbuf with the parity of the open group and close it, 0 if it is empty
+extern int fec_parity(pbuf_t *pbuf);
+
+// a data packet arrived, return the number of packets rebuilt with it,
+// -1 if it has been rebuilt already
+extern int fec_input(const uint8_t *pkt, int len, uint32_t seq);
+
+// a parity packet arrived, return the number of packets rebuilt, -1 if invalid
+extern int fec_repair(const uint8_t *payload, int len, uint32_t first);
+
+extern void fec_stat(fec_stat_t *stat);
+
+#endif // FEC_H
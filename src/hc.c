@@ -0,0 +1,468 @@
+/*
+ * hc.c - inner IP/TCP/UDP header compression
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "hc.h"
+
+#define HC_CONTEXTS 128
+#define HC_FULL     0x80
+#define HC_NACK     0x80
+// IPv6 + TCP with the longest options
+#define HC_HDR_MAX  100
+// 对端确认前和之后每 REFRESH 个包发送完整头部
+#define REFRESH     32
+
+typedef struct
+{
+    uint8_t hdr[HC_HDR_MAX];
+    // IP 头部和 IP + 传输层头部长度, 0 表示无效
+    uint8_t ip_len;
+    uint8_t len;
+    uint8_t gen;
+    // 对端已收到完整头部
+    uint8_t acked;
+    uint32_t count;
+    uint32_t key;
+} context_t;
+
+// 发送和接收的上下文表, 每个方向一张; 接收方保留上一代, 乱序的包仍能恢复
+static context_t tx[HC_CONTEXTS];
+static context_t rx[HC_CONTEXTS];
+static context_t rx_prev[HC_CONTEXTS];
+
+// 待发送的反馈, 每个上下文最多一条
+#define FB_ACK  1
+#define FB_NACK 2
+static uint8_t fb_state[HC_CONTEXTS];
+static uint8_t fb_gen[HC_CONTEXTS];
+static int fb_pending;
+
+static int enabled;
+static hc_stat_t counters;
+
+
+// 头部格式: 返回 IP + 传输层头部长度, 不能压缩时返回 0
+static int parse(const uint8_t *p, int len, int *ip_len)
+{
+    int proto;
+    if ((len >= 20) && ((p[0] >> 4) == 4))
+    {
+        // 不处理 IP 选项和分片
+        if ((p[0] != 0x45) || (((p[2] << 8) | p[3]) != len)
+            || ((((p[6] << 8) | p[7]) & 0x3fff) != 0))
+        {
+            return 0;
+        }
+        *ip_len = 20;
+        proto = p[9];
+    }
+    else if ((len >= 40) && ((p[0] >> 4) == 6))
+    {
+        // 不处理扩展头部
+        if (((p[4] << 8) | p[5]) != len - 40)
+        {
+            return 0;
+        }
+        *ip_len = 40;
+        proto = p[6];
+    }
+    else
+    {
+        return 0;
+    }
+
+    const uint8_t *t = p + *ip_len;
+    int left = len - *ip_len;
+    if (proto == 6)
+    {
+        if (left < 20)
+        {
+            return 0;
+        }
+        int doff = (t[12] >> 4) * 4;
+        if ((doff < 20) || (doff > left))
+        {
+            return 0;
+        }
+        return *ip_len + doff;
+    }
+    else if (proto == 17)
+    {
+        if ((left < 8) || (((t[4] << 8) | t[5]) != left))
+        {
+            return 0;
+        }
+        return *ip_len + 8;
+    }
+    return 0;
+}
+
+
+// 不变字段是否相同, 发送的可变字段不比较
+static int same(const uint8_t *a, const uint8_t *b, int ip_len, int len)
+{
+    if (ip_len == 20)
+    {
+        // version ~ tos, flags ~ protocol, addresses
+        if ((memcmp(a, b, 2) != 0) || (memcmp(a + 6, b + 6, 4) != 0)
+            || (memcmp(a + 12, b + 12, 8) != 0))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        // version ~ flow label, next header ~ addresses
+        if ((memcmp(a, b, 4) != 0) || (memcmp(a + 6, b + 6, 34) != 0))
+        {
+            return 0;
+        }
+    }
+    a += ip_len;
+    b += ip_len;
+    if (len - ip_len == 8)
+    {
+        // ports
+        return memcmp(a, b, 4) == 0;
+    }
+    // ports, data offset, urgent pointer
+    return (memcmp(a, b, 4) == 0) && (a[12] == b[12]) && (memcmp(a + 18, b + 18, 2) == 0);
+}
+
+
+static uint32_t flow_key(const uint8_t *p, int ip_len, int len)
+{
+    uint32_t h = 2166136261u;
+    const uint8_t *addr = p + ((ip_len == 20) ? 12 : 8);
+    int n = (ip_len == 20) ? 8 : 32;
+    for (int i = 0; i < n; i++)
+    {
+        h = (h ^ addr[i]) * 16777619u;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        h = (h ^ p[ip_len + i]) * 16777619u;
+    }
+    h = (h ^ (uint32_t)(ip_len ^ len)) * 16777619u;
+    return h;
+}
+
+
+// 可变字段, 按顺序发送
+static int fields(int ip_len, int len, int *off, int *cnt)
+{
+    int n = 0;
+    if (ip_len == 20)
+    {
+        // identification
+        off[n] = 4;
+        cnt[n++] = 2;
+    }
+    if (len - ip_len == 8)
+    {
+        // checksum
+        off[n] = ip_len + 6;
+        cnt[n++] = 2;
+    }
+    else
+    {
+        // seq, ack; flags, window, checksum; options
+        off[n] = ip_len + 4;
+        cnt[n++] = 8;
+        off[n] = ip_len + 13;
+        cnt[n++] = 5;
+        if (len - ip_len > 20)
+        {
+            off[n] = ip_len + 20;
+            cnt[n++] = len - ip_len - 20;
+        }
+    }
+    return n;
+}
+
+
+void hc_enable(int enable)
+{
+    enabled = enable;
+    // 重启后的第一代不同于对端残留的上下文
+    for (int i = 0; i < HC_CONTEXTS; i++)
+    {
+        tx[i].gen = (uint8_t)randombytes_uniform(256);
+    }
+}
+
+
+int hc_compress(const uint8_t *in, int len, uint8_t *out, int max)
+{
+    if (!enabled)
+    {
+        return 0;
+    }
+    int ip_len;
+    int hdr_len = parse(in, len, &ip_len);
+    if (hdr_len == 0)
+    {
+        return 0;
+    }
+
+    uint32_t key = flow_key(in, ip_len, hdr_len);
+    int cid = (int)(key % HC_CONTEXTS);
+    context_t *ctx = &tx[cid];
+
+    if ((ctx->len != hdr_len) || (ctx->ip_len != ip_len) || (ctx->key != key)
+        || !same(in, ctx->hdr, ip_len, hdr_len))
+    {
+        // 新流, 或者不变字段变了: 重新建立上下文
+        ctx->key = key;
+        ctx->ip_len = (uint8_t)ip_len;
+        ctx->len = (uint8_t)hdr_len;
+        ctx->gen++;
+        ctx->acked = 0;
+        ctx->count = 0;
+        memcpy(ctx->hdr, in, hdr_len);
+    }
+
+    ctx->count++;
+    if (!ctx->acked || (ctx->count % REFRESH == 0))
+    {
+        if (len + HC_OVERHEAD > max)
+        {
+            // 放不下, 下一个包再发完整头部
+            ctx->count--;
+            return 0;
+        }
+        out[0] = (uint8_t)(HC_FULL | cid);
+        out[1] = ctx->gen;
+        memcpy(out + HC_OVERHEAD, in, len);
+        counters.full++;
+        return len + HC_OVERHEAD;
+    }
+
+    int off[4], cnt[4];
+    int n = fields(ip_len, hdr_len, off, cnt);
+    uint8_t *p = out;
+    *p++ = (uint8_t)cid;
+    *p++ = ctx->gen;
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(p, in + off[i], cnt[i]);
+        p += cnt[i];
+    }
+    memcpy(p, in + hdr_len, len - hdr_len);
+    p += len - hdr_len;
+    counters.compressed++;
+    counters.saved += (uint64_t)(len - (p - out));
+    return (int)(p - out);
+}
+
+
+static uint16_t ip_checksum(const uint8_t *p, int len)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2)
+    {
+        sum += (uint32_t)((p[i] << 8) | p[i + 1]);
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+
+static void feedback(int cid, int state, uint8_t gen)
+{
+    if (fb_state[cid] == 0)
+    {
+        fb_pending++;
+    }
+    fb_state[cid] = (uint8_t)state;
+    fb_gen[cid] = gen;
+}
+
+
+int hc_decompress(uint8_t *buf, int len, int size)
+{
+    if (len < HC_OVERHEAD)
+    {
+        return -1;
+    }
+    int cid = buf[0] & ~HC_FULL;
+    context_t *ctx = &rx[cid];
+
+    if (buf[0] & HC_FULL)
+    {
+        uint8_t gen = buf[1];
+        len -= HC_OVERHEAD;
+        memmove(buf, buf + HC_OVERHEAD, len);
+        int ip_len;
+        int hdr_len = parse(buf, len, &ip_len);
+        if (hdr_len == 0)
+        {
+            return -1;
+        }
+        if ((ctx->len != 0) && (ctx->gen != gen))
+        {
+            rx_prev[cid] = *ctx;
+        }
+        feedback(cid, FB_ACK, gen);
+        ctx->ip_len = (uint8_t)ip_len;
+        ctx->len = (uint8_t)hdr_len;
+        ctx->gen = gen;
+        memcpy(ctx->hdr, buf, hdr_len);
+        return len;
+    }
+
+    if ((ctx->len == 0) || (ctx->gen != buf[1]))
+    {
+        if ((rx_prev[cid].len != 0) && (rx_prev[cid].gen == buf[1]))
+        {
+            // 上下文更新之前发出的包
+            ctx = &rx_prev[cid];
+        }
+        else
+        {
+            // 没有收到这个流的完整头部, 请对端重发
+            counters.misses++;
+            feedback(cid, FB_NACK, buf[1]);
+            return -1;
+        }
+    }
+
+    int off[4], cnt[4];
+    int n = fields(ctx->ip_len, ctx->len, off, cnt);
+    int sent = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sent += cnt[i];
+    }
+    if (len < HC_OVERHEAD + sent)
+    {
+        return -1;
+    }
+    int payload = len - HC_OVERHEAD - sent;
+    int total = ctx->len + payload;
+    if (total > size)
+    {
+        return -1;
+    }
+
+    // 可变字段先取出来, 再把 payload 移到头部之后
+    uint8_t dynamic[HC_HDR_MAX];
+    memcpy(dynamic, buf + HC_OVERHEAD, sent);
+    memmove(buf + ctx->len, buf + HC_OVERHEAD + sent, payload);
+    memcpy(buf, ctx->hdr, ctx->len);
+    const uint8_t *p = dynamic;
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(buf + off[i], p, cnt[i]);
+        p += cnt[i];
+    }
+
+    // 长度和 IPv4 头部校验和
+    if (ctx->ip_len == 20)
+    {
+        buf[2] = (uint8_t)(total >> 8);
+        buf[3] = (uint8_t)total;
+        buf[10] = 0;
+        buf[11] = 0;
+        uint16_t sum = ip_checksum(buf, 20);
+        buf[10] = (uint8_t)(sum >> 8);
+        buf[11] = (uint8_t)sum;
+    }
+    else
+    {
+        buf[4] = (uint8_t)((total - 40) >> 8);
+        buf[5] = (uint8_t)(total - 40);
+    }
+    if (ctx->len - ctx->ip_len == 8)
+    {
+        int udp_len = total - ctx->ip_len;
+        buf[ctx->ip_len + 4] = (uint8_t)(udp_len >> 8);
+        buf[ctx->ip_len + 5] = (uint8_t)udp_len;
+    }
+    return total;
+}
+
+
+int hc_feedback(uint8_t *out, int max)
+{
+    if (fb_pending == 0)
+    {
+        return 0;
+    }
+    int n = 0;
+    for (int cid = 0; (cid < HC_CONTEXTS) && (fb_pending > 0)
+                      && (n < (HC_FEEDBACK_MAX - 1) / 2) && (3 + 2 * n <= max); cid++)
+    {
+        if (fb_state[cid] == 0)
+        {
+            continue;
+        }
+        out[2 * n] = (uint8_t)(((fb_state[cid] == FB_NACK) ? HC_NACK : 0) | cid);
+        out[2 * n + 1] = fb_gen[cid];
+        fb_state[cid] = 0;
+        fb_pending--;
+        n++;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    out[2 * n] = (uint8_t)n;
+    return 2 * n + 1;
+}
+
+
+int hc_feedback_input(const uint8_t *in, int len)
+{
+    if (len < 1)
+    {
+        return -1;
+    }
+    int n = in[len - 1];
+    int fb_len = 2 * n + 1;
+    if ((n == 0) || (fb_len > HC_FEEDBACK_MAX) || (fb_len > len))
+    {
+        return -1;
+    }
+    const uint8_t *p = in + len - fb_len;
+    for (int i = 0; i < n; i++)
+    {
+        context_t *ctx = &tx[p[2 * i] & ~HC_NACK];
+        // 只处理当前这一代的反馈
+        if ((ctx->len == 0) || (ctx->gen != p[2 * i + 1]))
+        {
+            continue;
+        }
+        ctx->acked = !(p[2 * i] & HC_NACK);
+    }
+    return fb_len;
+}
+
+
+void hc_stat(hc_stat_t *stat)
+{
+    *stat = counters;
+}
@@ -0,0 +1,91 @@
+/*
+ * hc.h - inner IP/TCP/UDP header compression
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HC_H
+#define HC_H
+
+#include <stdint.h>
+
+/*
+ Packets with FLAG_HC start with a context id and its generation:
+
+   +--------------+------------+----------------------------------+
+   | F | CID (7b) | Generation | full packet / changing fields    |
+   +--------------+------------+----------------------------------+
+
+ F = 1: the full packet follows and (re)defines the context.
+ F = 0: only the fields that change from packet to packet follow, as
+        absolute values, then the payload. IPv4 ID; TCP sequence,
+        acknowledgment, flags, window, checksum and options; UDP checksum.
+        Lengths and the IPv4 header checksum are recomputed.
+
+ A compressed packet does not depend on the previous one, so losing it
+ breaks nothing. Full headers are sent until the peer acknowledges the
+ context, and every REFRESH packets after. A receiver without the context
+ (reordered ahead of its full header, or a restart) drops the packet and
+ asks for full headers again.
+
+ Feedback rides on any packet to the peer (FLAG_HC_FEEDBACK), after the
+ payload and the sequence number:
+
+   +----------------------+-----+----------------------+-------+
+   | N | CID (7b) | Gen   | ... | N | CID (7b) | Gen   | Count |
+   +----------------------+-----+----------------------+-------+
+
+ N = 0: full headers of the context arrived, N = 1: a packet missed it.
+
+ Packets are decoded on arrival, before the reorder buffer; the previous
+ context of each CID is kept for packets reordered across a context change,
+ so several paths need no reordering for header compression.
+*/
+
+// compressed header is at most this much longer than the original
+#define HC_OVERHEAD 2
+// longest feedback trailer
+#define HC_FEEDBACK_MAX (1 + 2 * 8)
+
+typedef struct
+{
+    // packets sent with full and compressed headers
+    uint64_t full;
+    uint64_t compressed;
+    // header bytes saved by sent packets
+    uint64_t saved;
+    // received packets dropped for lack of context
+    uint64_t misses;
+} hc_stat_t;
+
+extern void hc_enable(int enable);
+
+// compress headers of len bytes into out (len + HC_OVERHEAD bytes), return
+// new length, 0 if disabled, not a plain IP/TCP/UDP packet, or longer than max
+extern int hc_compress(const uint8_t *in, int len, uint8_t *out, int max);
+
+// restore headers in place, buf holds size bytes, return new length, -1 on error
+extern int hc_decompress(uint8_t *buf, int len, int size);
+
+// write pending feedback (at most max bytes), return its length, 0 if none
+extern int hc_feedback(uint8_t *out, int max);
+// apply the feedback trailer at the end of the len bytes at in,
+// return the trailer length, -1 if malformed
+extern int hc_feedback_input(const uint8_t *in, int len);
+
+extern void hc_stat(hc_stat_t *stat);
+
+#endif // HC_H
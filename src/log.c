@@ -18,29 +18,291 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "log.h"
 
+// 异步日志: 调用方只做 vsnprintf, 时间格式化和写文件在后台线程,
+// 环形队列每个槽带序号, 多个生产者 (包括 signal handler) 不需要加锁.
+// 队列空时后台线程阻塞在 pipe 上, 生产者写一个字节唤醒它 (write 可以在
+// signal handler 里调用, 条件变量不行)
+#define LOG_RING    1024
+#define LOG_MSG_MAX 256
+
+typedef struct
+{
+    unsigned seq;
+    FILE *stream;
+    time_t time;
+    char msg[LOG_MSG_MAX];
+} log_entry_t;
+
+static log_entry_t ring[LOG_RING];
+static unsigned enqueue_pos;
+static unsigned dequeue_pos;
+static uint64_t dropped;
+static uint64_t reported;
+static volatile int running = 0;
+static pthread_t thread;
+static int wakeup[2] = { -1, -1 };
+// 后台线程准备阻塞, 下一个生产者负责唤醒
+static int sleeping = 0;
+
+
+// t 为 0 表示接着上一条输出, 不加时间
+static void log_write(FILE *stream, time_t t, const char *msg)
+{
+    if (t == 0)
+    {
+        fprintf(stream, "%s\n", msg);
+        return;
+    }
+    struct tm tm;
+    char timestr[20];
+    strftime(timestr, 20, "%y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    fprintf(stream, "[%s] %s\n", timestr, msg);
+}
+
+
+static void log_wake(void)
+{
+    if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        char c = 0;
+        if (write(wakeup[1], &c, 1) < 0)
+        {
+            // pipe 里已经有未读的字节, 线程会醒来
+        }
+    }
+}
+
+
+static int log_pending(void)
+{
+    const log_entry_t *e = &ring[dequeue_pos % LOG_RING];
+    return (__atomic_load_n(&e->seq, __ATOMIC_SEQ_CST) == dequeue_pos + 1)
+           || (__atomic_load_n(&dropped, __ATOMIC_SEQ_CST) != reported);
+}
+
+
+static void *log_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        int n = 0;
+        while (1)
+        {
+            log_entry_t *e = &ring[dequeue_pos % LOG_RING];
+            if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+            {
+                break;
+            }
+            log_write(e->stream, e->time, e->msg);
+            __atomic_store_n(&e->seq, dequeue_pos + LOG_RING, __ATOMIC_RELEASE);
+            dequeue_pos++;
+            n++;
+        }
+        uint64_t d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+        if (d != reported)
+        {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%llu log messages dropped", (unsigned long long)(d - reported));
+            log_write(stderr, time(NULL), msg);
+            reported = d;
+            n++;
+        }
+        if (n > 0)
+        {
+            fflush(stdout);
+            fflush(stderr);
+        }
+        else if (!running)
+        {
+            break;
+        }
+        else
+        {
+            // 先声明要睡眠再检查一次队列, 之后入队的生产者一定会唤醒
+            __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+            if (!log_pending() && running)
+            {
+                char buf[64];
+                while ((read(wakeup[0], buf, sizeof(buf)) < 0) && (errno == EINTR))
+                {
+                }
+            }
+            __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+    return NULL;
+}
+
+
+static void log_atexit(void)
+{
+    log_stop();
+}
+
+
+int log_start(void)
+{
+    static int registered = 0;
+    if (running)
+    {
+        return 0;
+    }
+    for (unsigned i = 0; i < LOG_RING; i++)
+    {
+        ring[i].seq = i;
+    }
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    sleeping = 0;
+    if (pipe(wakeup) != 0)
+    {
+        return -1;
+    }
+    // 唤醒不能阻塞生产者
+    int flags = fcntl(wakeup[1], F_GETFL, 0);
+    fcntl(wakeup[1], F_SETFL, flags | O_NONBLOCK);
+    running = 1;
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0)
+    {
+        running = 0;
+        close(wakeup[0]);
+        close(wakeup[1]);
+        return -1;
+    }
+    if (!registered)
+    {
+        atexit(log_atexit);
+        registered = 1;
+    }
+    return 0;
+}
+
+
+void log_stop(void)
+{
+    if (running)
+    {
+        running = 0;
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        log_wake();
+        pthread_join(thread, NULL);
+        close(wakeup[0]);
+        close(wakeup[1]);
+        wakeup[0] = -1;
+        wakeup[1] = -1;
+    }
+}
+
+
+uint64_t log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+
+static void log_push(FILE *stream, int stamp, const char *format, va_list args)
+{
+    unsigned pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    log_entry_t *e;
+    while (1)
+    {
+        e = &ring[pos % LOG_RING];
+        int diff = (int)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // 队列满, 不阻塞数据路径
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    e->stream = stream;
+    e->time = stamp ? time(NULL) : 0;
+    vsnprintf(e->msg, sizeof(e->msg), format, args);
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_SEQ_CST);
+    log_wake();
+}
+
+
 void __log(FILE *stream, const char *format, ...)
 {
+    va_list args;
+    va_start(args, format);
+    if (running)
+    {
+        log_push(stream, 1, format, args);
+        va_end(args);
+        return;
+    }
+
     time_t now = time(NULL);
     char timestr[20];
     strftime(timestr, 20, "%y-%m-%d %H:%M:%S", localtime(&now));
     fprintf(stream, "[%s] ", timestr);
 
-    va_list args;
-    va_start(args, format);
     vfprintf(stream, format, args);
     va_end(args);
     putchar('\n');
     fflush(stream);
 }
 
+void __log_cont(FILE *stream, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (running)
+    {
+        log_push(stream, 0, format, args);
+    }
+    else
+    {
+        vfprintf(stream, format, args);
+        fputc('\n', stream);
+        fflush(stream);
+    }
+    va_end(args);
+}
+
 void __err(const char *msg)
 {
     __log(stderr, "%s: %s", msg, strerror(errno));
 }
 
+int __log_allow(log_limit_t *limit, int interval)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if ((limit->last != 0) && (now - limit->last < interval))
+    {
+        limit->suppressed++;
+        return 0;
+    }
+    int n = (int)limit->suppressed + 1;
+    limit->last = now;
+    limit->suppressed = 0;
+    return n;
+}
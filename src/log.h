@@ -21,11 +21,43 @@
 #define LOG_H
 
 
+#include <stdint.h>
 #include <stdio.h>
+
+typedef struct
+{
+    int64_t last;
+    unsigned suppressed;
+} log_limit_t;
+
+// write from a background thread, LOG() is synchronous until log_start()
+extern int log_start(void);
+// flush and stop the thread, call before fork
+extern void log_stop(void);
+// messages lost because the ring was full
+extern uint64_t log_dropped(void);
+
 extern void __log(FILE *stream, const char *format, ...);
+// a line continuing the previous message, without the time
+extern void __log_cont(FILE *stream, const char *format, ...);
 extern void __err(const char *msg);
+// return 0 to suppress, otherwise 1 + number suppressed since the last one
+extern int __log_allow(log_limit_t *limit, int interval);
 #define LOG(format, ...)  do{__log(stdout, format, ##__VA_ARGS__);}while(0)
+#define LOG_CONT(format, ...)  do{__log_cont(stdout, format, ##__VA_ARGS__);}while(0)
 #define ERROR(msg)  do{__err(msg);}while(0)
 
+// at most one message per interval (ms) from each call site
+#define LOG_RATELIMIT(interval, format, ...)  do{ \
+    static log_limit_t __limit; \
+    int __n = __log_allow(&__limit, interval); \
+    if (__n > 1) __log(stdout, format " (%d suppressed)", ##__VA_ARGS__, __n - 1); \
+    else if (__n == 1) __log(stdout, format, ##__VA_ARGS__); \
+}while(0)
+#define ERROR_RATELIMIT(interval, msg)  do{ \
+    static log_limit_t __limit; \
+    if (__log_allow(&__limit, interval) > 0) __err(msg); \
+}while(0)
+
 
 #endif // LOG_H
@@ -58,6 +58,9 @@ int main(int argc, char **argv)
         }
     }
 
+    // 数据路径上不再同步写日志
+    log_start();
+
     // 注册 signal handle
 #ifdef HAVE_SIGACTION
     struct sigaction sa;
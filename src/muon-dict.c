@@ -0,0 +1,522 @@
+/*
+ * muon-dict.c - train a shared compression dictionary from a pcap sample
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "compress.h"
+
+/*
+  统计样本中 K 字节片段出现在多少个包里, 从出现最多的片段开始, 向右扩展
+  到同样常见的相邻片段, 拼成字典. LZ4 匹配距离越近越好, 最常见的内容放在
+  字典末尾, muon 也只使用文件的最后 64KB.
+*/
+
+#define SAMPLE_MAX (64 * 1024 * 1024)
+#define PACKET_MAX 65535
+#define SEGMENT_MAX 256
+#define TABLE_BITS 22
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+typedef struct
+{
+    uint64_t hash;
+    uint32_t count;
+    // 最后一次计数的包, 同一个包里的重复由 LZ4 自己处理
+    uint32_t last;
+    // 第一次出现的位置
+    uint32_t pos;
+} entry_t;
+
+typedef struct
+{
+    uint32_t pos;
+    uint32_t len;
+} segment_t;
+
+static uint8_t *sample;
+static uint32_t sample_len;
+// 每个包的结束位置, 片段不跨包
+static uint32_t *ends;
+static uint32_t packets;
+static entry_t *table;
+static int k = 16;
+
+
+static void help(void)
+{
+    printf("usage: muon-dict [options] <pcap> <dict>\n"
+           "  -h, --help           show this help\n"
+           "  -s, --size <bytes>   dictionary size, default: 8192, max: 65536\n"
+           "  -k <bytes>           segment length, default: 16\n"
+           "\n"
+           "pcap is a capture of the traffic inside the tunnel (e.g. tcpdump -i tun0\n"
+           "-w sample.pcap), in classic pcap format. Copy dict to both ends and set\n"
+           "dict=<path> in their config files.\n");
+}
+
+
+static uint32_t get32(const uint8_t *p, int swap)
+{
+    if (swap)
+    {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+               | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16)
+           | ((uint32_t)p[1] << 8) | (uint32_t)p[0];
+}
+
+
+// 找到链路层帧中的 IP 包, 返回偏移, -1 表示不是 IP 包
+static int ip_offset(uint32_t linktype, const uint8_t *frame, uint32_t len)
+{
+    uint32_t off;
+    switch (linktype)
+    {
+    case 0:
+        // BSD loopback
+        off = 4;
+        break;
+    case 1:
+    {
+        // ethernet, 跳过 802.1Q 标签
+        off = 12;
+        while ((off + 2 <= len) && (frame[off] == 0x81) && (frame[off + 1] == 0x00))
+        {
+            off += 4;
+        }
+        off += 2;
+        break;
+    }
+    case 12:
+    case 14:
+    case 101:
+    case 228:
+    case 229:
+        // raw IP
+        off = 0;
+        break;
+    case 113:
+        // Linux cooked
+        off = 16;
+        break;
+    case 276:
+        // Linux cooked v2
+        off = 20;
+        break;
+    default:
+        return -1;
+    }
+    if (off >= len)
+    {
+        return -1;
+    }
+    int version = frame[off] >> 4;
+    return ((version == 4) || (version == 6)) ? (int)off : -1;
+}
+
+
+static int load_pcap(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    uint8_t hdr[24];
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+    {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        fclose(f);
+        return -1;
+    }
+    uint32_t magic = get32(hdr, 0);
+    int swap;
+    if ((magic == 0xa1b2c3d4) || (magic == 0xa1b23c4d))
+    {
+        swap = 0;
+    }
+    else if ((magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1))
+    {
+        swap = 1;
+    }
+    else
+    {
+        fprintf(stderr, "%s: not a pcap file (convert pcapng with editcap -F pcap)\n", path);
+        fclose(f);
+        return -1;
+    }
+    uint32_t linktype = get32(hdr + 20, swap) & 0xffff;
+
+    static uint8_t frame[PACKET_MAX];
+    uint8_t rec[16];
+    uint32_t skipped = 0;
+    uint32_t capacity = 0;
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec))
+    {
+        uint32_t caplen = get32(rec + 8, swap);
+        if (caplen > PACKET_MAX)
+        {
+            fprintf(stderr, "%s: corrupted record\n", path);
+            fclose(f);
+            return -1;
+        }
+        if (fread(frame, 1, caplen, f) != caplen)
+        {
+            break;
+        }
+        int off = ip_offset(linktype, frame, caplen);
+        if (off < 0)
+        {
+            skipped++;
+            continue;
+        }
+        uint32_t len = caplen - (uint32_t)off;
+        if (sample_len + len > SAMPLE_MAX)
+        {
+            fprintf(stderr, "sample truncated to %d bytes\n", SAMPLE_MAX);
+            break;
+        }
+        if (packets == capacity)
+        {
+            capacity = (capacity == 0) ? 1024 : capacity * 2;
+            uint32_t *p = realloc(ends, capacity * sizeof(uint32_t));
+            if (p == NULL)
+            {
+                perror("realloc");
+                fclose(f);
+                return -1;
+            }
+            ends = p;
+        }
+        memcpy(sample + sample_len, frame + off, len);
+        sample_len += len;
+        ends[packets++] = sample_len;
+    }
+    fclose(f);
+
+    if (skipped > 0)
+    {
+        fprintf(stderr, "%u non-IP frames skipped\n", skipped);
+    }
+    if (packets == 0)
+    {
+        fprintf(stderr, "%s: no IP packets found (linktype %u)\n", path, linktype);
+        return -1;
+    }
+    return 0;
+}
+
+
+static uint64_t hash(const uint8_t *p)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < k; i++)
+    {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h | 1;
+}
+
+
+static entry_t *lookup(uint64_t h, int insert)
+{
+    uint32_t i = (uint32_t)(h >> (64 - TABLE_BITS));
+    for (int probe = 0; probe < 64; probe++)
+    {
+        entry_t *e = &table[(i + probe) & (TABLE_SIZE - 1)];
+        if (e->hash == h)
+        {
+            return e;
+        }
+        if (e->hash == 0)
+        {
+            if (!insert)
+            {
+                return NULL;
+            }
+            e->hash = h;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+static void count(void)
+{
+    uint32_t start = 0;
+    for (uint32_t n = 0; n < packets; n++)
+    {
+        uint32_t end = ends[n];
+        for (uint32_t pos = start; pos + (uint32_t)k <= end; pos++)
+        {
+            entry_t *e = lookup(hash(sample + pos), 1);
+            if ((e != NULL) && ((e->count == 0) || (e->last != n)))
+            {
+                if (e->count == 0)
+                {
+                    e->pos = pos;
+                }
+                e->count++;
+                e->last = n;
+            }
+        }
+        start = end;
+    }
+}
+
+
+static int by_count(const void *a, const void *b)
+{
+    uint32_t x = table[*(const uint32_t *)a].count;
+    uint32_t y = table[*(const uint32_t *)b].count;
+    return (x < y) - (x > y);
+}
+
+
+// 二分查找 pos 所在的包
+static void packet_bounds(uint32_t pos, uint32_t *start, uint32_t *end)
+{
+    uint32_t lo = 0, hi = packets - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (ends[mid] <= pos)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *start = (lo > 0) ? ends[lo - 1] : 0;
+    *end = ends[lo];
+}
+
+
+// 从 pos 开始的片段足够常见时并入当前段, 之后不再单独选出
+static int take(uint32_t pos, uint32_t threshold)
+{
+    entry_t *e = lookup(hash(sample + pos), 0);
+    if ((e == NULL) || (e->count < threshold) || (e->count < 2))
+    {
+        return 0;
+    }
+    e->count = 0;
+    return 1;
+}
+
+
+static int train(const char *path, int size)
+{
+    count();
+
+    uint32_t candidates = 0;
+    uint32_t *order = malloc(TABLE_SIZE * sizeof(uint32_t));
+    if (order == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < TABLE_SIZE; i++)
+    {
+        if (table[i].count >= 2)
+        {
+            order[candidates++] = i;
+        }
+    }
+    qsort(order, candidates, sizeof(uint32_t), by_count);
+
+    // 按出现次数从高到低选片段, 向右扩展到至少一半常见的相邻片段
+    int max = size / k + 1;
+    segment_t *segments = malloc((size_t)max * sizeof(segment_t));
+    if (segments == NULL)
+    {
+        perror("malloc");
+        free(order);
+        return -1;
+    }
+    int nsegments = 0;
+    int total = 0;
+    for (uint32_t c = 0; (c < candidates) && (total < size) && (nsegments < max); c++)
+    {
+        entry_t *e = &table[order[c]];
+        if (e->count < 2)
+        {
+            // 已经包含在之前选出的片段中
+            continue;
+        }
+        uint32_t pos = e->pos;
+        uint32_t start, end;
+        packet_bounds(pos, &start, &end);
+        uint32_t threshold = e->count / 2;
+        uint32_t len = (uint32_t)k;
+        e->count = 0;
+        // 向两边扩展, 错开几个字节的相同内容并入同一段
+        while ((len < SEGMENT_MAX) && (pos + len < end) && take(pos + len - (uint32_t)k + 1, threshold))
+        {
+            len++;
+        }
+        while ((len < SEGMENT_MAX) && (pos > start) && take(pos - 1, threshold))
+        {
+            pos--;
+            len++;
+        }
+        segments[nsegments].pos = pos;
+        segments[nsegments].len = len;
+        nsegments++;
+        total += (int)len;
+    }
+    free(order);
+
+    if (nsegments == 0)
+    {
+        fprintf(stderr, "no repeated content found, sample more traffic\n");
+        free(segments);
+        return -1;
+    }
+
+    // 最常见的片段写在最后, 超出 size 时丢掉最不常见片段的开头
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        perror("fopen");
+        free(segments);
+        return -1;
+    }
+    int skip = (total > size) ? total - size : 0;
+    for (int i = nsegments - 1; i >= 0; i--)
+    {
+        uint32_t pos = segments[i].pos;
+        uint32_t len = segments[i].len;
+        if (skip > 0)
+        {
+            uint32_t n = ((uint32_t)skip < len) ? (uint32_t)skip : len;
+            pos += n;
+            len -= n;
+            skip -= (int)n;
+        }
+        if (fwrite(sample + pos, 1, len, f) != len)
+        {
+            perror("fwrite");
+            fclose(f);
+            free(segments);
+            return -1;
+        }
+    }
+    if (fclose(f) != 0)
+    {
+        perror("fclose");
+        free(segments);
+        return -1;
+    }
+    printf("%u packets, %d segments, %d bytes written to %s\n",
+           packets, nsegments, (total < size) ? total : size, path);
+    free(segments);
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *files[2];
+    int nfiles = 0;
+    int size = 8192;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0))
+        {
+            help();
+            return EXIT_SUCCESS;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--size") == 0))
+        {
+            if (i + 1 >= argc)
+            {
+                help();
+                return EXIT_FAILURE;
+            }
+            size = atoi(argv[++i]);
+            if ((size < 256) || (size > DICT_MAX))
+            {
+                fprintf(stderr, "size must be between 256 and %d\n", DICT_MAX);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                help();
+                return EXIT_FAILURE;
+            }
+            k = atoi(argv[++i]);
+            if ((k < 4) || (k > 64))
+            {
+                fprintf(stderr, "segment length must be between 4 and 64\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (nfiles < 2)
+        {
+            files[nfiles++] = argv[i];
+        }
+        else
+        {
+            help();
+            return EXIT_FAILURE;
+        }
+    }
+    if (nfiles != 2)
+    {
+        help();
+        return EXIT_FAILURE;
+    }
+
+    sample = malloc(SAMPLE_MAX);
+    table = calloc(TABLE_SIZE, sizeof(entry_t));
+    if ((sample == NULL) || (table == NULL))
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    int r = load_pcap(files[0]);
+    if (r == 0)
+    {
+        r = train(files[1], size);
+    }
+
+    free(sample);
+    free(table);
+    free(ends);
+    return (r == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
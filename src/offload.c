@@ -0,0 +1,429 @@
+/*
+ * offload.c - tun virtio-net header offload (TSO/GRO)
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "conf.h"
+#include "offload.h"
+
+
+#define VNET_F_NEEDS_CSUM 1
+#define VNET_GSO_NONE     0
+#define VNET_GSO_TCPV4    1
+#define VNET_GSO_TCPV6    4
+#define VNET_GSO_ECN      0x80
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+#define IP_LEN_MAX 65535
+
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+
+// Internet checksum
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, int len)
+{
+    while (len > 1)
+    {
+        sum += get16(p);
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        sum += (uint32_t)p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)sum;
+}
+
+// TCP 伪首部
+static uint32_t csum_pseudo(const uint8_t *pkt, int l4len)
+{
+    uint32_t sum;
+    if ((pkt[0] >> 4) == 4)
+    {
+        sum = csum_add(0, pkt + 12, 8);
+    }
+    else
+    {
+        sum = csum_add(0, pkt + 8, 32);
+    }
+    return sum + 6 + (uint32_t)l4len;
+}
+
+
+// 解析 TCP 包, 返回 IP 首部长度, 不是 TCP 包或有分片/扩展首部时返回 -1
+static int tcp_parse(const uint8_t *pkt, int len, int *hlen)
+{
+    int iphl;
+    if ((len >= 20) && ((pkt[0] >> 4) == 4))
+    {
+        iphl = (pkt[0] & 0x0f) * 4;
+        if ((iphl != 20) || (pkt[9] != 6) || (get16(pkt + 2) != len)
+            || ((get16(pkt + 6) & 0x3fff) != 0))
+        {
+            return -1;
+        }
+    }
+    else if ((len >= 40) && ((pkt[0] >> 4) == 6))
+    {
+        iphl = 40;
+        if ((pkt[6] != 6) || (get16(pkt + 4) + 40 != len))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    if (iphl + 20 > len)
+    {
+        return -1;
+    }
+    int thl = (pkt[iphl + 12] >> 4) * 4;
+    if ((thl < 20) || (iphl + thl > len))
+    {
+        return -1;
+    }
+    *hlen = iphl + thl;
+    return iphl;
+}
+
+
+int offload_begin(offload_t *it, uint8_t *buf, int n)
+{
+    vnet_hdr_t hdr;
+    if (n <= VNET_HDR_LEN)
+    {
+        return -1;
+    }
+    memcpy(&hdr, buf, VNET_HDR_LEN);
+    it->pkt = buf + VNET_HDR_LEN;
+    it->len = n - VNET_HDR_LEN;
+    it->iphl = 0;
+    it->hlen = 0;
+    it->mss = 0;
+    it->off = 0;
+    it->seg = 0;
+
+    int type = hdr.gso_type & ~VNET_GSO_ECN;
+    if (type == VNET_GSO_NONE)
+    {
+        if (hdr.flags & VNET_F_NEEDS_CSUM)
+        {
+            // 内核只填了伪首部校验和, 补全
+            int start = hdr.csum_start;
+            int pos = start + hdr.csum_offset;
+            if (pos + 2 > it->len)
+            {
+                return -1;
+            }
+            put16(it->pkt + pos, ~csum_fold(csum_add(0, it->pkt + start, it->len - start)));
+        }
+        return 0;
+    }
+    if ((type != VNET_GSO_TCPV4) && (type != VNET_GSO_TCPV6))
+    {
+        return -1;
+    }
+
+    // 长度和校验和在分段时重新计算
+    uint8_t *pkt = it->pkt;
+    int iphl = ((pkt[0] >> 4) == 4) ? (pkt[0] & 0x0f) * 4 : 40;
+    if ((iphl < 20) || (iphl + 20 > it->len))
+    {
+        return -1;
+    }
+    int thl = (pkt[iphl + 12] >> 4) * 4;
+    if ((thl < 20) || (iphl + thl > it->len) || (hdr.gso_size == 0))
+    {
+        return -1;
+    }
+    it->iphl = iphl;
+    it->hlen = iphl + thl;
+    it->mss = hdr.gso_size;
+    return 0;
+}
+
+
+int offload_next(offload_t *it, uint8_t *out, int max)
+{
+    if (it->mss == 0)
+    {
+        if (it->seg > 0)
+        {
+            return 0;
+        }
+        if (it->len > max)
+        {
+            return -1;
+        }
+        memcpy(out, it->pkt, it->len);
+        it->seg++;
+        return it->len;
+    }
+
+    int data = it->len - it->hlen;
+    if (it->off >= data)
+    {
+        return 0;
+    }
+    int chunk = data - it->off;
+    if (chunk > it->mss)
+    {
+        chunk = it->mss;
+    }
+    int len = it->hlen + chunk;
+    if (len > max)
+    {
+        return -1;
+    }
+    memcpy(out, it->pkt, it->hlen);
+    memcpy(out + it->hlen, it->pkt + it->hlen + it->off, chunk);
+
+    // 修正 IP 首部
+    if ((out[0] >> 4) == 4)
+    {
+        put16(out + 2, (uint16_t)len);
+        put16(out + 4, (uint16_t)(get16(it->pkt + 4) + it->seg));
+        put16(out + 10, 0);
+        put16(out + 10, ~csum_fold(csum_add(0, out, it->iphl)));
+    }
+    else
+    {
+        put16(out + 4, (uint16_t)(len - 40));
+    }
+
+    // 修正 TCP 首部
+    uint8_t *tcp = out + it->iphl;
+    put32(tcp + 4, get32(it->pkt + it->iphl + 4) + (uint32_t)it->off);
+    if (it->off + chunk < data)
+    {
+        tcp[13] &= ~(TCP_FIN | TCP_PSH);
+    }
+    if (it->seg > 0)
+    {
+        tcp[13] &= ~TCP_CWR;
+    }
+    put16(tcp + 16, 0);
+    uint32_t sum = csum_pseudo(out, len - it->iphl);
+    put16(tcp + 16, ~csum_fold(csum_add(sum, tcp, len - it->iphl)));
+
+    it->off += chunk;
+    it->seg++;
+    return len;
+}
+
+
+// 合并中的 TCP 流, iov 指向调用者的缓冲区, 写入 tun 之前不能修改
+static struct
+{
+    int segs;
+    int len;
+    int iphl;
+    int hlen;
+    int mss;
+    int closed;
+    int psh;
+    uint32_t seq;
+    uint8_t *pkt;
+    vnet_hdr_t hdr;
+    struct iovec iov[BATCH_MAX + 1];
+} rx;
+
+
+static int can_merge(const uint8_t *pkt, int len)
+{
+    const uint8_t *head = rx.pkt;
+    int hlen;
+    if (rx.closed || (rx.segs >= BATCH_MAX))
+    {
+        return 0;
+    }
+    int iphl = tcp_parse(pkt, len, &hlen);
+    if ((iphl != rx.iphl) || (hlen != rx.hlen) || ((pkt[0] >> 4) != (head[0] >> 4)))
+    {
+        return 0;
+    }
+    int payload = len - hlen;
+    if ((payload <= 0) || (payload > rx.mss) || (rx.len + payload > IP_LEN_MAX))
+    {
+        return 0;
+    }
+    if (iphl == 20)
+    {
+        // 相同 TOS/TTL/DF 和地址
+        if ((pkt[1] != head[1]) || (pkt[8] != head[8]) || ((pkt[6] & 0x40) != (head[6] & 0x40))
+            || (memcmp(pkt + 12, head + 12, 8) != 0))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        if ((memcmp(pkt, head, 4) != 0) || (pkt[7] != head[7])
+            || (memcmp(pkt + 8, head + 8, 32) != 0))
+        {
+            return 0;
+        }
+    }
+    const uint8_t *tcp = pkt + iphl;
+    const uint8_t *htcp = head + iphl;
+    // 端口, ACK, 窗口和选项都相同, 序号连续
+    if (((tcp[13] & ~TCP_PSH) != TCP_ACK) || (get32(tcp + 4) != rx.seq)
+        || (memcmp(tcp, htcp, 4) != 0) || (memcmp(tcp + 8, htcp + 8, 4) != 0)
+        || (memcmp(tcp + 14, htcp + 14, 2) != 0)
+        || (memcmp(tcp + 20, htcp + 20, hlen - iphl - 20) != 0))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+
+int offload_push(int tun, uint8_t *pkt, int len)
+{
+    if (rx.segs > 0)
+    {
+        if (can_merge(pkt, len))
+        {
+            int payload = len - rx.hlen;
+            rx.iov[rx.segs + 1].iov_base = pkt + rx.hlen;
+            rx.iov[rx.segs + 1].iov_len = payload;
+            rx.segs++;
+            rx.len += payload;
+            rx.seq += (uint32_t)payload;
+            if (pkt[rx.iphl + 13] & TCP_PSH)
+            {
+                rx.psh = 1;
+                rx.closed = 1;
+            }
+            else if (payload < rx.mss)
+            {
+                rx.closed = 1;
+            }
+            return 0;
+        }
+        if (offload_flush(tun) != 0)
+        {
+            return -1;
+        }
+    }
+
+    rx.pkt = pkt;
+    rx.len = len;
+    rx.segs = 1;
+    rx.psh = 0;
+    rx.iov[1].iov_base = pkt;
+    rx.iov[1].iov_len = len;
+    rx.iphl = tcp_parse(pkt, len, &rx.hlen);
+    if ((rx.iphl < 0) || (pkt[rx.iphl + 13] != TCP_ACK) || (len - rx.hlen <= 0))
+    {
+        // 只合并纯 ACK 的数据段, 其它包直接写入
+        rx.closed = 1;
+        return offload_flush(tun);
+    }
+    rx.mss = len - rx.hlen;
+    rx.seq = get32(pkt + rx.iphl + 4) + (uint32_t)rx.mss;
+    rx.closed = 0;
+    return 0;
+}
+
+
+int offload_flush(int tun)
+{
+    if (rx.segs == 0)
+    {
+        return 0;
+    }
+
+    memset(&rx.hdr, 0, sizeof(rx.hdr));
+    if (rx.segs > 1)
+    {
+        uint8_t *pkt = rx.pkt;
+        if (rx.iphl == 20)
+        {
+            put16(pkt + 2, (uint16_t)rx.len);
+            put16(pkt + 10, 0);
+            put16(pkt + 10, ~csum_fold(csum_add(0, pkt, rx.iphl)));
+            rx.hdr.gso_type = VNET_GSO_TCPV4;
+        }
+        else
+        {
+            put16(pkt + 4, (uint16_t)(rx.len - 40));
+            rx.hdr.gso_type = VNET_GSO_TCPV6;
+        }
+        uint8_t *tcp = pkt + rx.iphl;
+        if (rx.psh)
+        {
+            tcp[13] |= TCP_PSH;
+        }
+        // 内核按 NEEDS_CSUM 补全校验和, 这里只填伪首部
+        put16(tcp + 16, csum_fold(csum_pseudo(pkt, rx.len - rx.iphl)));
+        rx.hdr.flags = VNET_F_NEEDS_CSUM;
+        rx.hdr.hdr_len = (uint16_t)rx.hlen;
+        rx.hdr.gso_size = (uint16_t)rx.mss;
+        rx.hdr.csum_start = (uint16_t)rx.iphl;
+        rx.hdr.csum_offset = 16;
+    }
+    rx.iov[0].iov_base = &rx.hdr;
+    rx.iov[0].iov_len = VNET_HDR_LEN;
+
+    ssize_t n = writev(tun, rx.iov, rx.segs + 1);
+    rx.segs = 0;
+    return (n < 0) ? -1 : 0;
+}
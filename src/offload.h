@@ -0,0 +1,64 @@
+/*
+ * offload.h - tun virtio-net header offload (TSO/GRO)
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdint.h>
+
+// same layout as struct virtio_net_hdr, host byte order
+typedef struct
+{
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+} vnet_hdr_t;
+
+#define VNET_HDR_LEN ((int)sizeof(vnet_hdr_t))
+// largest packet read from tun in offload mode
+#define OFFLOAD_BUF_SIZE (VNET_HDR_LEN + 65535)
+
+// iterator over the MTU-sized packets of one packet read from tun
+typedef struct
+{
+    uint8_t *pkt;
+    int len;
+    int iphl;
+    int hlen;
+    int mss;
+    int off;
+    int seg;
+} offload_t;
+
+// parse packet read from tun (vnet header + IP packet), return -1 if invalid
+extern int offload_begin(offload_t *it, uint8_t *buf, int n);
+
+// copy next segment to out, return its length, 0 when done, -1 if too large
+extern int offload_next(offload_t *it, uint8_t *out, int max);
+
+// queue a decapsulated IP packet, coalescing in-order TCP segments
+extern int offload_push(int tun, uint8_t *pkt, int len);
+
+// write queued packets to tun
+extern int offload_flush(int tun);
+
+#endif // OFFLOAD_H
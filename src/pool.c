@@ -0,0 +1,151 @@
+/*
+ * pool.c - preallocated packet buffer pool
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "pool.h"
+
+#define CACHE_LINE 64
+#define HUGE_PAGE  (2 * 1024 * 1024)
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+ 每个 slot 放一个 pbuf_t, 按 cache line 对齐. pbuf_t 的 payload 前面已经留了
+ nonce 等首部的位置, 封装时不需要额外的 headroom
+
+ 空闲 slot 保存在栈里, 后进先出, 刚释放的 buffer 还在 cache 中
+*/
+static uint8_t *base = NULL;
+static size_t base_len;
+static size_t slot;
+static pbuf_t **free_list;
+static int nfree;
+static pool_stat_t counters;
+
+
+int pool_init(int count, int hugepages)
+{
+    assert(base == NULL);
+    assert(count > 0);
+
+    slot = ALIGN(sizeof(pbuf_t), CACHE_LINE);
+    base_len = slot * count;
+    base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugepages)
+    {
+        base_len = ALIGN(base_len, HUGE_PAGE);
+        base = mmap(NULL, base_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            LOG("huge pages not available, using normal pages");
+            base_len = slot * count;
+        }
+    }
+#else
+    if (hugepages)
+    {
+        LOG("huge pages not supported, using normal pages");
+    }
+#endif
+    if (base == MAP_FAILED)
+    {
+        base = mmap(NULL, base_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base == MAP_FAILED)
+    {
+        ERROR("mmap");
+        base = NULL;
+        return -1;
+    }
+
+    free_list = malloc(sizeof(pbuf_t *) * count);
+    if (free_list == NULL)
+    {
+        ERROR("malloc");
+        munmap(base, base_len);
+        base = NULL;
+        return -1;
+    }
+    // 倒序入栈, 先分配低地址的 slot
+    for (int i = 0; i < count; i++)
+    {
+        free_list[i] = (pbuf_t *)(base + slot * (count - 1 - i));
+    }
+    nfree = count;
+    counters.size = count;
+    counters.used = 0;
+    counters.peak = 0;
+    counters.exhausted = 0;
+    return 0;
+}
+
+
+void pool_destroy(void)
+{
+    if (base != NULL)
+    {
+        munmap(base, base_len);
+        free(free_list);
+        base = NULL;
+    }
+}
+
+
+pbuf_t *pool_get(void)
+{
+    if (nfree == 0)
+    {
+        counters.exhausted++;
+        return NULL;
+    }
+    counters.used++;
+    if (counters.used > counters.peak)
+    {
+        counters.peak = counters.used;
+    }
+    return free_list[--nfree];
+}
+
+
+void pool_put(pbuf_t *pbuf)
+{
+    assert(((uint8_t *)pbuf >= base) && ((uint8_t *)pbuf < base + slot * counters.size));
+    assert(nfree < counters.size);
+    free_list[nfree++] = pbuf;
+    counters.used--;
+}
+
+
+void pool_stat(pool_stat_t *s)
+{
+    *s = counters;
+}
@@ -0,0 +1,50 @@
+/*
+ * pool.h - preallocated packet buffer pool
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "encapsulate.h"
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+typedef struct
+{
+    int size;
+    int used;
+    int peak;
+    // pool_get() calls that found the pool empty
+    uint64_t exhausted;
+} pool_stat_t;
+
+// allocate count buffers, optionally backed by huge pages
+extern int pool_init(int count, int hugepages);
+extern void pool_destroy(void);
+
+// return NULL if the pool is empty
+extern pbuf_t *pool_get(void);
+extern void pool_put(pbuf_t *pbuf);
+
+extern void pool_stat(pool_stat_t *stat);
+
+#endif // POOL_H
@@ -0,0 +1,217 @@
+/*
+ * probe.c - RTT, jitter and loss of paths, and schedulers using them
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "conf.h"
+#include "encapsulate.h"
+#include "probe.h"
+
+#define PROBE_TIMEOUT_MIN 1000000
+
+
+uint32_t probe_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+
+static void lost(probe_t *probe, int i)
+{
+    probe->pending &= ~(1u << i);
+    probe->expired |= 1u << i;
+    probe->lost++;
+    probe->loss = (probe->loss * 15 + 1000) / 16;
+}
+
+
+void probe_mark(probe_t *probe, pbuf_t *pbuf, int force, uint32_t t)
+{
+    if (!force && (t - probe->last < PROBE_INTERVAL))
+    {
+        return;
+    }
+    // 多个 worker 共享同一个 path 的状态, 拿不到锁就不发这个探测
+    if (spin_lock(&(probe->lock)) != 0)
+    {
+        return;
+    }
+    if (!force && (t - probe->last < PROBE_INTERVAL))
+    {
+        // 其它 worker 刚发过
+        spin_unlock(&(probe->lock));
+        return;
+    }
+
+    uint32_t timeout = (uint32_t)(2 * probe->srtt + 4 * probe->rttvar);
+    if (timeout < PROBE_TIMEOUT_MIN)
+    {
+        timeout = PROBE_TIMEOUT_MIN;
+    }
+    for (int i = 0; i < PROBE_WINDOW; i++)
+    {
+        if ((probe->pending & (1u << i)) && (t - probe->ts[i] > timeout))
+        {
+            lost(probe, i);
+        }
+    }
+
+    // 覆盖最老的一个
+    int i = probe->next;
+    if (probe->pending & (1u << i))
+    {
+        lost(probe, i);
+    }
+    probe->expired &= ~(1u << i);
+    probe->pending |= 1u << i;
+    probe->ts[i] = t;
+    probe->next = (i + 1) % PROBE_WINDOW;
+    probe->last = t;
+    probe->sent++;
+    spin_unlock(&(probe->lock));
+
+    pbuf->flag |= FLAG_TS;
+    pbuf->ack = htonl(t);
+}
+
+
+void probe_echo(probe_t *probe, uint32_t ts, uint32_t t)
+{
+    if (spin_lock(&(probe->lock)) != 0)
+    {
+        // 丢掉这个回显, 相当于它没有到达
+        return;
+    }
+    int i;
+    for (i = 0; i < PROBE_WINDOW; i++)
+    {
+        if ((probe->ts[i] == ts) && ((probe->pending | probe->expired) & (1u << i)))
+        {
+            break;
+        }
+    }
+    if (i == PROBE_WINDOW)
+    {
+        // 重复或者太旧的回显
+        spin_unlock(&(probe->lock));
+        return;
+    }
+    if (probe->pending & (1u << i))
+    {
+        probe->echoed++;
+        probe->loss = probe->loss * 15 / 16;
+    }
+    // 已经算作丢失的回显仍然用来估计 RTT, 否则 RTT 突然变大时永远测不到
+    probe->pending &= ~(1u << i);
+    probe->expired &= ~(1u << i);
+
+    // RFC 6298
+    int rtt = (int)(t - ts);
+    if (probe->srtt == 0)
+    {
+        probe->srtt = rtt;
+        probe->rttvar = rtt / 2;
+    }
+    else
+    {
+        int delta = (probe->srtt > rtt) ? probe->srtt - rtt : rtt - probe->srtt;
+        probe->rttvar = (probe->rttvar * 3 + delta) / 4;
+        probe->srtt = (probe->srtt * 7 + rtt) / 8;
+    }
+    if (probe->srtt == 0)
+    {
+        // 0 表示还没有测量
+        probe->srtt = 1;
+    }
+    spin_unlock(&(probe->lock));
+}
+
+
+static int64_t isqrt(int64_t x)
+{
+    int64_t r = x;
+    int64_t y = (x + 1) / 2;
+    while (y < r)
+    {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+    return r;
+}
+
+
+// 估计的带宽, 按 Mathis 公式正比于 1 / (RTT * sqrt(loss)), 丢包率最低按 0.1% 算
+static int64_t capacity(const probe_t *probe)
+{
+    int loss = (probe->loss > 1) ? probe->loss : 1;
+    return (int64_t)1000000000000LL / ((int64_t)probe->srtt * isqrt((int64_t)loss * 100));
+}
+
+
+int probe_schedule(const probe_t *probes, const int *paths, int count,
+                   int scheduler, int64_t *current)
+{
+    int best = -1;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const probe_t *p = &probes[paths[i]];
+        if (p->srtt == 0)
+        {
+            continue;
+        }
+        if (scheduler == SCHED_WEIGHTED)
+        {
+            // smooth weighted round-robin
+            int64_t weight = capacity(p);
+            current[paths[i]] += weight;
+            total += weight;
+            if ((best < 0) || (current[paths[i]] > current[best]))
+            {
+                best = paths[i];
+            }
+            continue;
+        }
+        if (best >= 0)
+        {
+            const probe_t *b = &probes[best];
+            if (scheduler == SCHED_LOWLOSS)
+            {
+                if ((p->loss > b->loss) || ((p->loss == b->loss) && (p->srtt >= b->srtt)))
+                {
+                    continue;
+                }
+            }
+            else if (p->srtt >= b->srtt)
+            {
+                continue;
+            }
+        }
+        best = paths[i];
+    }
+    if ((scheduler == SCHED_WEIGHTED) && (best >= 0))
+    {
+        current[best] -= total;
+    }
+    return best;
+}
@@ -0,0 +1,73 @@
+/*
+ * probe.h - RTT, jitter and loss of paths, and schedulers using them
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+
+#include "encapsulate.h"
+#include "spinlock.h"
+
+/*
+ A packet with FLAG_TS carries the send time of its sender (us, network
+ order) in ACK. The peer answers at once with an empty packet with
+ FLAG_ECHO and the same ACK, so the sender gets the RTT of that path.
+ Heartbeats are always probes, other packets at most every PROBE_INTERVAL.
+ A probe without an echo within max(1 s, 2 * srtt + 4 * rttvar) is lost.
+*/
+
+#define PROBE_INTERVAL 100000
+#define PROBE_WINDOW   16
+
+typedef struct
+{
+    spinlock_t lock;
+    // send time of the last probe
+    uint32_t last;
+    // smoothed RTT and its mean deviation (jitter), us, 0 before the first echo
+    int srtt;
+    int rttvar;
+    // loss rate of recent probes, per mille
+    int loss;
+    // recent probes, waiting for echo or already counted as lost
+    uint32_t ts[PROBE_WINDOW];
+    uint32_t pending;
+    uint32_t expired;
+    int next;
+    uint64_t sent;
+    uint64_t echoed;
+    uint64_t lost;
+} __attribute__((aligned(64))) probe_t;
+
+// monotonic clock, us
+extern uint32_t probe_clock(void);
+
+// make pbuf a probe if one is due, or always if force
+extern void probe_mark(probe_t *probe, pbuf_t *pbuf, int force, uint32_t t);
+
+// an echo of ts arrived
+extern void probe_echo(probe_t *probe, uint32_t ts, uint32_t t);
+
+// choose one of count paths by scheduler (SCHED_*), current keeps the
+// state of weighted, return -1 if none of them has been measured yet
+extern int probe_schedule(const probe_t *probes, const int *paths, int count,
+                          int scheduler, int64_t *current);
+
+#endif // PROBE_H
@@ -0,0 +1,320 @@
+/*
+ * reorder.c - put packets sprayed over paths back in order
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reorder.h"
+
+// 序号相差这么多时认为对端重启了, 重新开始
+#define REORDER_RESYNC (REORDER_SLOTS * 16)
+
+static void (*output)(const uint8_t *pkt, int len);
+static int mtu;
+static uint8_t *bufs;
+static int lens[REORDER_SLOTS];
+static int64_t arrived[REORDER_SLOTS];
+// next 之前 REORDER_SLOTS 个序号是否已经写出, 用来丢弃重复的包
+static uint64_t done[REORDER_SLOTS / 64];
+
+static int started;
+static uint32_t next;
+static int held;
+// 本次 reorder_input 写出的缓存的包
+static int released;
+// 等待 next 的开始时间, 即最早收到的后续包
+static int64_t waiting;
+// 最近一次跳过空洞的时间
+static int64_t skipped_at;
+
+// 空洞等待时间的均值, ms * 8
+static int wait8 = 5 * 8;
+static int skew;
+static int rate;
+static int timeout;
+static int depth;
+
+static reorder_stat_t stat;
+
+
+static void tune(void)
+{
+    timeout = wait8 / 4;
+    if (timeout < skew)
+    {
+        timeout = skew;
+    }
+    if (timeout < REORDER_TIMEOUT_MIN)
+    {
+        timeout = REORDER_TIMEOUT_MIN;
+    }
+    else if (timeout > REORDER_TIMEOUT_MAX)
+    {
+        timeout = REORDER_TIMEOUT_MAX;
+    }
+
+    depth = (int)((int64_t)rate * timeout * 2 / 1000);
+    if (depth < REORDER_DEPTH_MIN)
+    {
+        depth = REORDER_DEPTH_MIN;
+    }
+    else if (depth > REORDER_SLOTS)
+    {
+        depth = REORDER_SLOTS;
+    }
+}
+
+
+int reorder_init(int size, void (*fn)(const uint8_t *pkt, int len))
+{
+    free(bufs);
+    bufs = (uint8_t *)malloc((size_t)size * REORDER_SLOTS);
+    if (bufs == NULL)
+    {
+        return -1;
+    }
+    mtu = size;
+    output = fn;
+    memset(lens, 0, sizeof(lens));
+    memset(done, 0, sizeof(done));
+    memset(&stat, 0, sizeof(stat));
+    started = 0;
+    held = 0;
+    skipped_at = 0;
+    wait8 = 5 * 8;
+    skew = 0;
+    rate = 0;
+    tune();
+    return 0;
+}
+
+
+static void wait_done(int64_t t)
+{
+    int wait = (int)(t - waiting);
+    wait8 = wait8 - wait8 / 8 + wait;
+    tune();
+}
+
+
+// next 写出了或者跳过了
+static void advance(int written)
+{
+    int i = next % REORDER_SLOTS;
+    if (written)
+    {
+        done[i / 64] |= 1ull << (i % 64);
+    }
+    else
+    {
+        done[i / 64] &= ~(1ull << (i % 64));
+    }
+    next++;
+}
+
+
+// 写出 next 开始连续的包, 重新计算等待的开始时间
+static void release(void)
+{
+    while (lens[next % REORDER_SLOTS] > 0)
+    {
+        int i = next % REORDER_SLOTS;
+        output(bufs + (size_t)i * mtu, lens[i]);
+        lens[i] = 0;
+        held--;
+        released++;
+        advance(1);
+    }
+    if (held > 0)
+    {
+        waiting = INT64_MAX;
+        for (uint32_t seq = next + 1; seq - next < REORDER_SLOTS; seq++)
+        {
+            int i = seq % REORDER_SLOTS;
+            if ((lens[i] > 0) && (arrived[i] < waiting))
+            {
+                waiting = arrived[i];
+            }
+        }
+    }
+}
+
+
+// 放弃 next 这个空洞, 直到下一个收到的包
+static void skip(int64_t t)
+{
+    while (lens[next % REORDER_SLOTS] == 0)
+    {
+        advance(0);
+    }
+    stat.skipped++;
+    skipped_at = t;
+    release();
+}
+
+
+// 全部写出, 从 seq 重新开始
+static void resync(uint32_t seq, int64_t t)
+{
+    while (held > 0)
+    {
+        skip(t);
+    }
+    memset(done, 0, sizeof(done));
+    next = seq;
+}
+
+
+int reorder_input(const uint8_t *pkt, int len, uint32_t seq, int64_t t)
+{
+    released = 0;
+    if ((len <= 0) || (len > mtu))
+    {
+        stat.dropped++;
+        return 0;
+    }
+    if (!started)
+    {
+        started = 1;
+        next = seq;
+    }
+
+    int32_t distance = (int32_t)(seq - next);
+    if ((distance < -REORDER_RESYNC) || (distance > REORDER_RESYNC))
+    {
+        resync(seq, t);
+        distance = 0;
+    }
+
+    if (distance < 0)
+    {
+        // 已经写出过的是重复的包, 太旧的分不清, 也当作重复的
+        int i = seq % REORDER_SLOTS;
+        if ((distance < -REORDER_SLOTS) || (done[i / 64] & (1ull << (i % 64))))
+        {
+            stat.dropped++;
+            return released;
+        }
+        // 空洞已经跳过了, 迟到的包也比丢掉好; 刚跳过的话下次多等一会
+        done[i / 64] |= 1ull << (i % 64);
+        stat.late++;
+        int wait = (int)(t - skipped_at) + timeout;
+        if ((t - skipped_at < REORDER_TIMEOUT_MAX) && (wait * 8 > wait8))
+        {
+            wait8 = wait8 - wait8 / 8 + wait;
+            tune();
+        }
+        output(pkt, len);
+        return released;
+    }
+
+    if (distance == 0)
+    {
+        output(pkt, len);
+        advance(1);
+        if (held > 0)
+        {
+            wait_done(t);
+            release();
+        }
+        return released;
+    }
+
+    // 没有空间了, 跳过最老的空洞
+    while ((held > 0) && ((int32_t)(seq - next) >= depth))
+    {
+        skip(t);
+    }
+    distance = (int32_t)(seq - next);
+    if (distance == 0)
+    {
+        output(pkt, len);
+        advance(1);
+        release();
+        return released;
+    }
+    if (distance >= depth)
+    {
+        // 之前的都没收到
+        stat.skipped++;
+        skipped_at = t;
+        if (distance >= REORDER_SLOTS)
+        {
+            memset(done, 0, sizeof(done));
+            next = seq;
+        }
+        while (next != seq)
+        {
+            advance(0);
+        }
+        output(pkt, len);
+        advance(1);
+        return released;
+    }
+
+    int i = seq % REORDER_SLOTS;
+    if (lens[i] > 0)
+    {
+        stat.dropped++;
+        return released;
+    }
+    memcpy(bufs + (size_t)i * mtu, pkt, (size_t)len);
+    lens[i] = len;
+    arrived[i] = t;
+    if (held == 0)
+    {
+        waiting = t;
+    }
+    held++;
+    stat.reordered++;
+    return released;
+}
+
+
+int64_t reorder_flush(int64_t t)
+{
+    while ((held > 0) && (t - waiting >= timeout))
+    {
+        skip(t);
+    }
+    return reorder_deadline();
+}
+
+
+int64_t reorder_deadline(void)
+{
+    return (held > 0) ? waiting + timeout : -1;
+}
+
+
+void reorder_tune(int skew_ms, int packet_rate)
+{
+    skew = skew_ms;
+    rate = packet_rate;
+    tune();
+}
+
+
+void reorder_stat(reorder_stat_t *s)
+{
+    *s = stat;
+    s->timeout = timeout;
+    s->depth = depth;
+}
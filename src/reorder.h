@@ -0,0 +1,75 @@
+/*
+ * reorder.h - put packets sprayed over paths back in order
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stdint.h>
+
+/*
+ The sender numbers data packets of the tunnel with FLAG_SEQ. The receiver
+ writes a packet at once if it is the next one, otherwise holds it until
+ the missing ones arrive or the oldest held packet has waited the timeout,
+ then skips the gap. Packets behind the gap are written late unless they
+ were already written; duplicates and packets too old to tell are dropped.
+
+ The timeout follows the delay skew between paths: twice the average time
+ a gap took to fill, at least the skew measured by probes, longer after
+ late packets. The depth is the packets arriving in two timeouts.
+*/
+
+#define REORDER_SLOTS       256
+#define REORDER_DEPTH_MIN   16
+// ms
+#define REORDER_TIMEOUT_MIN 2
+#define REORDER_TIMEOUT_MAX 200
+
+typedef struct
+{
+    // held until the packets before them arrived
+    uint64_t reordered;
+    // arrived after their gap was skipped, written out of order
+    uint64_t late;
+    // duplicates, older than REORDER_SLOTS, or no room to hold
+    uint64_t dropped;
+    // gaps skipped on timeout or when the buffer was full
+    uint64_t skipped;
+    int timeout;
+    int depth;
+} reorder_stat_t;
+
+// output writes a packet to tun, packets are at most mtu bytes
+extern int reorder_init(int mtu, void (*output)(const uint8_t *pkt, int len));
+
+// return how many held packets were written, their buffers may be reused
+// by the next call
+extern int reorder_input(const uint8_t *pkt, int len, uint32_t seq, int64_t t);
+
+// release packets that waited long enough, return when to call again, -1 if empty
+extern int64_t reorder_flush(int64_t t);
+
+// when the oldest held packet times out, -1 if empty
+extern int64_t reorder_deadline(void);
+
+// delay skew between paths measured by probes (ms), received packets per second
+extern void reorder_tune(int skew, int rate);
+
+extern void reorder_stat(reorder_stat_t *stat);
+
+#endif // REORDER_H
@@ -0,0 +1,448 @@
+/*
+ * session.c - clients of a multi-client server
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <libmill.h>
+#include <sodium.h>
+
+#include "conf.h"
+#include "spinlock.h"
+#include "totp.h"
+#include "session.h"
+
+// 和 path 的 alive 一样, 5 个 TOTP_STEP 内收到过包
+#define SESSION_ALIVE (5 * TOTP_STEP)
+
+// 槽位一旦使用就不再清空, 查找时遇到空槽位即可停止;
+// 槽位只在 lock 和 seqlock 保护下改写, 读者读完后检查 seq.
+// 过期的槽位会分给新地址, 拿着指针的读者要确认地址没变
+struct session
+{
+    volatile uint32_t seq;
+    spinlock_t lock;
+    volatile uint32_t used;
+    uint8_t addr[SESSION_KEY_LEN];
+    int64_t seen;
+    uint32_t next;
+    struct
+    {
+        int token;
+        int64_t seen;
+        ipaddr remote;
+        // 客户端使用的格式, 按同样的格式回复
+        int cipher;
+    } paths[PATH_MAX_COUNT];
+    uint64_t in_packets;
+    uint64_t in_bytes;
+    uint64_t out_packets;
+    uint64_t out_bytes;
+} __attribute__((aligned(64)));
+
+typedef struct
+{
+    // 只有新建会话时加锁
+    spinlock_t lock;
+    uint32_t seed;
+    uint32_t mask;
+    int max;
+    int path_count;
+    int used;
+    uint64_t created;
+    uint64_t full;
+} __attribute__((aligned(64))) table_t;
+
+static table_t *table;
+static session_t *slots;
+
+// IPv4 地址按 ::ffff:a.b.c.d 存放
+static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+
+static uint32_t hash(const uint8_t *key)
+{
+    uint32_t w[SESSION_KEY_LEN / 4];
+    memcpy(w, key, SESSION_KEY_LEN);
+    uint32_t h = table->seed;
+    for (int i = 0; i < SESSION_KEY_LEN / 4; i++)
+    {
+        h = (h ^ w[i]) * 0x9e3779b1u;
+    }
+    // IPv4 地址只在最后 4 字节, 低位也要混入高位
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+
+int session_init(int max, int path_count)
+{
+    // 负载不超过一半
+    uint32_t size = 1;
+    while (size < (uint32_t)max * 2)
+    {
+        size <<= 1;
+    }
+    size_t bytes = sizeof(table_t) + sizeof(session_t) * size;
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+    memset(p, 0, bytes);
+    table = (table_t *)p;
+    slots = (session_t *)(table + 1);
+    table->seed = randombytes_random();
+    table->mask = size - 1;
+    table->max = max;
+    table->path_count = path_count;
+    return 0;
+}
+
+
+int session_addr(const char *addr, uint8_t *key)
+{
+    char buf[SESSION_ADDRSTRLEN];
+    size_t len = strcspn(addr, "/");
+    if (len >= sizeof(buf))
+    {
+        return -1;
+    }
+    memcpy(buf, addr, len);
+    buf[len] = '\0';
+    if (inet_pton(AF_INET, buf, key + 12) == 1)
+    {
+        memcpy(key, v4mapped, 12);
+        return 0;
+    }
+    return (inet_pton(AF_INET6, buf, key) == 1) ? 0 : -1;
+}
+
+
+const char *session_addrstr(const uint8_t *key, char *buf)
+{
+    if (memcmp(key, v4mapped, 12) == 0)
+    {
+        return inet_ntop(AF_INET, key + 12, buf, SESSION_ADDRSTRLEN);
+    }
+    return inet_ntop(AF_INET6, key, buf, SESSION_ADDRSTRLEN);
+}
+
+
+int session_key(const uint8_t *pkt, int len, int dst, uint8_t *key)
+{
+    if ((len >= 20) && ((pkt[0] >> 4) == 4))
+    {
+        memcpy(key, v4mapped, 12);
+        memcpy(key + 12, pkt + (dst ? 16 : 12), 4);
+        return 0;
+    }
+    else if ((len >= 40) && ((pkt[0] >> 4) == 6))
+    {
+        memcpy(key, pkt + (dst ? 24 : 8), SESSION_KEY_LEN);
+        return 0;
+    }
+    return -1;
+}
+
+
+// 等到没有写者时返回 seq, 写者进程退出时替它结束, 等待太久返回 -1
+static int read_begin(session_t *s, uint32_t *seq, int *spins)
+{
+    while ((*seq = s->seq) & 1)
+    {
+        int32_t owner = spin_dead(&(s->lock), *spins);
+        if ((owner != 0) && __sync_bool_compare_and_swap(&(s->lock), owner, (int32_t)getpid()))
+        {
+            // 写了一半的槽位内容不可信, 作为过期槽位留给新地址
+            if (s->seq & 1)
+            {
+                s->seen = 0;
+                __sync_fetch_and_add(&(s->seq), 1);
+            }
+            spin_unlock(&(s->lock));
+        }
+        if (spin_wait(spins) != 0)
+        {
+            return -1;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return 0;
+}
+
+
+static int read_retry(session_t *s, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return seq != s->seq;
+}
+
+
+static int write_begin(session_t *s)
+{
+    if (spin_lock(&(s->lock)) != 0)
+    {
+        return -1;
+    }
+    // 接手了退出的写者留下的锁
+    if (s->seq & 1)
+    {
+        s->seen = 0;
+        __sync_fetch_and_add(&(s->seq), 1);
+    }
+    __sync_fetch_and_add(&(s->seq), 1);
+    return 0;
+}
+
+
+static void write_end(session_t *s)
+{
+    __sync_fetch_and_add(&(s->seq), 1);
+    spin_unlock(&(s->lock));
+}
+
+
+session_t *session_find(const uint8_t *key)
+{
+    uint32_t h = hash(key) & table->mask;
+    int spins = 0;
+    while (1)
+    {
+        session_t *s = &slots[h];
+        if (!s->used)
+        {
+            return NULL;
+        }
+        uint32_t seq;
+        if (read_begin(s, &seq, &spins) != 0)
+        {
+            return NULL;
+        }
+        int same = (memcmp(s->addr, key, SESSION_KEY_LEN) == 0);
+        if (read_retry(s, seq))
+        {
+            // 正在被改写, 重新比较
+            if (spin_wait(&spins) != 0)
+            {
+                return NULL;
+            }
+            continue;
+        }
+        if (same)
+        {
+            return s;
+        }
+        h = (h + 1) & table->mask;
+    }
+}
+
+
+session_t *session_learn(const uint8_t *key, int64_t t)
+{
+    session_t *s = session_find(key);
+    if (s != NULL)
+    {
+        return s;
+    }
+
+    if (spin_lock(&(table->lock)) != 0)
+    {
+        return NULL;
+    }
+    // 加锁之后再找一遍, 其它 worker 可能刚刚建立
+    session_t *reuse = NULL;
+    uint32_t h = hash(key) & table->mask;
+    for (s = &slots[h]; s->used; s = &slots[h])
+    {
+        if (memcmp(s->addr, key, SESSION_KEY_LEN) == 0)
+        {
+            spin_unlock(&(table->lock));
+            return s;
+        }
+        if ((reuse == NULL) && (t - s->seen > SESSION_TIMEOUT))
+        {
+            reuse = s;
+        }
+        h = (h + 1) & table->mask;
+    }
+    if (reuse == NULL)
+    {
+        if (table->used >= table->max)
+        {
+            table->full++;
+            spin_unlock(&(table->lock));
+            return NULL;
+        }
+        reuse = s;
+        table->used++;
+    }
+
+    s = reuse;
+    if (write_begin(s) != 0)
+    {
+        spin_unlock(&(table->lock));
+        return NULL;
+    }
+    memcpy(s->addr, key, SESSION_KEY_LEN);
+    memset(s->paths, 0, sizeof(s->paths));
+    s->seen = t;
+    s->in_packets = 0;
+    s->in_bytes = 0;
+    s->out_packets = 0;
+    s->out_bytes = 0;
+    s->used = 1;
+    write_end(s);
+    table->created++;
+    spin_unlock(&(table->lock));
+    return s;
+}
+
+
+void session_seen(session_t *s, const uint8_t *key, int path, int token, ipaddr remote,
+                  int cipher, int64_t t)
+{
+    if ((s->paths[path].token == token) && (s->paths[path].cipher == cipher)
+        && (t - s->paths[path].seen < 100)
+        && (memcmp(&(s->paths[path].remote), &remote, sizeof(ipaddr)) == 0))
+    {
+        // nothing changed, avoid bouncing the cache line between cores
+        return;
+    }
+
+    if (write_begin(s) != 0)
+    {
+        return;
+    }
+    if (memcmp(s->addr, key, SESSION_KEY_LEN) != 0)
+    {
+        // 槽位已经分给了别的地址
+        write_end(s);
+        return;
+    }
+    s->paths[path].token = token;
+    s->paths[path].seen = t;
+    s->paths[path].remote = remote;
+    s->paths[path].cipher = cipher;
+    s->seen = t;
+    write_end(s);
+}
+
+
+int session_route(session_t *s, const uint8_t *key, int64_t t, int *token, ipaddr *remote,
+                  int *cipher)
+{
+    // 轮流使用可用的 path, 多个 worker 同时修改 next 也无妨
+    uint32_t start = s->next++;
+    int spins = 0;
+    for (int i = 0; i < table->path_count; i++)
+    {
+        int path = (int)((start + i) % table->path_count);
+        int64_t seen;
+        int same;
+        uint32_t seq;
+        while (1)
+        {
+            if (read_begin(s, &seq, &spins) != 0)
+            {
+                return -1;
+            }
+            same = (memcmp(s->addr, key, SESSION_KEY_LEN) == 0);
+            seen = s->paths[path].seen;
+            *token = s->paths[path].token;
+            *remote = s->paths[path].remote;
+            *cipher = s->paths[path].cipher;
+            if (!read_retry(s, seq))
+            {
+                break;
+            }
+            if (spin_wait(&spins) != 0)
+            {
+                return -1;
+            }
+        }
+        if (!same)
+        {
+            // 查找之后槽位分给了别的地址
+            return -1;
+        }
+        if ((seen != 0) && (t - seen < SESSION_ALIVE))
+        {
+            return path;
+        }
+    }
+    return -1;
+}
+
+
+void session_count(session_t *s, int out, int bytes)
+{
+    if (out)
+    {
+        __sync_fetch_and_add(&(s->out_packets), 1);
+        __sync_fetch_and_add(&(s->out_bytes), (uint64_t)bytes);
+    }
+    else
+    {
+        __sync_fetch_and_add(&(s->in_packets), 1);
+        __sync_fetch_and_add(&(s->in_bytes), (uint64_t)bytes);
+    }
+}
+
+
+int session_next(int i, session_info_t *info)
+{
+    for (; i <= (int)table->mask; i++)
+    {
+        session_t *s = &slots[i];
+        if (s->used)
+        {
+            memcpy(info->addr, s->addr, SESSION_KEY_LEN);
+            info->seen = s->seen;
+            info->in_packets = s->in_packets;
+            info->in_bytes = s->in_bytes;
+            info->out_packets = s->out_packets;
+            info->out_bytes = s->out_bytes;
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void session_stat(session_stat_t *stat, int64_t t)
+{
+    stat->active = 0;
+    for (uint32_t i = 0; i <= table->mask; i++)
+    {
+        if (slots[i].used && (t - slots[i].seen <= SESSION_TIMEOUT))
+        {
+            stat->active++;
+        }
+    }
+    stat->created = table->created;
+    stat->full = table->full;
+}
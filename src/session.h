@@ -0,0 +1,95 @@
+/*
+ * session.h - clients of a multi-client server
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include <libmill.h>
+
+/*
+ A session is one inner address of a client: the source address of its
+ packets, or an address it announces in heartbeats with FLAG_IDENT. The
+ heartbeat payload is one key per address, IPv4 as ::ffff:a.b.c.d.
+
+ The table is shared by all workers. Packets read from tun go to the session
+ of their destination address, through a path the client was recently seen
+ on, so every client is reachable from every worker.
+*/
+
+#define SESSION_KEY_LEN 16
+// long enough for an IPv6 address
+#define SESSION_ADDRSTRLEN 46
+
+typedef struct session session_t;
+
+typedef struct
+{
+    uint8_t addr[SESSION_KEY_LEN];
+    int64_t seen;
+    uint64_t in_packets;
+    uint64_t in_bytes;
+    uint64_t out_packets;
+    uint64_t out_bytes;
+} session_info_t;
+
+typedef struct
+{
+    // sessions seen in the last SESSION_TIMEOUT
+    int active;
+    uint64_t created;
+    // new addresses rejected because the table was full
+    uint64_t full;
+} session_stat_t;
+
+// 空闲超过这个时间的会话可以让给新地址
+#define SESSION_TIMEOUT (60 * 1000)
+
+// table for max sessions over path_count paths, call before fork
+extern int session_init(int max, int path_count);
+
+// key of an address in the config file, "10.0.0.2/24" or "fd00::2/64"
+extern int session_addr(const char *addr, uint8_t *key);
+extern const char *session_addrstr(const uint8_t *key, char *buf);
+
+// source (dst = 0) or destination address of an IP packet, -1 if not IP
+extern int session_key(const uint8_t *pkt, int len, int dst, uint8_t *key);
+
+extern session_t *session_find(const uint8_t *key);
+// find or create, NULL if the table is full
+extern session_t *session_learn(const uint8_t *key, int64_t t);
+
+// a valid packet of the session in format cipher arrived on path; key is the
+// address s was found for, the slot may have been given to another since
+extern void session_seen(session_t *s, const uint8_t *key, int path, int token, ipaddr remote,
+                         int cipher, int64_t t);
+
+// choose a path the session of key is alive on, return -1 if none
+extern int session_route(session_t *s, const uint8_t *key, int64_t t, int *token, ipaddr *remote,
+                         int *cipher);
+
+extern void session_count(session_t *s, int out, int bytes);
+
+// fill info of the next used slot from i on, return its index or -1
+extern int session_next(int i, session_info_t *info);
+
+extern void session_stat(session_stat_t *stat, int64_t t);
+
+#endif // SESSION_H
@@ -0,0 +1,103 @@
+/*
+ * spinlock.c - locks shared by worker processes
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "spinlock.h"
+
+// 先空转 SPIN_PAUSE 次, 之后每次让出 CPU; 每 SPIN_CHECK 次检查持有者是否还在
+#define SPIN_PAUSE 64
+#define SPIN_CHECK 256
+#define SPIN_MAX   (1 << 20)
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#  define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#  define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+
+int spin_wait(int *spins)
+{
+    if (*spins >= SPIN_MAX)
+    {
+        return -1;
+    }
+    if (*spins < SPIN_PAUSE)
+    {
+        cpu_relax();
+    }
+    else
+    {
+        sched_yield();
+    }
+    (*spins)++;
+    return 0;
+}
+
+
+int32_t spin_dead(spinlock_t *lock, int spins)
+{
+    if (spins % SPIN_CHECK != SPIN_CHECK - 1)
+    {
+        return 0;
+    }
+    int32_t owner = *lock;
+    if ((owner > 0) && (kill(owner, 0) != 0) && (errno == ESRCH))
+    {
+        return owner;
+    }
+    return 0;
+}
+
+
+int spin_lock(spinlock_t *lock)
+{
+    int32_t self = (int32_t)getpid();
+    int spins = 0;
+    while (1)
+    {
+        if ((*lock == 0) && __sync_bool_compare_and_swap(lock, 0, self))
+        {
+            return 0;
+        }
+        int32_t owner = spin_dead(lock, spins);
+        if ((owner != 0) && __sync_bool_compare_and_swap(lock, owner, self))
+        {
+            // 持有者已经退出, 接手
+            return 0;
+        }
+        if (spin_wait(&spins) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+
+void spin_unlock(spinlock_t *lock)
+{
+    __sync_lock_release(lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * spinlock.h - locks shared by worker processes
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+/*
+ A lock in memory shared by the worker processes holds the pid of its owner,
+ 0 when free. Waiters pause, then yield the CPU, and take the lock over when
+ the owner has exited; a lock that stays held by a live process for about a
+ second is given up on.
+*/
+
+typedef volatile int32_t spinlock_t;
+
+// return 0 when acquired, -1 after waiting too long
+extern int spin_lock(spinlock_t *lock);
+extern void spin_unlock(spinlock_t *lock);
+
+// one step of backoff, spins counts the steps taken, return -1 when too many
+extern int spin_wait(int *spins);
+
+// pid of the owner if it has exited, otherwise 0; checked every few steps
+extern int32_t spin_dead(spinlock_t *lock, int spins);
+
+#endif // SPINLOCK_H
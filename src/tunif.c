@@ -29,6 +29,7 @@
 #ifdef TARGET_LINUX
 #  include <linux/if.h>
 #  include <linux/if_tun.h>
+#  include <linux/virtio_net.h>
 #endif
 
 #ifdef TARGET_DARWIN
@@ -41,7 +42,7 @@
 
 
 #ifdef TARGET_LINUX
-int tun_new(const char *dev)
+int tun_new(const char *dev, int multi_queue, int vnet_hdr)
 {
     struct ifreq ifr;
     int fd, err;
@@ -55,31 +56,57 @@ int tun_new(const char *dev)
     memset(&ifr, 0, sizeof(struct ifreq));
 
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    if (multi_queue)
+    {
+        // every call attaches one more queue to the same device
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
     if (*dev != '\0')
     {
         strncpy(ifr.ifr_name, dev, IFNAMSIZ);
         ifr.ifr_name[sizeof(ifr.ifr_name) - 1] = '\0';
     }
 
+    if (vnet_hdr)
+    {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+
     err = ioctl(fd, TUNSETIFF, (void *)&ifr);
     if (err < 0)
     {
         close(fd);
         return err;
     }
+
+    if (vnet_hdr)
+    {
+        // 接收 64KB 的 TSO 包, 校验和由 muon 补全
+        int size = sizeof(struct virtio_net_hdr);
+        unsigned int offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+        if ((ioctl(fd, TUNSETVNETHDRSZ, &size) < 0) || (ioctl(fd, TUNSETOFFLOAD, offload) < 0))
+        {
+            close(fd);
+            return -1;
+        }
+    }
     return fd;
 }
 #endif
 
 
 #ifdef TARGET_DARWIN
-int tun_new(const char *dev)
+int tun_new(const char *dev, int multi_queue, int vnet_hdr)
 {
     struct ctl_info ctlInfo;
     struct sockaddr_ctl sc;
     int fd;
     int utunnum;
 
+    // utun has no multi queue or offload support
+    (void)multi_queue;
+    (void)vnet_hdr;
+
     if (sscanf(dev, "utun%d", &utunnum) != 1)
     {
         return -1;
@@ -27,7 +27,7 @@
 #  include "config.h"
 #endif
 
-extern int tun_new(const char *dev);
+extern int tun_new(const char *dev, int multi_queue, int vnet_hdr);
 extern void tun_close(int tun);
 
 #ifdef TARGET_LINUX
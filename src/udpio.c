@@ -0,0 +1,699 @@
+/*
+ * udpio.c - batched udp io
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "udpio.h"
+
+#ifdef TARGET_LINUX
+#  include <linux/filter.h>
+#  include <linux/if_ether.h>
+#endif
+
+#if defined(TARGET_LINUX) && defined(IP_TRANSPARENT) && defined(IP_RECVORIGDSTADDR)
+#  define UDPIO_TPROXY
+#  ifndef IPV6_TRANSPARENT
+#    define IPV6_TRANSPARENT 75
+#  endif
+#  ifndef IPV6_RECVORIGDSTADDR
+#    define IPV6_RECVORIGDSTADDR 74
+#  endif
+#  ifndef IPV6_ORIGDSTADDR
+#    define IPV6_ORIGDSTADDR IPV6_RECVORIGDSTADDR
+#  endif
+#endif
+
+#if defined(TARGET_LINUX) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#  define UDPIO_OFFLOAD
+#  include <netinet/udp.h>
+#  ifndef SOL_UDP
+#    define SOL_UDP 17
+#  endif
+#  ifndef UDP_SEGMENT
+#    define UDP_SEGMENT 103
+#  endif
+#  ifndef UDP_GRO
+#    define UDP_GRO 104
+#  endif
+#endif
+
+
+// libmill stores a plain sockaddr_in/sockaddr_in6 inside ipaddr
+#define SOCKADDR(addr) ((struct sockaddr *)(addr))
+
+// 单个 GSO/GRO 超级包的限制
+#define GSO_SEGS_MAX  64
+#define GSO_BYTES_MAX 65000
+#define GRO_MSGS      8
+#define GRO_BUF_SIZE  65536
+
+static int gso = 0;
+static int gro = 0;
+
+#ifdef UDPIO_OFFLOAD
+// GRO 接收缓冲区, 未取完的分段留给同一个 fd 的下一次 udpio_recv()
+static struct
+{
+    int fd;
+    int count;
+    int msg;
+    int off;
+    int lens[GRO_MSGS];
+    int segs[GRO_MSGS];
+    ipaddr addrs[GRO_MSGS];
+    uint8_t bufs[GRO_MSGS][GRO_BUF_SIZE];
+} rx = { .fd = -1 };
+#endif
+
+static socklen_t addrlen(const ipaddr *addr)
+{
+    if (SOCKADDR(addr)->sa_family == AF_INET6)
+    {
+        return sizeof(struct sockaddr_in6);
+    }
+    return sizeof(struct sockaddr_in);
+}
+
+
+int udpio_init(int offload)
+{
+    gso = 0;
+    gro = 0;
+#ifdef UDPIO_OFFLOAD
+    if (offload == 0)
+    {
+        return 0;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    // 旧内核不认识这两个选项, setsockopt 返回 ENOPROTOOPT
+    int opt = 1400;
+    if ((offload & UDPIO_GSO) && (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt, sizeof(opt)) == 0))
+    {
+        gso = 1;
+    }
+    opt = 1;
+    if ((offload & UDPIO_GRO) && (setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == 0))
+    {
+        gro = 1;
+    }
+    close(fd);
+#else
+    (void)offload;
+#endif
+    return (gso ? UDPIO_GSO : 0) | (gro ? UDPIO_GRO : 0);
+}
+
+
+int udpio_bind(ipaddr addr, int reuseport)
+{
+    int fd = socket(SOCKADDR(&addr)->sa_family, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuseport)
+    {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+#else
+    if (reuseport)
+    {
+        close(fd);
+        return -1;
+    }
+#endif
+
+#ifdef UDPIO_OFFLOAD
+    if (gro)
+    {
+        setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+    }
+#endif
+
+    if (bind(fd, SOCKADDR(&addr), addrlen(&addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int udpio_steer(int fd, int count)
+{
+#if defined(TARGET_LINUX) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    // 返回值是 reuseport 组里的 socket 序号, 即加入组的顺序
+    // 只对源地址 (IPv6 取低 32 位) 做哈希, 客户端换端口后仍落在同一个 socket
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 2),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1u),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+    (void)fd;
+    (void)count;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+
+int udpio_connect(int fd, ipaddr addr)
+{
+    return connect(fd, SOCKADDR(&addr), addrlen(&addr));
+}
+
+
+int udpio_port(const ipaddr *addr)
+{
+    // sin_port 和 sin6_port 的偏移相同
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+
+void udpio_setport(ipaddr *addr, int port)
+{
+    ((struct sockaddr_in *)addr)->sin_port = htons((uint16_t)port);
+}
+
+
+int udpio_addr_equal(const ipaddr *a, const ipaddr *b)
+{
+    int family = ((const struct sockaddr *)a)->sa_family;
+    if ((family != ((const struct sockaddr *)b)->sa_family) || (udpio_port(a) != udpio_port(b)))
+    {
+        return 0;
+    }
+    if (family == AF_INET)
+    {
+        return ((const struct sockaddr_in *)a)->sin_addr.s_addr
+               == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+    }
+    if (family == AF_INET6)
+    {
+        return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+                      &((const struct sockaddr_in6 *)b)->sin6_addr, 16) == 0;
+    }
+    return 0;
+}
+
+
+int udpio_tproxy(ipaddr addr, int reuseport)
+{
+#ifdef UDPIO_TPROXY
+    int family = SOCKADDR(&addr)->sa_family;
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int opt = 1;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        || (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0)
+        || (reuseport && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0)))
+    {
+        close(fd);
+        return -1;
+    }
+    // 双栈 socket 收到的 IPv4 包也要取原目的地址
+    int r = setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
+    r |= setsockopt(fd, SOL_IP, IP_RECVORIGDSTADDR, &opt, sizeof(opt));
+    if (family == AF_INET6)
+    {
+        r |= setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &opt, sizeof(opt));
+        r |= setsockopt(fd, SOL_IPV6, IPV6_RECVORIGDSTADDR, &opt, sizeof(opt));
+    }
+    if ((r != 0) || (bind(fd, SOCKADDR(&addr), addrlen(&addr)) != 0))
+    {
+        // 保留 setsockopt/bind 的 errno, 调用者要报告它
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+#else
+    (void)addr;
+    (void)reuseport;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+
+#ifdef UDPIO_TPROXY
+// 取 IP_ORIGDSTADDR, IPv6 socket 收到的 IPv4 地址转成 v4-mapped 地址
+static void orig_dst(struct msghdr *msg, ipaddr *dst)
+{
+    int family = SOCKADDR(msg->msg_name)->sa_family;
+    memset(dst, 0, sizeof(ipaddr));
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_ORIGDSTADDR))
+        {
+            struct sockaddr_in sin;
+            memcpy(&sin, CMSG_DATA(cmsg), sizeof(sin));
+            if (family == AF_INET6)
+            {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)dst;
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = sin.sin_port;
+                sin6->sin6_addr.s6_addr[10] = 0xff;
+                sin6->sin6_addr.s6_addr[11] = 0xff;
+                memcpy(&sin6->sin6_addr.s6_addr[12], &sin.sin_addr, 4);
+            }
+            else
+            {
+                memcpy(dst, &sin, sizeof(sin));
+            }
+        }
+        else if ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_ORIGDSTADDR))
+        {
+            memcpy(dst, CMSG_DATA(cmsg), sizeof(struct sockaddr_in6));
+        }
+    }
+}
+#endif
+
+
+int udpio_recvdst(int fd, pbuf_t **pbufs, ipaddr *addrs, ipaddr *dsts, int *lens, int count)
+{
+#ifdef UDPIO_TPROXY
+    if (count > BATCH_MAX)
+    {
+        count = BATCH_MAX;
+    }
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } ctrl[BATCH_MAX];
+    struct iovec iovs[BATCH_MAX];
+    struct mmsghdr msgs[BATCH_MAX];
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; i++)
+    {
+        iovs[i].iov_base = pbufs[i];
+        iovs[i].iov_len = PAYLOAD_OFFSET + PAYLOAD_MAX;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(ipaddr);
+        msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+    }
+#  ifdef HAVE_RECVMMSG
+    int n = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+#  else
+    int n;
+    for (n = 0; n < count; n++)
+    {
+        ssize_t r = recvmsg(fd, &msgs[n].msg_hdr, MSG_DONTWAIT);
+        if (r < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return (n > 0) ? n : -1;
+        }
+        msgs[n].msg_len = (unsigned)r;
+    }
+#  endif
+    for (int i = 0; i < n; i++)
+    {
+        lens[i] = (int)msgs[i].msg_len;
+        orig_dst(&msgs[i].msg_hdr, &dsts[i]);
+    }
+    return n;
+#else
+    (void)fd;
+    (void)pbufs;
+    (void)addrs;
+    (void)dsts;
+    (void)lens;
+    (void)count;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+
+#ifdef UDPIO_OFFLOAD
+static int recv_gro(int fd, pbuf_t **pbufs, ipaddr *addrs, int *lens, int count)
+{
+    if (rx.fd != fd)
+    {
+        struct mmsghdr msgs[GRO_MSGS];
+        struct iovec iovs[GRO_MSGS];
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } ctrl[GRO_MSGS];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < GRO_MSGS; i++)
+        {
+            iovs[i].iov_base = rx.bufs[i];
+            iovs[i].iov_len = GRO_BUF_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &rx.addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(ipaddr);
+            msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+        }
+        int n = recvmmsg(fd, msgs, GRO_MSGS, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            rx.lens[i] = (int)msgs[i].msg_len;
+            rx.segs[i] = rx.lens[i];
+            struct cmsghdr *cmsg;
+            for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+            {
+                if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO))
+                {
+                    memcpy(&rx.segs[i], CMSG_DATA(cmsg), sizeof(int));
+                }
+            }
+            if (rx.segs[i] <= 0)
+            {
+                rx.segs[i] = rx.lens[i];
+            }
+        }
+        rx.fd = fd;
+        rx.count = n;
+        rx.msg = 0;
+        rx.off = 0;
+    }
+
+    // 按 gso_size 拆分超级包
+    int n = 0;
+    while ((n < count) && (rx.msg < rx.count))
+    {
+        int m = rx.msg;
+        int seg = rx.lens[m] - rx.off;
+        if (seg > rx.segs[m])
+        {
+            seg = rx.segs[m];
+        }
+        int len = seg;
+        if (len > PAYLOAD_OFFSET + PAYLOAD_MAX)
+        {
+            len = PAYLOAD_OFFSET + PAYLOAD_MAX;
+        }
+        memcpy(pbufs[n], rx.bufs[m] + rx.off, len);
+        lens[n] = len;
+        if (addrs != NULL)
+        {
+            addrs[n] = rx.addrs[m];
+        }
+        n++;
+        rx.off += seg;
+        if (rx.off >= rx.lens[m])
+        {
+            rx.msg++;
+            rx.off = 0;
+        }
+    }
+    if (rx.msg >= rx.count)
+    {
+        rx.fd = -1;
+    }
+    return n;
+}
+#endif
+
+
+int udpio_pending(int fd)
+{
+#ifdef UDPIO_OFFLOAD
+    return rx.fd == fd;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+
+int udpio_recv(int fd, pbuf_t **pbufs, ipaddr *addrs, int *lens, int count)
+{
+    if (count > BATCH_MAX)
+    {
+        count = BATCH_MAX;
+    }
+
+#ifdef UDPIO_OFFLOAD
+    if (gro)
+    {
+        return recv_gro(fd, pbufs, addrs, lens, count);
+    }
+#endif
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec iovs[BATCH_MAX];
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; i++)
+    {
+        iovs[i].iov_base = pbufs[i];
+        iovs[i].iov_len = PAYLOAD_OFFSET + PAYLOAD_MAX;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (addrs != NULL)
+        {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(ipaddr);
+        }
+    }
+    int n = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        lens[i] = (int)msgs[i].msg_len;
+    }
+    return n;
+#else
+    // fallback: drain socket one datagram at a time, still one wakeup
+    int n;
+    for (n = 0; n < count; n++)
+    {
+        socklen_t len = sizeof(ipaddr);
+        ssize_t r = recvfrom(fd, pbufs[n], PAYLOAD_OFFSET + PAYLOAD_MAX, MSG_DONTWAIT,
+                             (addrs != NULL) ? SOCKADDR(&addrs[n]) : NULL,
+                             (addrs != NULL) ? &len : NULL);
+        if (r < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return (n > 0) ? n : -1;
+        }
+        lens[n] = (int)r;
+    }
+    return n;
+#endif
+}
+
+
+#ifdef UDPIO_OFFLOAD
+static int send_gso(int fd, const ipaddr *addr, pbuf_t **pbufs, const int *lens, int count)
+{
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec iovs[BATCH_MAX];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctrl[BATCH_MAX];
+    int first[BATCH_MAX];
+    int m = 0;
+
+    // 相同长度的连续数据包合并为一个超级包, 最后一个可以更短
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; )
+    {
+        int size = lens[i];
+        int total = 0;
+        int j = i;
+        while ((j < count) && (j - i < GSO_SEGS_MAX)
+               && (lens[j] <= size) && (total + lens[j] <= GSO_BYTES_MAX))
+        {
+            iovs[j].iov_base = pbufs[j];
+            iovs[j].iov_len = lens[j];
+            total += lens[j];
+            j++;
+            if (lens[j - 1] < size)
+            {
+                break;
+            }
+        }
+        struct msghdr *hdr = &msgs[m].msg_hdr;
+        hdr->msg_iov = &iovs[i];
+        hdr->msg_iovlen = j - i;
+        hdr->msg_name = (void *)addr;
+        hdr->msg_namelen = (addr != NULL) ? addrlen(addr) : 0;
+        if (j - i > 1)
+        {
+            hdr->msg_control = ctrl[m].buf;
+            hdr->msg_controllen = sizeof(ctrl[m].buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t seg = (uint16_t)size;
+            memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+        }
+        first[m] = i;
+        m++;
+        i = j;
+    }
+
+    int done = 0;
+    while (done < m)
+    {
+        int n = sendmmsg(fd, msgs + done, m - done, MSG_DONTWAIT);
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EIO))
+            {
+                // 网卡不支持 UDP GSO 时内核返回 EIO, 关闭 GSO 重发剩下的
+                gso = 0;
+                return first[done] + udpio_send(fd, addr, pbufs + first[done],
+                                                lens + first[done], count - first[done]);
+            }
+            break;
+        }
+        done += n;
+    }
+    return (done < m) ? first[done] : count;
+}
+#endif
+
+
+int udpio_send(int fd, const ipaddr *addr, pbuf_t **pbufs, const int *lens, int count)
+{
+    if (count > BATCH_MAX)
+    {
+        count = BATCH_MAX;
+    }
+
+#ifdef UDPIO_OFFLOAD
+    if (gso && (count > 1))
+    {
+        return send_gso(fd, addr, pbufs, lens, count);
+    }
+#endif
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec iovs[BATCH_MAX];
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; i++)
+    {
+        iovs[i].iov_base = pbufs[i];
+        iovs[i].iov_len = lens[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = (void *)addr;
+        msgs[i].msg_hdr.msg_namelen = (addr != NULL) ? addrlen(addr) : 0;
+    }
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = sendmmsg(fd, msgs + sent, count - sent, MSG_DONTWAIT);
+        if (n <= 0)
+        {
+            // socket buffer full or error, drop the rest like udpsend() does
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+#else
+    int sent = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (sendto(fd, pbufs[i], lens[i], MSG_DONTWAIT, (addr != NULL) ? SOCKADDR(addr) : NULL,
+                   (addr != NULL) ? addrlen(addr) : 0) >= 0)
+        {
+            sent++;
+        }
+    }
+    return sent;
+#endif
+}
@@ -0,0 +1,72 @@
+/*
+ * udpio.h - batched udp io
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPIO_H
+#define UDPIO_H
+
+#include <libmill.h>
+
+#include "encapsulate.h"
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#define UDPIO_GSO 0x01
+#define UDPIO_GRO 0x02
+
+// probe the offloads requested in mask (UDPIO_GSO | UDPIO_GRO), return enabled ones
+extern int udpio_init(int offload);
+
+// create a non-blocking udp socket bound to addr, return fd
+extern int udpio_bind(ipaddr addr, int reuseport);
+
+// steer datagrams among the count sockets of fd's SO_REUSEPORT group
+// by source address, sockets are indexed in the order they were bound
+extern int udpio_steer(int fd, int count);
+
+// connect fd to addr, the kernel then caches the route
+extern int udpio_connect(int fd, ipaddr addr);
+
+// port of a sockaddr_in/sockaddr_in6 stored in ipaddr
+extern int udpio_port(const ipaddr *addr);
+extern void udpio_setport(ipaddr *addr, int port);
+
+// same family, address and port; bytes past the sockaddr are ignored
+extern int udpio_addr_equal(const ipaddr *a, const ipaddr *b);
+
+// create a transparent udp socket bound to addr for TPROXY redirected
+// datagrams, reporting their original destination (Linux only)
+extern int udpio_tproxy(ipaddr addr, int reuseport);
+
+// like udpio_recv(), also return the original destination of each datagram
+extern int udpio_recvdst(int fd, pbuf_t **pbufs, ipaddr *addrs, ipaddr *dsts,
+                         int *lens, int count);
+
+// receive up to count datagrams without blocking, return number received
+extern int udpio_recv(int fd, pbuf_t **pbufs, ipaddr *addrs, int *lens, int count);
+
+// whether GRO segments of fd are still pending, call udpio_recv() again
+// before yielding if so
+extern int udpio_pending(int fd);
+
+// send count datagrams to addr (NULL on a connected socket), return number sent
+extern int udpio_send(int fd, const ipaddr *addr, pbuf_t **pbufs, const int *lens, int count);
+
+#endif // UDPIO_H
@@ -0,0 +1,457 @@
+/*
+ * uring.c - minimal io_uring wrapper
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if defined(TARGET_LINUX) && defined(HAVE_LINUX_IO_URING_H)
+
+#include <linux/io_uring.h>
+
+// 直接使用内核接口, 不依赖 liburing
+#define BGID 0
+
+static struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_size;
+    void *cq_ring;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned queued;
+
+    // provided buffer ring
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned br_mask;
+    uint8_t *br_base;
+    unsigned br_bufsize;
+} ring = { .fd = -1 };
+
+
+static int sys_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags, NULL, 0);
+}
+
+
+static int sys_register(unsigned opcode, void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr);
+}
+
+
+int uring_init(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+    {
+        return -1;
+    }
+
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_size > ring.sq_size)
+        {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = ring.sq_size;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED)
+    {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring.cq_ring = ring.sq_ring;
+    }
+    else
+    {
+        ring.cq_ring = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED)
+        {
+            munmap(ring.sq_ring, ring.sq_size);
+            close(ring.fd);
+            ring.fd = -1;
+            return -1;
+        }
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        if (ring.cq_ring != ring.sq_ring)
+        {
+            munmap(ring.cq_ring, ring.cq_size);
+        }
+        munmap(ring.sq_ring, ring.sq_size);
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    uint8_t *sq = ring.sq_ring;
+    uint8_t *cq = ring.cq_ring;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.queued = 0;
+    return ring.fd;
+}
+
+
+void uring_close(void)
+{
+    if (ring.fd < 0)
+    {
+        return;
+    }
+    if (ring.br != NULL)
+    {
+        munmap(ring.br, ring.br_size);
+        ring.br = NULL;
+    }
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+    {
+        munmap(ring.cq_ring, ring.cq_size);
+    }
+    munmap(ring.sq_ring, ring.sq_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+
+int uring_register(void *base, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = base;
+    iov.iov_len = len;
+    return sys_register(IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+
+int uring_provide(void *base, unsigned size, unsigned count)
+{
+    // count 必须是 2 的幂
+    if ((count == 0) || (count & (count - 1)) || (count > 32768))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ring.br_size = count * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, ring.br_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED)
+    {
+        ring.br = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+    reg.ring_entries = count;
+    reg.bgid = BGID;
+    if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        munmap(ring.br, ring.br_size);
+        ring.br = NULL;
+        return -1;
+    }
+
+    ring.br_mask = count - 1;
+    ring.br_base = base;
+    ring.br_bufsize = size;
+    ring.br->tail = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        uring_recycle((int)i);
+    }
+    return 0;
+}
+
+
+void uring_recycle(int bid)
+{
+    unsigned short tail = ring.br->tail;
+    struct io_uring_buf *buf = &ring.br->bufs[tail & ring.br_mask];
+    buf->addr = (uint64_t)(uintptr_t)(ring.br_base + (size_t)bid * ring.br_bufsize);
+    buf->len = ring.br_bufsize;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&ring.br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring.sq_tail;
+    if (tail - head >= ring.sq_entries)
+    {
+        // 提交队列满, 先提交
+        if (uring_submit(0) < 0)
+        {
+            return NULL;
+        }
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring.sq_entries)
+        {
+            return NULL;
+        }
+    }
+    unsigned idx = tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return sqe;
+}
+
+
+int uring_read_fixed(int fd, void *buf, unsigned len, uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+
+int uring_recvmsg(int fd, struct msghdr *msg, uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = data;
+    return 0;
+}
+
+
+int uring_cancel(uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = 0;
+    return 0;
+}
+
+
+int uring_submit(int wait)
+{
+    if ((ring.queued == 0) && (wait == 0))
+    {
+        return 0;
+    }
+    int n;
+    do
+    {
+        n = sys_enter(ring.queued, (unsigned)wait, (wait > 0) ? IORING_ENTER_GETEVENTS : 0);
+    } while ((n < 0) && (errno == EINTR));
+    if (n < 0)
+    {
+        return -1;
+    }
+    ring.queued -= ((unsigned)n < ring.queued) ? (unsigned)n : ring.queued;
+    return n;
+}
+
+
+int uring_reap(uring_event_t *events, int max)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while ((head != tail) && (n < max))
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+        events[n].data = cqe->user_data;
+        events[n].res = cqe->res;
+        events[n].more = (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+        events[n].bid = (cqe->flags & IORING_CQE_F_BUFFER) ?
+                        (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+        head++;
+        n++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+void *uring_payload(const uring_event_t *event, const struct msghdr *msg, int *len, void **name)
+{
+    if ((event->bid < 0) || (event->res < (int)sizeof(struct io_uring_recvmsg_out)))
+    {
+        return NULL;
+    }
+    uint8_t *buf = ring.br_base + (size_t)event->bid * ring.br_bufsize;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    if (out->flags & MSG_TRUNC)
+    {
+        return NULL;
+    }
+    uint8_t *p = buf + sizeof(struct io_uring_recvmsg_out);
+    if (name != NULL)
+    {
+        *name = p;
+    }
+    p += msg->msg_namelen + msg->msg_controllen;
+    *len = (int)out->payloadlen;
+    return p;
+}
+
+
+#else
+
+
+int uring_init(unsigned entries)
+{
+    (void)entries;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_close(void)
+{
+}
+
+int uring_register(void *base, size_t len)
+{
+    (void)base;
+    (void)len;
+    return -1;
+}
+
+int uring_provide(void *base, unsigned size, unsigned count)
+{
+    (void)base;
+    (void)size;
+    (void)count;
+    return -1;
+}
+
+void uring_recycle(int bid)
+{
+    (void)bid;
+}
+
+int uring_read_fixed(int fd, void *buf, unsigned len, uint64_t data)
+{
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)data;
+    return -1;
+}
+
+int uring_recvmsg(int fd, struct msghdr *msg, uint64_t data)
+{
+    (void)fd;
+    (void)msg;
+    (void)data;
+    return -1;
+}
+
+int uring_cancel(uint64_t data)
+{
+    (void)data;
+    return -1;
+}
+
+int uring_submit(int wait)
+{
+    (void)wait;
+    return -1;
+}
+
+int uring_reap(uring_event_t *events, int max)
+{
+    (void)events;
+    (void)max;
+    return 0;
+}
+
+void *uring_payload(const uring_event_t *event, const struct msghdr *msg, int *len, void **name)
+{
+    (void)event;
+    (void)msg;
+    (void)len;
+    (void)name;
+    return NULL;
+}
+
+#endif
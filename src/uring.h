@@ -0,0 +1,73 @@
+/*
+ * uring.h - minimal io_uring wrapper
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+// room before the payload of a multishot recvmsg buffer:
+// struct io_uring_recvmsg_out (16B) and the source address (up to 48B)
+#define URING_MSG_OVERHEAD 64
+
+typedef struct
+{
+    uint64_t data;
+    int res;
+    // multishot request still armed
+    int more;
+    // provided buffer id, -1 if none
+    int bid;
+} uring_event_t;
+
+// create the ring, return its fd (pollable), -1 if io_uring is not available
+extern int uring_init(unsigned entries);
+extern void uring_close(void);
+
+// register one fixed buffer (index 0) for uring_read_fixed()
+extern int uring_register(void *base, size_t len);
+
+// provide count buffers of size bytes for multishot receive
+extern int uring_provide(void *base, unsigned size, unsigned count);
+
+// return a provided buffer to the kernel
+extern void uring_recycle(int bid);
+
+// queue requests, submitted by uring_submit()
+extern int uring_read_fixed(int fd, void *buf, unsigned len, uint64_t data);
+extern int uring_recvmsg(int fd, struct msghdr *msg, uint64_t data);
+extern int uring_cancel(uint64_t data);
+
+// submit queued requests, wait for at least wait completions
+extern int uring_submit(int wait);
+
+// fetch up to max completions without blocking
+extern int uring_reap(uring_event_t *events, int max);
+
+// locate payload and source address of a multishot recvmsg completion
+extern void *uring_payload(const uring_event_t *event, const struct msghdr *msg,
+                           int *len, void **name);
+
+#endif // URING_H
@@ -278,4 +278,33 @@ int nat(const char *address, int on)
     }
     return 0;
 }
+
+
+// 把端口范围内的 udp 包重定向到 port_start 上的透明 socket
+// 任一条规则失败都返回 -1; 添加失败时撤销已添加的另一条, 删除时两条都尝试
+int tproxy(int port_start, int port_end, int ipv4, int ipv6, int on)
+{
+    char cmd[200];
+    const char *op = on ? "-A" : "-D";
+    int ok4 = 1;
+    int ok6 = 1;
+
+    if (ipv4)
+    {
+        sprintf(cmd, "/bin/sh -c \'iptables -t mangle %s PREROUTING -p udp --dport %d:%d -j TPROXY --on-port %d\'",
+                op, port_start, port_end, port_start);
+        ok4 = (system(cmd) == 0);
+    }
+    if (ipv6 && (ok4 || !on))
+    {
+        sprintf(cmd, "/bin/sh -c \'ip6tables -t mangle %s PREROUTING -p udp --dport %d:%d -j TPROXY --on-port %d\'",
+                op, port_start, port_end, port_start);
+        ok6 = (system(cmd) == 0);
+    }
+    if (on && ipv4 && ok4 && !ok6)
+    {
+        tproxy(port_start, port_end, 1, 0, 0);
+    }
+    return (ok4 && ok6) ? 0 : -1;
+}
 #endif
@@ -30,6 +30,7 @@ extern int route(const char *tunif, const char *server, int ipv4, int ipv6);
 #ifdef TARGET_LINUX
 extern int ifconfig(const char *tunif, int mtu, const char *address, const char *address6);
 extern int nat(const char *address, int on);
+extern int tproxy(int port_start, int port_end, int ipv4, int ipv6, int on);
 #endif
 #ifdef TARGET_DARWIN
 extern int ifconfig(const char *tunif, int mtu, const char *address, const char *peer, const char *address6);
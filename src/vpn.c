@@ -19,22 +19,39 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <libmill.h>
 #include <sodium.h>
 
+#include "compress.h"
 #include "conf.h"
 #include "crypto.h"
 #include "encapsulate.h"
+#include "fec.h"
+#include "hc.h"
 #include "log.h"
+#include "offload.h"
+#include "pool.h"
+#include "probe.h"
+#include "reorder.h"
+#include "session.h"
 #include "totp.h"
 #include "tunif.h"
+#include "udpio.h"
+#include "uring.h"
 #include "utils.h"
 
 #include "vpn.h"
@@ -47,12 +64,171 @@ static const conf_t *conf;
 
 static ctx_t ctx;
 
+// 多 worker 模式下各进程共享的 path 状态, 用 seqlock 保护
+typedef struct {
+    volatile uint32_t seq;
+    int token;
+    int64_t seen;
+    ipaddr remote;
+    int cipher;
+} __attribute__((aligned(64))) hint_t;
+
+static hint_t *hints;
+
+static int queues[WORKER_MAX];
+static pid_t pids[WORKER_MAX];
+
+// io_uring 后端, 每个 worker 一个 ring
+#define URING_ENTRIES 256
+#define URING_READS   16
+#define URING_BUFS    256
+#define URING_TUN     1
+
+typedef struct
+{
+    int path;
+    int token;
+    udpsock s;
+    int fd;
+    int armed;
+    int closing;
+    struct msghdr msg;
+} uring_sock_t;
+
+// steer=yes 时每个端口每个 worker 一个 socket, 下标 token * workers + worker
+static int *shards[PATH_MAX_COUNT];
+
+// tproxy=yes 时每个 path 一个透明 socket, 每个 worker 一个
+static int tproxy_fds[PATH_MAX_COUNT][WORKER_MAX];
+
+// hop=reuse 时每个 path 轮流使用的 socket 数量, 旧端口的回包仍能收到
+#define HOP_SOCKS 4
+
+// 客户端服务器地址缓存, 由 resolver 后台刷新, 刷新期间继续用旧地址
+#define DNS_TTL     (60 * 1000)
+#define DNS_RETRY   (5 * 1000)
+#define DNS_TIMEOUT (5 * 1000)
+static struct
+{
+    ipaddr addr;
+    int valid;
+} dns_cache[PATH_MAX_COUNT];
+
+// 无效包不再逐个写日志, 每 SUMMARY_INTERVAL 汇总输出一次
+#define SUMMARY_INTERVAL (10 * 1000)
+#define SUMMARY_SOURCES  64
+static struct
+{
+    uint64_t count;
+    int sources;
+    ipaddr addrs[SUMMARY_SOURCES];
+    int64_t since;
+} invalid;
+
+// 当前有效 token 的位图, 由 heartbeat 更新
+static uint8_t *token_maps[PATH_MAX_COUNT];
+
+// AF_XDP socket of each worker
+static xdp_t *xsks[WORKER_MAX];
+static xdp_t *xsk;
+
+// tun_worker 和 udp_sender 之间的发送队列, 满了就丢包
+#define SENDQ_SIZE 256
+static struct
+{
+    int count;
+    chan ch;
+} sendq;
+
+// udp_worker_batch 和 xdp_worker 共用的接收缓冲区, 处理过程中不会切换协程
+static pbuf_t *rx_pbufs[BATCH_MAX];
+
+// 批量读取 tun 设备, 按 path 分组后用 sendmmsg 发送
+static struct
+{
+    pbuf_t *pbufs[BATCH_MAX];
+    pbuf_t *queue[PATH_MAX_COUNT][BATCH_MAX];
+    int lens[PATH_MAX_COUNT][BATCH_MAX];
+    int counts[PATH_MAX_COUNT];
+    int used;
+    // session=yes: 按客户端的 path, token, 地址分组
+    struct
+    {
+        int path;
+        int token;
+        ipaddr remote;
+        int count;
+        pbuf_t *queue[BATCH_MAX];
+        int lens[BATCH_MAX];
+    } groups[BATCH_MAX];
+    int group_count;
+} tx;
+
+// scheduler 不是 rr 时测量每个 path, 多 worker 时共享
+static probe_t *probes;
+static int64_t sched_current[PATH_MAX_COUNT];
+
+// reorder=yes 或 fec=yes 时数据包的序号
+static uint32_t tx_seq;
+
+// 重排缓冲区空的时候 reorder_worker 等在 ch 上, 有包暂存时唤醒
+static struct
+{
+    int idle;
+    chan ch;
+} reorder_wake;
+
+// session=yes 的客户端在心跳包里带上的内层地址
+static uint8_t ident[SESSION_KEY_LEN * 2];
+static int ident_len;
+
+static int ring_fd = -1;
+static uint8_t *tun_bufs;
+static size_t tun_buf_size;
+static uint8_t *udp_bufs;
+static size_t udp_buf_size;
+
 
 coroutine static void tun_worker(void);
+static void tun_worker_batch(void);
+static void tun_worker_uring(void);
 coroutine static void udp_worker(int path, int port, int timeout);
-coroutine static void udp_sender(pbuf_t *pbuf);
+static void udp_worker_batch(int path, int token, udpsock s, int fd, int64_t deadline);
+static void udp_worker_uring(int path, int token, udpsock s, int fd, int64_t deadline);
+static void udp_worker_single(int path, int token, udpsock s, int fd, int64_t deadline);
+static int uring_setup(void);
+static int pool_setup(void);
+static int steer_setup(void);
+static int tproxy_setup(void);
+coroutine static void tproxy_worker(int path);
+static udpsock reply_sock(int path, int token, ipaddr local);
+static void reply_gc(int path);
+static int udp_input(int path, int token, udpsock s, int fd, ipaddr addr, pbuf_t *pbuf, ssize_t n);
+static void tun_output(const uint8_t *pkt, int len);
+static void tun_deliver(const uint8_t *pkt, int len, uint32_t seq);
+static void fec_send(void);
+coroutine static void fec_worker(void);
+coroutine static void reorder_worker(void);
+static int token_valid(int path, int token);
+static void drop_packet(int reason, const ipaddr *addr);
+static void drop_summary(void);
+coroutine static void udp_sender(void);
+static int select_path(void);
+static void hint_publish(int path, ipaddr remote, int token, int cipher);
+static void hint_sync(int path);
+coroutine static void xdp_worker(void);
 coroutine static void client_hop(void);
+coroutine static void hop_worker(int path, int slot);
+static void path_send(int path, pbuf_t *pbuf, int n);
+static udpsock token_sock(int path, int token);
+static void session_input(int path, int token, ipaddr addr, pbuf_t *pbuf, int n);
+static void reply(int path, int token, udpsock s, ipaddr addr, const pbuf_t *pbuf);
+static int session_lookup(pbuf_t *pbuf, session_t **se, int *token, ipaddr *remote, int *cipher);
+coroutine static void resolver(int path);
+static int path_remote(int path, int port, ipaddr *remote);
 coroutine static void heartbeat(void);
+static int path_skew(void);
+static int path_loss(void);
 coroutine static void snmp_logger();
 
 
@@ -63,29 +239,253 @@ int vpn_init(const conf_t *config)
     memset(&ctx, 0, sizeof(ctx));
     ctx.mode = conf->mode;
     ctx.mtu = conf->mtu;
+    ctx.batch = conf->batch;
+    ctx.offload = conf->offload;
+    ctx.io = conf->io;
+    ctx.workers = conf->workers;
     ctx.path_count = conf->path_count;
     for (int i = 0; i < ctx.path_count; i++)
     {
         strcpy(ctx.paths[i].server, conf->paths[i].server);
         ctx.paths[i].port_start = conf->paths[i].port[0];
         ctx.paths[i].port_range = conf->paths[i].port[1] - conf->paths[i].port[0];
+        ctx.paths[i].obfs = conf->paths[i].obfs;
+        ctx.paths[i].cipher = CIPHER_AUTO;
     }
 
     LOG("starting muon %s", (ctx.mode == MODE_SERVER) ? "server" : "client");
 
+    for (int i = 0; i < ctx.path_count; i++)
+    {
+        token_maps[i] = calloc(ctx.paths[i].port_range / 8 + 1, 1);
+        if (token_maps[i] == NULL)
+        {
+            ERROR("calloc");
+            return -1;
+        }
+    }
+
     if (crypto_init(conf->key) != 0)
     {
         return -1;
     }
-
-    // create tun device
-    ctx.tun = tun_new(conf->tunif);
-    if (ctx.tun < 0)
+    // 服务器按每个客户端使用的格式回复, 见 ctx.paths[].cipher 和会话
+    int cipher = crypto_setup(conf->cipher, conf->legacy);
+    if (cipher < 0)
     {
-        LOG("failed to init tun device");
+        LOG("%s is not supported on this cpu", crypto_name(conf->cipher));
         return -1;
     }
+    LOG("using cipher: %s", crypto_name(cipher));
+
+    hc_enable(conf->hc);
+
+    // 会话表在 fork 之前创建, 所有 worker 共享
+    if ((ctx.mode == MODE_SERVER) && (conf->session))
+    {
+        if (session_init(conf->sessions, ctx.path_count) != 0)
+        {
+            ERROR("mmap");
+            return -1;
+        }
+        ctx.sessions = conf->sessions;
+        LOG("serving up to %d sessions", ctx.sessions);
+    }
+    else if (conf->session)
+    {
+        const char *addrs[2] = {conf->address, conf->address6};
+        for (int i = 0; i < 2; i++)
+        {
+            if (addrs[i][0] == '\0')
+            {
+                continue;
+            }
+            if (session_addr(addrs[i], ident + ident_len) != 0)
+            {
+                LOG("invalid address: %s", addrs[i]);
+                return -1;
+            }
+            ident_len += SESSION_KEY_LEN;
+        }
+    }
+
+    // 两端的字典必须相同, 打印指纹便于对比
+    if (conf->dict[0] != '\0')
+    {
+        uint32_t id;
+        int size = compress_dict(conf->dict, &id);
+        if (size < 0)
+        {
+            LOG("failed to load dictionary %s", conf->dict);
+            return -1;
+        }
+        LOG("using dictionary: %d bytes, fingerprint %08x", size, id);
+    }
+
+    // create tun device, one queue per worker
+    for (int i = 0; i < ctx.workers; i++)
+    {
+        queues[i] = tun_new(conf->tunif, ctx.workers > 1, ctx.offload);
+        if (queues[i] < 0)
+        {
+            LOG("failed to init tun device");
+            return -1;
+        }
+        // 每次唤醒都读到 EAGAIN 为止
+        int flags = fcntl(queues[i], F_GETFL, 0);
+        if ((flags < 0) || (fcntl(queues[i], F_SETFL, flags | O_NONBLOCK) < 0))
+        {
+            ERROR("fcntl");
+            return -1;
+        }
+    }
+    ctx.tun = queues[0];
     LOG("using tun device: %s", conf->tunif);
+    if (ctx.offload)
+    {
+        LOG("tun offload: tso, csum");
+    }
+    if (ctx.batch > 1)
+    {
+        LOG("batch mode, up to %d packets per wakeup", ctx.batch);
+        // io_uring 直接收进 provided buffer, 不拆分 GRO 包
+        int mask = (ctx.io == IO_URING) ? UDPIO_GSO : (UDPIO_GSO | UDPIO_GRO);
+        int offload = udpio_init(conf->gso ? mask : 0);
+        if (offload)
+        {
+            LOG("udp offload:%s%s", (offload & UDPIO_GSO) ? " gso" : "",
+                (offload & UDPIO_GRO) ? " gro" : "");
+        }
+    }
+
+    if (ctx.workers > 1)
+    {
+        hints = mmap(NULL, sizeof(hint_t) * PATH_MAX_COUNT, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (hints == MAP_FAILED)
+        {
+            ERROR("mmap");
+            return -1;
+        }
+        memset(hints, 0, sizeof(hint_t) * PATH_MAX_COUNT);
+        LOG("using %d workers", ctx.workers);
+    }
+
+    if ((conf->scheduler != SCHED_RR) && (ctx.sessions > 0))
+    {
+        LOG("scheduler is ignored with session, clients use round-robin");
+    }
+    else if ((conf->scheduler != SCHED_RR) || conf->fec)
+    {
+        // fec 按测量的丢包率调整
+        int flags = (ctx.workers > 1) ? MAP_SHARED : MAP_PRIVATE;
+        probes = mmap(NULL, sizeof(probe_t) * PATH_MAX_COUNT, PROT_READ | PROT_WRITE,
+                      flags | MAP_ANONYMOUS, -1, 0);
+        if (probes == MAP_FAILED)
+        {
+            ERROR("mmap");
+            return -1;
+        }
+        memset(probes, 0, sizeof(probe_t) * PATH_MAX_COUNT);
+        static const char *names[] = {"rr", "minrtt", "weighted", "lowloss"};
+        LOG("using scheduler: %s", names[conf->scheduler]);
+    }
+
+    if (conf->fec)
+    {
+        if (fec_init(ctx.mtu, tun_deliver) != 0)
+        {
+            ERROR("malloc");
+            return -1;
+        }
+    }
+
+    if (conf->reorder)
+    {
+        if (reorder_init(ctx.mtu, tun_output) != 0)
+        {
+            ERROR("malloc");
+            return -1;
+        }
+        if (probes == NULL)
+        {
+            LOG("reorder timeout only adapts to observed delays, set scheduler to measure paths");
+        }
+    }
+
+    // 按客户端地址分流, fork 之前按 worker 顺序打开每个端口
+    if ((ctx.mode == MODE_SERVER) && (conf->steer))
+    {
+        if (ctx.workers == 1)
+        {
+            LOG("steer needs workers > 1, ignored");
+        }
+        else if (steer_setup() != 0)
+        {
+            LOG("failed to setup steering");
+            return -1;
+        }
+        else
+        {
+            LOG("steering clients among workers by source address");
+        }
+    }
+
+    // 整个端口范围重定向到一个透明 socket, 需要 root 权限
+    if ((ctx.mode == MODE_SERVER) && (conf->tproxy))
+    {
+        if (tproxy_setup() != 0)
+        {
+            LOG("failed to setup tproxy");
+            return -1;
+        }
+        LOG("receiving port ranges with tproxy");
+    }
+
+    // AF_XDP, socket 需要 root 权限, 在 fork 和 runas 之前创建
+    if (conf->xdp[0] != '\0')
+    {
+        const char *addrs[PATH_MAX_COUNT];
+        int ranges[PATH_MAX_COUNT][2];
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            addrs[i] = ctx.paths[i].server;
+            ranges[i][0] = ctx.paths[i].port_start;
+            ranges[i][1] = ctx.paths[i].port_start + ctx.paths[i].port_range;
+        }
+        if (xdp_attach(conf->xdp, addrs, (const int (*)[2])ranges, ctx.path_count) != 0)
+        {
+            LOG("failed to attach xdp program, using sockets only");
+        }
+        else
+        {
+            for (int i = 0; i < ctx.workers; i++)
+            {
+                xsks[i] = xdp_open(i);
+                if (xsks[i] == NULL)
+                {
+                    LOG("failed to open AF_XDP socket on queue %d", i);
+                }
+            }
+            LOG("using AF_XDP on %s", conf->xdp);
+        }
+    }
+
+    // 按 token 查找 socket, worker 之间切换回复 socket, AF_XDP 收包或回复会话时使用
+    if ((ctx.mode == MODE_SERVER)
+        && ((ctx.workers > 1) || (conf->xdp[0] != '\0') || (conf->tproxy) || (ctx.sessions > 0)))
+    {
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            ctx.paths[i].socks = calloc(ctx.paths[i].port_range + 1, sizeof(udpsock));
+            ctx.paths[i].fds = calloc(ctx.paths[i].port_range + 1, sizeof(int));
+            if ((ctx.paths[i].socks == NULL) || (ctx.paths[i].fds == NULL))
+            {
+                ERROR("calloc");
+                return -1;
+            }
+        }
+    }
 
     // set IP address
 #ifdef TARGET_LINUX
@@ -148,10 +548,116 @@ int vpn_init(const conf_t *config)
 
 int vpn_run(void)
 {
+    // 日志线程不能跨 fork, fork 前停止, 之后各进程重新启动
+    if (ctx.workers > 1)
+    {
+        log_stop();
+    }
+
+    // fork workers, each worker owns one tun queue
+    for (int i = 1; i < ctx.workers; i++)
+    {
+        pid_t pid = mfork();
+        if (pid < 0)
+        {
+            ERROR("mfork");
+            for (int j = 1; j < i; j++)
+            {
+                kill(pids[j], SIGTERM);
+                waitpid(pids[j], NULL, 0);
+            }
+            return EXIT_FAILURE;
+        }
+        else if (pid == 0)
+        {
+            ctx.worker = i;
+            break;
+        }
+        pids[i] = pid;
+    }
+    if (ctx.workers > 1)
+    {
+        log_start();
+        ctx.tun = queues[ctx.worker];
+        for (int i = 0; i < ctx.workers; i++)
+        {
+            if (i != ctx.worker)
+            {
+                tun_close(queues[i]);
+            }
+        }
+        LOG("worker %d started", ctx.worker);
+    }
+
+    // 只保留本 worker 的 socket
+    for (int path = 0; (path < ctx.path_count) && (conf->tproxy); path++)
+    {
+        for (int i = 0; i < ctx.workers; i++)
+        {
+            if (i != ctx.worker)
+            {
+                close(tproxy_fds[path][i]);
+            }
+        }
+    }
+    for (int path = 0; path < ctx.path_count; path++)
+    {
+        if (shards[path] == NULL)
+        {
+            continue;
+        }
+        for (int i = 0; i < (ctx.paths[path].port_range + 1) * ctx.workers; i++)
+        {
+            if (i % ctx.workers != ctx.worker)
+            {
+                close(shards[path][i]);
+            }
+        }
+    }
+
+    xsk = xsks[ctx.worker];
+    for (int i = 0; i < ctx.workers; i++)
+    {
+        if (i != ctx.worker)
+        {
+            xdp_close(xsks[i]);
+        }
+    }
+
+    // ring 不能跨 fork 共享, 每个 worker 单独创建
+    if (ctx.io == IO_URING)
+    {
+        if (uring_setup() != 0)
+        {
+            LOG("io_uring not available, fall back to poll");
+            ctx.io = IO_POLL;
+        }
+        else
+        {
+            LOG("using io_uring");
+        }
+    }
+
+    if (pool_setup() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
     if (ctx.mode == MODE_CLIENT)
     {
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            go(resolver(i));
+        }
         go(client_hop());
     }
+    else if (conf->tproxy)
+    {
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            go(tproxy_worker(i));
+        }
+    }
     else
     {
         for (int i = 0; i < ctx.path_count; i++)
@@ -165,9 +671,23 @@ int vpn_run(void)
 
     go(tun_worker());
 
+    if (xsk != NULL)
+    {
+        go(xdp_worker());
+    }
+
     // keepalive
     go(heartbeat());
 
+    if (conf->reorder)
+    {
+        go(reorder_worker());
+    }
+    if (conf->fec)
+    {
+        go(fec_worker());
+    }
+
     go(snmp_logger());
 
     ctx.running = 1;
@@ -176,9 +696,33 @@ int vpn_run(void)
         msleep(now() + 50);
     }
 
-    // turn off nat
+    if (ctx.io == IO_URING)
+    {
+        uring_close();
+    }
+
+    xdp_close(xsk);
+
+    if (ctx.worker != 0)
+    {
+        pool_destroy();
+        tun_close(ctx.tun);
+        LOG("worker %d exit", ctx.worker);
+        return EXIT_SUCCESS;
+    }
+
+    // stop other workers
+    for (int i = 1; i < ctx.workers; i++)
+    {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+
+    xdp_detach();
+
+    // turn off nat and tproxy
 #ifdef TARGET_LINUX
-    if ((ctx.mode == MODE_SERVER) && (conf->nat))
+    if ((ctx.mode == MODE_SERVER) && ((conf->nat) || (conf->tproxy)))
     {
         // regain root privilege
         if (conf->user[0] != '\0')
@@ -189,14 +733,25 @@ int vpn_run(void)
             }
         }
 
-        if (nat(conf->address, 0))
+        if ((conf->nat) && (nat(conf->address, 0)))
         {
             LOG("failed to turn off NAT");
         }
+        for (int i = 0; (i < ctx.path_count) && (conf->tproxy); i++)
+        {
+            int ipv6 = (strchr(ctx.paths[i].server, ':') != NULL);
+            int ipv4 = !ipv6 || (strcmp(ctx.paths[i].server, "::") == 0);
+            int end = ctx.paths[i].port_start + ctx.paths[i].port_range;
+            if (tproxy(ctx.paths[i].port_start, end, ipv4, ipv6, 0) != 0)
+            {
+                LOG("failed to remove tproxy rule");
+            }
+        }
     }
 #endif
 
     // clean up
+    pool_destroy();
     tun_close(ctx.tun);
     LOG("close tun device");
 
@@ -207,17 +762,109 @@ int vpn_run(void)
 
 void vpn_snmp(void)
 {
-    LOG("snmp:");
-    printf("uptime: %" PRIu64 "s\n", ctx.snmp.uptime / 1000);
-    printf("out_packets: %" PRIu64 "\n", ctx.snmp.out_packets);
-    printf("out_bytes: %" PRIu64 "\n", ctx.snmp.out_bytes);
-    printf("out_packet_rate: %d\n", ctx.snmp.out_packet_rate);
-    printf("out_byte_rate: %d\n", ctx.snmp.out_byte_rate);
-    printf("in_packets: %" PRIu64 "\n", ctx.snmp.in_packets);
-    printf("in_bytes: %" PRIu64 "\n", ctx.snmp.in_bytes);
-    printf("in_packet_rate: %d\n", ctx.snmp.in_packet_rate);
-    printf("in_byte_rate: %d\n", ctx.snmp.in_byte_rate);
-    fflush(stdout);
+    // 标题和各行走同一个日志队列, 保持顺序
+    if (ctx.workers > 1)
+    {
+        LOG("snmp (worker %d):", ctx.worker);
+    }
+    else
+    {
+        LOG("snmp:");
+    }
+    LOG_CONT("uptime: %" PRIu64 "s", ctx.snmp.uptime / 1000);
+    LOG_CONT("out_packets: %" PRIu64, ctx.snmp.out_packets);
+    LOG_CONT("out_bytes: %" PRIu64, ctx.snmp.out_bytes);
+    LOG_CONT("out_packet_rate: %d", ctx.snmp.out_packet_rate);
+    LOG_CONT("out_byte_rate: %d", ctx.snmp.out_byte_rate);
+    LOG_CONT("out_drops: %" PRIu64, ctx.snmp.out_drops);
+    LOG_CONT("out_padding: %" PRIu64, ctx.snmp.out_padding);
+    LOG_CONT("out_noroute: %" PRIu64, ctx.snmp.out_noroute);
+    LOG_CONT("in_packets: %" PRIu64, ctx.snmp.in_packets);
+    LOG_CONT("in_bytes: %" PRIu64, ctx.snmp.in_bytes);
+    LOG_CONT("in_packet_rate: %d", ctx.snmp.in_packet_rate);
+    LOG_CONT("in_byte_rate: %d", ctx.snmp.in_byte_rate);
+    LOG_CONT("in_drops_token: %" PRIu64, ctx.snmp.in_drops[DROP_TOKEN]);
+    LOG_CONT("in_drops_auth: %" PRIu64, ctx.snmp.in_drops[DROP_AUTH]);
+    LOG_CONT("in_drops_short: %" PRIu64, ctx.snmp.in_drops[DROP_SHORT]);
+    LOG_CONT("log_drops: %" PRIu64, log_dropped());
+    LOG_CONT("compress_tried: %" PRIu64, ctx.snmp.compress_tried);
+    LOG_CONT("compress_skipped: %" PRIu64, ctx.snmp.compress_skipped);
+    LOG_CONT("compress_evicted: %" PRIu64, ctx.snmp.compress_evicted);
+    LOG_CONT("compress_ratio: %d%%", ctx.snmp.compress_ratio);
+    LOG_CONT("compress_saved: %" PRIu64 "us", ctx.snmp.compress_saved_us);
+    LOG_CONT("hc_full: %" PRIu64, ctx.snmp.hc_full);
+    LOG_CONT("hc_compressed: %" PRIu64, ctx.snmp.hc_compressed);
+    LOG_CONT("hc_saved: %" PRIu64, ctx.snmp.hc_saved);
+    LOG_CONT("hc_misses: %" PRIu64, ctx.snmp.hc_misses);
+    if (conf->reorder)
+    {
+        reorder_stat_t rs;
+        reorder_stat(&rs);
+        LOG_CONT("reorder_reordered: %" PRIu64, rs.reordered);
+        LOG_CONT("reorder_late: %" PRIu64, rs.late);
+        LOG_CONT("reorder_dropped: %" PRIu64, rs.dropped);
+        LOG_CONT("reorder_skipped: %" PRIu64, rs.skipped);
+        LOG_CONT("reorder_timeout: %dms", rs.timeout);
+        LOG_CONT("reorder_depth: %d", rs.depth);
+    }
+    if (conf->fec)
+    {
+        fec_stat_t fs;
+        fec_stat(&fs);
+        LOG_CONT("fec_group: %d", fs.group);
+        LOG_CONT("fec_parity_sent: %" PRIu64, fs.parity_sent);
+        LOG_CONT("fec_parity_received: %" PRIu64, fs.parity_received);
+        LOG_CONT("fec_recovered: %" PRIu64, fs.recovered);
+        LOG_CONT("fec_unrecoverable: %" PRIu64, fs.unrecoverable);
+        LOG_CONT("fec_duplicates: %" PRIu64, fs.duplicates);
+    }
+    pool_stat_t stat;
+    pool_stat(&stat);
+    if (ctx.mode == MODE_CLIENT)
+    {
+        static const char *buckets[DNS_HIST] = {"1ms", "10ms", "100ms", "1s", "inf"};
+        LOG_CONT("dns_lookups: %" PRIu64, ctx.snmp.dns_lookups);
+        LOG_CONT("dns_failures: %" PRIu64, ctx.snmp.dns_failures);
+        for (int i = 0; i < DNS_HIST; i++)
+        {
+            LOG_CONT("dns_latency_%s: %" PRIu64, buckets[i], ctx.snmp.dns_latency[i]);
+        }
+    }
+    if ((ctx.sessions > 0) && (ctx.worker == 0))
+    {
+        // 会话表是共享的, 只由 worker 0 输出
+        int64_t t = now();
+        session_stat_t ss;
+        session_stat(&ss, t);
+        LOG_CONT("sessions: %d", ss.active);
+        LOG_CONT("sessions_created: %" PRIu64, ss.created);
+        LOG_CONT("sessions_full: %" PRIu64, ss.full);
+        session_info_t info;
+        for (int i = session_next(0, &info); i >= 0; i = session_next(i + 1, &info))
+        {
+            char buf[SESSION_ADDRSTRLEN];
+            if (t - info.seen > SESSION_TIMEOUT)
+            {
+                continue;
+            }
+            LOG_CONT("session %s: in_packets %" PRIu64 ", in_bytes %" PRIu64
+                     ", out_packets %" PRIu64 ", out_bytes %" PRIu64 ", idle %ds",
+                     session_addrstr(info.addr, buf), info.in_packets, info.in_bytes,
+                     info.out_packets, info.out_bytes, (int)((t - info.seen) / 1000));
+        }
+    }
+    for (int i = 0; (i < ctx.path_count) && (probes != NULL); i++)
+    {
+        const probe_t *p = &probes[i];
+        LOG_CONT("path %d: rtt %d.%03dms, jitter %d.%03dms, loss %d.%d%%, "
+                 "probes %" PRIu64 ", echoed %" PRIu64 ", lost %" PRIu64,
+                 i, p->srtt / 1000, p->srtt % 1000, p->rttvar / 1000, p->rttvar % 1000,
+                 p->loss / 10, p->loss % 10, p->sent, p->echoed, p->lost);
+    }
+    LOG_CONT("pool_size: %d", stat.size);
+    LOG_CONT("pool_used: %d", stat.used);
+    LOG_CONT("pool_peak: %d", stat.peak);
+    LOG_CONT("pool_exhausted: %" PRIu64, stat.exhausted);
 }
 
 
@@ -227,40 +874,817 @@ void vpn_stop(void)
 }
 
 
-coroutine static void tun_worker(void)
+// 每个端口按 worker 顺序绑定 workers 个 socket, 在 reuseport 组里的序号就是
+// worker 编号, BPF 程序按源地址哈希选出序号
+static int steer_setup(void)
 {
-    pbuf_t pbuf;
-    int events;
-    ssize_t n;
-    while (1)
+    rlim_t need = 64;
+    for (int path = 0; path < ctx.path_count; path++)
     {
-        events = fdwait(ctx.tun, FDW_IN, -1);
-        if(events & FDW_IN)
+        need += (rlim_t)(ctx.paths[path].port_range + 1) * ctx.workers;
+    }
+    struct rlimit rl;
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < need))
+    {
+        rl.rlim_cur = ((rl.rlim_max == RLIM_INFINITY) || (rl.rlim_max > need)) ? need : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
         {
-            // 从 tun 设备读取 IP 包
-            n = tun_read(ctx.tun, pbuf.payload, ctx.mtu);
-            if (n <= 0)
-            {
-                ERROR("tun_read");
-                return;
-            }
-            pbuf.len = (uint16_t)n;
-            pbuf.flag = 0x0000;
-
-            // 发送到 remote
-            go(udp_sender(&pbuf));
+            ERROR("setrlimit");
         }
     }
-}
 
-
-coroutine static void client_hop(void)
-{
-    while (1)
+    for (int path = 0; path < ctx.path_count; path++)
     {
-        for (int i = 0; i < ctx.path_count; i++)
+        int ports = ctx.paths[path].port_range + 1;
+        shards[path] = malloc(sizeof(int) * ports * ctx.workers);
+        if (shards[path] == NULL)
         {
-            int range = ctx.paths[i].port_range;
+            ERROR("malloc");
+            return -1;
+        }
+        for (int token = 0; token < ports; token++)
+        {
+            int port = ctx.paths[path].port_start + token;
+            ipaddr addr = iplocal(ctx.paths[path].server, port, 0);
+            int *fds = shards[path] + token * ctx.workers;
+            for (int i = 0; i < ctx.workers; i++)
+            {
+                fds[i] = udpio_bind(addr, 1);
+                if (fds[i] < 0)
+                {
+                    ERROR("bind");
+                    return -1;
+                }
+            }
+            if (udpio_steer(fds[0], ctx.workers) != 0)
+            {
+                ERROR("SO_ATTACH_REUSEPORT_CBPF");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// 添加 TPROXY 规则, 为每个 worker 打开 port_start 上的透明 socket
+// 失败时撤销已添加的规则并关闭已打开的 socket, 退出时不会再删除规则
+static int tproxy_setup(void)
+{
+#ifdef TARGET_LINUX
+    int path;
+    int opened = 0;
+    for (path = 0; path < ctx.path_count; path++)
+    {
+        int ipv6 = (strchr(ctx.paths[path].server, ':') != NULL);
+        int ipv4 = !ipv6 || (strcmp(ctx.paths[path].server, "::") == 0);
+        int end = ctx.paths[path].port_start + ctx.paths[path].port_range;
+        if (tproxy(ctx.paths[path].port_start, end, ipv4, ipv6, 1) != 0)
+        {
+            LOG("failed to add tproxy rule for ports %d-%d", ctx.paths[path].port_start, end);
+            break;
+        }
+        ipaddr addr = iplocal(ctx.paths[path].server, ctx.paths[path].port_start, 0);
+        for (opened = 0; opened < ctx.workers; opened++)
+        {
+            tproxy_fds[path][opened] = udpio_tproxy(addr, ctx.workers > 1);
+            if (tproxy_fds[path][opened] < 0)
+            {
+                ERROR("udpio_tproxy");
+                break;
+            }
+        }
+        if (opened < ctx.workers)
+        {
+            path++;
+            break;
+        }
+    }
+    if ((path == ctx.path_count) && (opened == ctx.workers))
+    {
+        return 0;
+    }
+
+    while (path-- > 0)
+    {
+        for (int i = 0; i < opened; i++)
+        {
+            close(tproxy_fds[path][i]);
+        }
+        opened = ctx.workers;
+        int ipv6 = (strchr(ctx.paths[path].server, ':') != NULL);
+        int ipv4 = !ipv6 || (strcmp(ctx.paths[path].server, "::") == 0);
+        int end = ctx.paths[path].port_start + ctx.paths[path].port_range;
+        tproxy(ctx.paths[path].port_start, end, ipv4, ipv6, 0);
+    }
+    return -1;
+#else
+    return -1;
+#endif
+}
+
+
+// 回复用的 socket 绑定到客户端发往的地址和端口, 只为有效 token 打开
+// token 0 就是透明 socket 自己的端口
+static udpsock reply_sock(int path, int token, ipaddr local)
+{
+    if (ctx.paths[path].socks[token] != NULL)
+    {
+        return ctx.paths[path].socks[token];
+    }
+    int fd = (token == 0) ? tproxy_fds[path][ctx.worker] : udpio_bind(local, 0);
+    udpsock s = (fd < 0) ? NULL : udpattach(fd);
+    if (s == NULL)
+    {
+        ERROR("bind");
+        return NULL;
+    }
+    ctx.paths[path].socks[token] = s;
+    ctx.paths[path].fds[token] = fd;
+    return s;
+}
+
+
+// 关闭已经失效的回复 socket
+static void reply_gc(int path)
+{
+    for (int token = 1; token <= ctx.paths[path].port_range; token++)
+    {
+        udpsock s = ctx.paths[path].socks[token];
+        if ((s != NULL) && (s != ctx.paths[path].sock) && !token_valid(path, token))
+        {
+            udpclose(s);
+            ctx.paths[path].socks[token] = NULL;
+            ctx.paths[path].fds[token] = -1;
+        }
+    }
+}
+
+
+// 按 worker 的用法估算 buffer 数量, fork 之后每个 worker 单独分配
+static int pool_setup(void)
+{
+    // 发送队列, 批量收发缓冲区, 心跳包
+    int count = SENDQ_SIZE + 2 * BATCH_MAX + 1;
+    if ((ctx.batch == 1) && (ctx.io == IO_POLL) && !((ctx.mode == MODE_SERVER) && (conf->tproxy)))
+    {
+        // 逐包模式下每个 udp_worker 占用一个 buffer
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            count += (ctx.mode == MODE_SERVER) ? ctx.paths[i].port_range + 1 : 16;
+        }
+    }
+    if (pool_init(count, conf->hugepages) != 0)
+    {
+        LOG("failed to allocate packet buffers");
+        return -1;
+    }
+
+    for (int i = 0; i < BATCH_MAX; i++)
+    {
+        if ((ctx.batch > 1) || (xsk != NULL) || (conf->tproxy))
+        {
+            rx_pbufs[i] = pool_get();
+        }
+        if (ctx.batch > 1)
+        {
+            tx.pbufs[i] = pool_get();
+        }
+    }
+    return 0;
+}
+
+
+coroutine static void tun_worker(void)
+{
+    if (ctx.io == IO_URING)
+    {
+        tun_worker_uring();
+        return;
+    }
+    if (ctx.batch > 1)
+    {
+        tun_worker_batch();
+        return;
+    }
+
+    sendq.ch = chmake(pbuf_t *, SENDQ_SIZE);
+    go(udp_sender());
+
+    static pbuf_t drop;
+    int events;
+    ssize_t n;
+    while (1)
+    {
+        events = fdwait(ctx.tun, FDW_IN, -1);
+        if (!(events & FDW_IN))
+        {
+            continue;
+        }
+        while (1)
+        {
+            // 队列满了先让 udp_sender 发送, 仍然满或没有空闲 buffer 则丢包
+            if (sendq.count == SENDQ_SIZE)
+            {
+                yield();
+            }
+            pbuf_t *pbuf = (sendq.count < SENDQ_SIZE) ? pool_get() : NULL;
+            if (pbuf == NULL)
+            {
+                pbuf = &drop;
+            }
+
+            // 从 tun 设备读取 IP 包
+            n = tun_read(ctx.tun, pbuf->payload, ctx.mtu);
+            if (n <= 0)
+            {
+                if (pbuf != &drop)
+                {
+                    pool_put(pbuf);
+                }
+                if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+                {
+                    break;
+                }
+                ERROR_RATELIMIT(1000, "tun_read");
+                return;
+            }
+            if (pbuf == &drop)
+            {
+                ctx.snmp.out_drops++;
+                continue;
+            }
+            pbuf->len = (uint16_t)n;
+            pbuf->flag = 0x0000;
+
+            // 发送到 remote
+            sendq.count++;
+            chs(sendq.ch, pbuf_t *, pbuf);
+        }
+    }
+}
+
+
+// 只统计真正发出去的包, socket 缓冲区满时剩下的算作丢弃, 和 udpsend() 一样不重试
+static void tx_count(const int *lens, int count, int sent)
+{
+    for (int i = 0; i < sent; i++)
+    {
+        ctx.snmp.out_bytes += lens[i];
+    }
+    ctx.snmp.out_packets += sent;
+    ctx.snmp.out_drops += count - sent;
+}
+
+
+static void tx_flush(void)
+{
+    for (int path = 0; path < ctx.path_count; path++)
+    {
+        int sent = 0;
+        if ((tx.counts[path] > 0) && ctx.paths[path].xdp && (xsk != NULL))
+        {
+            sent = xdp_send(xsk, &ctx.paths[path].peer, tx.queue[path], tx.lens[path],
+                            tx.counts[path]);
+        }
+        else if (tx.counts[path] > 0)
+        {
+            const ipaddr *remote = ctx.paths[path].connected ? NULL : &ctx.paths[path].remote;
+            sent = udpio_send(ctx.paths[path].fd, remote, tx.queue[path], tx.lens[path],
+                              tx.counts[path]);
+        }
+        tx_count(tx.lens[path], tx.counts[path], sent);
+        tx.counts[path] = 0;
+    }
+    for (int i = 0; i < tx.group_count; i++)
+    {
+        int path = tx.groups[i].path;
+        int token = tx.groups[i].token;
+        int sent = 0;
+        if (token_sock(path, token) != NULL)
+        {
+            sent = udpio_send(ctx.paths[path].fds[token], &tx.groups[i].remote,
+                              tx.groups[i].queue, tx.groups[i].lens, tx.groups[i].count);
+        }
+        tx_count(tx.groups[i].lens, tx.groups[i].count, sent);
+    }
+    tx.group_count = 0;
+    tx.used = 0;
+}
+
+
+// 发往同一个客户端地址的包放在一组, 通常和上一个包同组
+static void tx_group(int path, int token, const ipaddr *remote, pbuf_t *pbuf, int n)
+{
+    int i;
+    for (i = tx.group_count - 1; i >= 0; i--)
+    {
+        if ((tx.groups[i].path == path) && (tx.groups[i].token == token)
+            && udpio_addr_equal(&(tx.groups[i].remote), remote))
+        {
+            break;
+        }
+    }
+    if (i < 0)
+    {
+        i = tx.group_count++;
+        tx.groups[i].path = path;
+        tx.groups[i].token = token;
+        tx.groups[i].remote = *remote;
+        tx.groups[i].count = 0;
+    }
+    tx.groups[i].queue[tx.groups[i].count] = pbuf;
+    tx.groups[i].lens[tx.groups[i].count] = n;
+    tx.groups[i].count++;
+}
+
+
+// 校验包排在同一个 path 上这一组的数据包之后, 和它们一起发送
+static void tx_parity(int path)
+{
+    pbuf_t *pbuf = tx.pbufs[tx.used];
+    if (!fec_parity(pbuf))
+    {
+        return;
+    }
+    int n = encapsulate(ctx.paths[path].token, ctx.paths[path].cipher, pbuf, ctx.mtu,
+                        &ctx.paths[path].obfs);
+    ctx.snmp.out_padding += pbuf->padding;
+    tx.queue[path][tx.counts[path]] = pbuf;
+    tx.lens[path][tx.counts[path]] = n;
+    tx.counts[path]++;
+    tx.used++;
+    if (tx.used == BATCH_MAX)
+    {
+        tx_flush();
+    }
+}
+
+
+// 加密并放入发送队列, tx_flush() 之前 pbuf 不能被修改
+static void tx_queue(pbuf_t *pbuf, int n)
+{
+    pbuf->len = (uint16_t)n;
+    pbuf->flag = 0x0000;
+
+    if (ctx.sessions > 0)
+    {
+        session_t *se;
+        int token;
+        ipaddr remote;
+        int cipher;
+        int path = session_lookup(pbuf, &se, &token, &remote, &cipher);
+        if (path >= 0)
+        {
+            n = encapsulate(token, cipher, pbuf, ctx.mtu, &ctx.paths[path].obfs);
+            ctx.snmp.out_padding += pbuf->padding;
+            session_count(se, 1, n);
+            tx_group(path, token, &remote, pbuf, n);
+        }
+        tx.used++;
+        if (tx.used == BATCH_MAX)
+        {
+            tx_flush();
+        }
+        return;
+    }
+
+    int path = select_path();
+    int parity = 0;
+    if (path >= 0)
+    {
+        int token = ctx.paths[path].token;
+        if (probes != NULL)
+        {
+            probe_mark(&probes[path], pbuf, 0, probe_clock());
+        }
+        if (conf->reorder || conf->fec)
+        {
+            pbuf->flag |= FLAG_SEQ;
+            pbuf->seq = tx_seq++;
+            parity = conf->fec && fec_encode(pbuf->payload, pbuf->len, pbuf->seq, now());
+        }
+        n = encapsulate(token, ctx.paths[path].cipher, pbuf, ctx.mtu, &ctx.paths[path].obfs);
+        ctx.snmp.out_padding += pbuf->padding;
+        tx.queue[path][tx.counts[path]] = pbuf;
+        tx.lens[path][tx.counts[path]] = n;
+        tx.counts[path]++;
+    }
+    else
+    {
+        ctx.snmp.out_drops++;
+    }
+    tx.used++;
+    if (tx.used == BATCH_MAX)
+    {
+        tx_flush();
+    }
+    if (parity)
+    {
+        tx_parity(path);
+    }
+}
+
+
+static void tun_worker_batch(void)
+{
+    static uint8_t buf[OFFLOAD_BUF_SIZE];
+    while (1)
+    {
+        int events = fdwait(ctx.tun, FDW_IN, -1);
+        if (!(events & FDW_IN))
+        {
+            continue;
+        }
+
+        for (int i = 0; i < ctx.batch; i++)
+        {
+            ssize_t n;
+            if (ctx.offload)
+            {
+                n = tun_read(ctx.tun, buf, sizeof(buf));
+            }
+            else
+            {
+                n = tun_read(ctx.tun, tx.pbufs[tx.used]->payload, ctx.mtu);
+            }
+            if (n < 0)
+            {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                ERROR_RATELIMIT(1000, "tun_read");
+                return;
+            }
+            else if (n == 0)
+            {
+                ERROR_RATELIMIT(1000, "tun_read");
+                return;
+            }
+
+            if (!ctx.offload)
+            {
+                tx_queue(tx.pbufs[tx.used], (int)n);
+                continue;
+            }
+
+            // 把 TSO 包切成 MTU 大小的 IP 包
+            offload_t it;
+            if (offload_begin(&it, buf, (int)n) != 0)
+            {
+                continue;
+            }
+            while ((n = offload_next(&it, tx.pbufs[tx.used]->payload, ctx.mtu)) > 0)
+            {
+                tx_queue(tx.pbufs[tx.used], (int)n);
+            }
+        }
+        tx_flush();
+    }
+}
+
+
+static int tun_arm(int i)
+{
+    uint8_t *buf = tun_bufs + (size_t)i * tun_buf_size;
+    uint64_t data = ((uint64_t)i << 1) | URING_TUN;
+    if (ctx.offload)
+    {
+        return uring_read_fixed(ctx.tun, buf, OFFLOAD_BUF_SIZE, data);
+    }
+    else
+    {
+        return uring_read_fixed(ctx.tun, ((pbuf_t *)buf)->payload, ctx.mtu, data);
+    }
+}
+
+
+static int uring_setup(void)
+{
+    ring_fd = uring_init(URING_ENTRIES);
+    if (ring_fd < 0)
+    {
+        return -1;
+    }
+
+    // tun 读缓冲区注册为 fixed buffer, udp 用 provided buffer ring
+    tun_buf_size = ctx.offload ? OFFLOAD_BUF_SIZE : sizeof(pbuf_t);
+    tun_buf_size = (tun_buf_size + 63) & ~(size_t)63;
+    udp_buf_size = (URING_MSG_OVERHEAD + sizeof(pbuf_t) + 63) & ~(size_t)63;
+    tun_bufs = mmap(NULL, tun_buf_size * URING_READS, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    udp_bufs = mmap(NULL, udp_buf_size * URING_BUFS, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int flags = fcntl(ctx.tun, F_GETFL, 0);
+    if ((tun_bufs == MAP_FAILED) || (udp_bufs == MAP_FAILED)
+        || (uring_register(tun_bufs, tun_buf_size * URING_READS) != 0)
+        || (uring_provide(udp_bufs, udp_buf_size, URING_BUFS) != 0)
+        || (flags < 0) || (fcntl(ctx.tun, F_SETFL, flags & ~O_NONBLOCK) < 0))
+    {
+        uring_close();
+        if (tun_bufs != MAP_FAILED)
+        {
+            munmap(tun_bufs, tun_buf_size * URING_READS);
+        }
+        if (udp_bufs != MAP_FAILED)
+        {
+            munmap(udp_bufs, udp_buf_size * URING_BUFS);
+        }
+        ring_fd = -1;
+        return -1;
+    }
+
+    for (int i = 0; i < URING_READS; i++)
+    {
+        tun_arm(i);
+    }
+    return 0;
+}
+
+
+// 处理一个 tun 读完成事件, 返回 -1 表示 tun 不可用
+// 其他错误 (EAGAIN, EINTR, ENOBUFS 等) 只丢掉这次读, 读请求照样重新提交
+static int tun_input_uring(int i, int res)
+{
+    uint8_t *buf = tun_bufs + (size_t)i * tun_buf_size;
+    if (res <= 0)
+    {
+        if ((res == -EAGAIN) || (res == -EINTR))
+        {
+            return 0;
+        }
+        errno = (res < 0) ? -res : EIO;
+        ERROR_RATELIMIT(1000, "tun_read");
+        if ((res == 0) || (res == -EBADF) || (res == -EFAULT)
+            || (res == -EINVAL) || (res == -EIO))
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!ctx.offload)
+    {
+        // 直接在读缓冲区里加密, tx_flush() 之后再重新提交读请求
+        tx_queue((pbuf_t *)buf, res);
+        return 0;
+    }
+
+    offload_t it;
+    if (offload_begin(&it, buf, res) == 0)
+    {
+        int n;
+        while ((n = offload_next(&it, tx.pbufs[tx.used]->payload, ctx.mtu)) > 0)
+        {
+            tx_queue(tx.pbufs[tx.used], n);
+        }
+    }
+    return 0;
+}
+
+
+// 收割 io_uring 完成事件, 代替 tun_worker 和 udp_worker 里的 fdwait
+static void tun_worker_uring(void)
+{
+    static uring_event_t events[URING_ENTRIES];
+    static int rearm[URING_READS];
+    static int bids[URING_ENTRIES];
+    // 提交队列满时没能重新提交的读请求留到下一轮
+    int nrearm = 0;
+    while (1)
+    {
+        if (uring_submit(0) < 0)
+        {
+            ERROR_RATELIMIT(1000, "io_uring_enter");
+        }
+        fdwait(ring_fd, FDW_IN, (nrearm > 0) ? now() + 1 : -1);
+
+        int n = uring_reap(events, URING_ENTRIES);
+        int nbids = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uring_event_t *e = &events[i];
+            if (e->data == 0)
+            {
+                // cancel
+                continue;
+            }
+            if (e->data & URING_TUN)
+            {
+                int idx = (int)(e->data >> 1);
+                if (tun_input_uring(idx, e->res) != 0)
+                {
+                    // 和 tun_worker_batch() 一样, tun 坏了就退出
+                    return;
+                }
+                rearm[nrearm++] = idx;
+                continue;
+            }
+
+            uring_sock_t *us = (uring_sock_t *)(uintptr_t)e->data;
+            if (e->bid >= 0)
+            {
+                bids[nbids++] = e->bid;
+                int len;
+                void *name;
+                pbuf_t *pbuf = uring_payload(e, &us->msg, &len, &name);
+                if ((pbuf != NULL) && !us->closing)
+                {
+                    ipaddr addr;
+                    memcpy(&addr, name, sizeof(ipaddr));
+                    if ((ctx.mode == MODE_SERVER) && !token_valid(us->path, us->token))
+                    {
+                        drop_packet(DROP_TOKEN, &addr);
+                    }
+                    else
+                    {
+                        udp_input(us->path, us->token, us->s, us->fd, addr, pbuf, len);
+                    }
+                }
+            }
+            if (!e->more)
+            {
+                // multishot 结束 (取消或缓冲区用完), 未关闭则重新提交
+                if (us->closing || (uring_recvmsg(us->fd, &us->msg, e->data) != 0))
+                {
+                    us->armed = 0;
+                }
+            }
+        }
+
+        // 缓冲区在写完 tun/udp 之后才能还给内核
+        if (ctx.offload && (offload_flush(ctx.tun) != 0))
+        {
+            ERROR_RATELIMIT(1000, "tun_write");
+        }
+        tx_flush();
+        for (int i = 0; i < nbids; i++)
+        {
+            uring_recycle(bids[i]);
+        }
+        int left = 0;
+        for (int i = 0; i < nrearm; i++)
+        {
+            if (tun_arm(rearm[i]) != 0)
+            {
+                rearm[left++] = rearm[i];
+            }
+        }
+        nrearm = left;
+    }
+}
+
+
+static void udp_worker_uring(int path, int token, udpsock s, int fd, int64_t deadline)
+{
+    // 结构体在协程栈上, 直到 multishot 请求结束
+    uring_sock_t us;
+    memset(&us, 0, sizeof(us));
+    us.path = path;
+    us.token = token;
+    us.s = s;
+    us.fd = fd;
+    us.msg.msg_namelen = sizeof(ipaddr);
+    uint64_t data = (uint64_t)(uintptr_t)&us;
+    if (uring_recvmsg(fd, &us.msg, data) != 0)
+    {
+        ERROR("io_uring");
+        return;
+    }
+    us.armed = 1;
+
+    msleep(deadline);
+
+    us.closing = 1;
+    uring_cancel(data);
+    while (us.armed)
+    {
+        msleep(now() + 10);
+    }
+}
+
+
+// AF_XDP 收包, 按目的端口找到 path 和 token 后和 socket 收到的包一样处理
+coroutine static void xdp_worker(void)
+{
+    pbuf_t **pbufs = rx_pbufs;
+    static ipaddr addrs[BATCH_MAX];
+    static int ports[BATCH_MAX];
+    static int lens[BATCH_MAX];
+    static xdp_peer_t peers[BATCH_MAX];
+    while (1)
+    {
+        fdwait(xdp_fd(xsk), FDW_IN, -1);
+        int n = xdp_recv(xsk, pbufs, addrs, ports, peers, lens, BATCH_MAX);
+        for (int i = 0; i < n; i++)
+        {
+            int path;
+            for (path = 0; path < ctx.path_count; path++)
+            {
+                int token = ports[i] - ctx.paths[path].port_start;
+                if ((token >= 0) && (token <= ctx.paths[path].port_range))
+                {
+                    break;
+                }
+            }
+            if (path == ctx.path_count)
+            {
+                continue;
+            }
+            int token = ports[i] - ctx.paths[path].port_start;
+            udpsock s = ctx.paths[path].socks[token];
+            if ((s == NULL) && (conf->tproxy) && token_valid(path, token))
+            {
+                ipaddr local = iplocal(ctx.paths[path].server, ports[i], 0);
+                s = reply_sock(path, token, local);
+            }
+            if (s == NULL)
+            {
+                continue;
+            }
+            if (!token_valid(path, token))
+            {
+                drop_packet(DROP_TOKEN, &addrs[i]);
+                continue;
+            }
+            if (udp_input(path, token, s, ctx.paths[path].fds[token], addrs[i],
+                          pbufs[i], lens[i]) == 0)
+            {
+                ctx.paths[path].xdp = 1;
+                ctx.paths[path].peer = peers[i];
+            }
+        }
+        if (ctx.offload && (offload_flush(ctx.tun) != 0))
+        {
+            ERROR_RATELIMIT(1000, "tun_write");
+        }
+    }
+}
+
+
+// 一个透明 socket 收整个端口范围, 原目的端口就是 token
+coroutine static void tproxy_worker(int path)
+{
+    static ipaddr addrs[BATCH_MAX];
+    static ipaddr dsts[BATCH_MAX];
+    static int lens[BATCH_MAX];
+    pbuf_t **pbufs = rx_pbufs;
+    int fd = tproxy_fds[path][ctx.worker];
+    ctx.paths[path].alive = 0;
+    while (1)
+    {
+        fdwait(fd, FDW_IN, -1);
+        int n = udpio_recvdst(fd, pbufs, addrs, dsts, lens, ctx.batch);
+        if (n < 0)
+        {
+            ERROR_RATELIMIT(1000, "recvmmsg");
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int token = udpio_port(&dsts[i]) - ctx.paths[path].port_start;
+            if ((token < 0) || (token > ctx.paths[path].port_range))
+            {
+                continue;
+            }
+            if (!token_valid(path, token))
+            {
+                drop_packet(DROP_TOKEN, &addrs[i]);
+                continue;
+            }
+            udpsock s = reply_sock(path, token, dsts[i]);
+            if (s != NULL)
+            {
+                udp_input(path, token, s, ctx.paths[path].fds[token], addrs[i], pbufs[i], lens[i]);
+            }
+        }
+        if (ctx.offload && (offload_flush(ctx.tun) != 0))
+        {
+            ERROR_RATELIMIT(1000, "tun_write");
+        }
+    }
+}
+
+
+coroutine static void client_hop(void)
+{
+    if (conf->hop == HOP_REUSE)
+    {
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            for (int j = 0; j < HOP_SOCKS; j++)
+            {
+                go(hop_worker(i, j));
+            }
+        }
+        return;
+    }
+    while (1)
+    {
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            int range = ctx.paths[i].port_range;
             int token = totp(range, 0);
             go(udp_worker(i, token, 5 * 1000));
         }
@@ -269,143 +1693,495 @@ coroutine static void client_hop(void)
 }
 
 
-coroutine static void udp_worker(int path, int token, int timeout)
+// hop=reuse: 一个 socket 每 HOP_SOCKS 个 TOTP_STEP 重新 connect 到新端口,
+// 期间一直接收旧端口的回包
+coroutine static void hop_worker(int path, int slot)
+{
+    ipaddr addr = iplocal(NULL, 0, IPADDR_PREF_IPV6);
+    int fd = udpio_bind(addr, 0);
+    udpsock s = (fd < 0) ? NULL : udpattach(fd);
+    if (s == NULL)
+    {
+        LOG("failed to bind udp address");
+        return;
+    }
+
+    int64_t deadline = now() + slot * TOTP_STEP;
+    msleep(deadline);
+    while (1)
+    {
+        int token = totp(ctx.paths[path].port_range, 0);
+        int port = ctx.paths[path].port_start + token;
+        ipaddr remote;
+        if (path_remote(path, port, &remote) != 0)
+        {
+            // 还没有解析出地址
+            deadline += TOTP_STEP;
+            msleep(deadline);
+            continue;
+        }
+        int connected = (udpio_connect(fd, remote) == 0);
+        if (!connected)
+        {
+            ERROR("connect");
+        }
+        ctx.paths[path].sock = s;
+        ctx.paths[path].fd = fd;
+        ctx.paths[path].remote = remote;
+        ctx.paths[path].token = token;
+        ctx.paths[path].connected = connected;
+
+        deadline += HOP_SOCKS * TOTP_STEP;
+        if (ctx.io == IO_URING)
+        {
+            udp_worker_uring(path, token, s, fd, deadline);
+        }
+        else if (ctx.batch > 1)
+        {
+            udp_worker_batch(path, token, s, fd, deadline);
+        }
+        else
+        {
+            udp_worker_single(path, token, s, fd, deadline);
+        }
+    }
+}
+
+
+coroutine static void udp_worker(int path, int token, int timeout)
+{
+    int64_t deadline;
+    if (timeout < 0)
+    {
+        deadline = -1;
+    }
+    else
+    {
+        deadline = now() + timeout;
+    }
+
+    int port = ctx.paths[path].port_start + token;
+    ipaddr addr;
+    if (ctx.mode == MODE_CLIENT)
+    {
+        // client
+        ipaddr remote;
+        if (path_remote(path, port, &remote) != 0)
+        {
+            return;
+        }
+        addr = iplocal(NULL, 0, IPADDR_PREF_IPV6);
+        ctx.paths[path].remote = remote;
+        ctx.paths[path].token = token;
+    }
+    else
+    {
+        // server
+        addr = iplocal(ctx.paths[path].server, port, 0);
+        ctx.paths[path].alive = 0;
+    }
+    udpsock s;
+    int fd = -1;
+    if ((ctx.mode == MODE_SERVER) && (shards[path] != NULL))
+    {
+        // 在 steer_setup() 里已经打开
+        fd = shards[path][token * ctx.workers + ctx.worker];
+        s = udpattach(fd);
+    }
+    else if ((ctx.batch > 1) || (ctx.workers > 1))
+    {
+        // every worker binds all ports, kernel spreads datagrams among them
+        fd = udpio_bind(addr, ctx.workers > 1);
+        s = (fd < 0) ? NULL : udpattach(fd);
+    }
+    else
+    {
+        s = udplisten(addr);
+    }
+
+    if (s == NULL)
+    {
+        LOG("failed to bind udp address");
+        return;
+    }
+
+    ctx.paths[path].sock = s;
+    ctx.paths[path].fd = fd;
+    if (ctx.paths[path].socks != NULL)
+    {
+        ctx.paths[path].socks[token] = s;
+        ctx.paths[path].fds[token] = fd;
+    }
+
+    if (ctx.io == IO_URING)
+    {
+        udp_worker_uring(path, token, s, fd, deadline);
+        udpclose(s);
+        return;
+    }
+    if (ctx.batch > 1)
+    {
+        udp_worker_batch(path, token, s, fd, deadline);
+        udpclose(s);
+        return;
+    }
+
+    udp_worker_single(path, token, s, fd, deadline);
+    udpclose(s);
+}
+
+
+// 逐包接收
+static void udp_worker_single(int path, int token, udpsock s, int fd, int64_t deadline)
+{
+    pbuf_t *pbuf = pool_get();
+    if (pbuf == NULL)
+    {
+        LOG("packet buffer pool exhausted");
+        return;
+    }
+    // 客户端不关心来源地址
+    ipaddr addr = ctx.paths[path].remote;
+    // 最长的是带序号的校验包
+    size_t size = ctx.mtu + PAYLOAD_OFFSET + CRYPTO_TAG_LEN + SEQ_LEN + FEC_HEADER_LEN;
+    ssize_t n;
+    while (1)
+    {
+        if (ctx.mode == MODE_CLIENT)
+        {
+            // client
+            n = udprecv(s, NULL, pbuf, size, deadline);
+        }
+        else
+        {
+            // server
+            n = udprecv(s, &addr, pbuf, size, deadline);
+            if (!token_valid(path, token))
+            {
+                if (errno == 0)
+                {
+                    drop_packet(DROP_TOKEN, &addr);
+                }
+                continue;
+            }
+        }
+        if (errno == ETIMEDOUT)
+        {
+            break;
+        }
+        else if (errno != 0)
+        {
+            ERROR_RATELIMIT(1000, "udprecv");
+            continue;
+        }
+
+        udp_input(path, token, s, fd, addr, pbuf, n);
+    }
+    pool_put(pbuf);
+}
+
+
+// 批量接收: 每次唤醒用 recvmmsg 读取多个包
+static void udp_worker_batch(int path, int token, udpsock s, int fd, int64_t deadline)
+{
+    pbuf_t **pbufs = rx_pbufs;
+    static ipaddr addrs[BATCH_MAX];
+    static int lens[BATCH_MAX];
+
+    while (1)
+    {
+        int events = fdwait(fd, FDW_IN, deadline);
+        if (events == 0)
+        {
+            // timeout
+            break;
+        }
+
+        // GRO 超级包拆出的分段可能一次取不完, 取完之前不能切换协程
+        do
+        {
+            int n = udpio_recv(fd, pbufs, addrs, lens, ctx.batch);
+            if (n < 0)
+            {
+                ERROR_RATELIMIT(1000, "recvmmsg");
+                break;
+            }
+            if ((ctx.mode == MODE_SERVER) && (n > 0) && !token_valid(path, token))
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    drop_packet(DROP_TOKEN, &addrs[i]);
+                }
+                continue;
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                udp_input(path, token, s, fd, addrs[i], pbufs[i], lens[i]);
+            }
+            if (ctx.offload && (offload_flush(ctx.tun) != 0))
+            {
+                ERROR_RATELIMIT(1000, "tun_write");
+            }
+        } while (udpio_pending(fd));
+    }
+}
+
+
+// 统计丢弃的包, 来源地址去重后留给 drop_summary()
+static void drop_packet(int reason, const ipaddr *addr)
+{
+    ctx.snmp.in_drops[reason]++;
+
+    // 本机发来的包不计入汇总
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    if ((sin->sin_family == AF_INET) && (sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK)))
+    {
+        return;
+    }
+
+    invalid.count++;
+    ipaddr a = *addr;
+    udpio_setport(&a, 0);
+    for (int i = 0; i < invalid.sources; i++)
+    {
+        if (udpio_addr_equal(&invalid.addrs[i], &a))
+        {
+            return;
+        }
+    }
+    if (invalid.sources < SUMMARY_SOURCES)
+    {
+        invalid.addrs[invalid.sources++] = a;
+    }
+}
+
+
+static void drop_summary(void)
+{
+    int64_t t = now();
+    if (t - invalid.since < SUMMARY_INTERVAL)
+    {
+        return;
+    }
+    if (invalid.count > 0)
+    {
+        char buf[IPADDR_MAXSTRLEN];
+        ipaddrstr(invalid.addrs[0], buf);
+        LOG("%" PRIu64 " invalid packets from %s%d sources in last %ds, first from %s",
+            invalid.count, (invalid.sources == SUMMARY_SOURCES) ? ">=" : "",
+            invalid.sources, (int)((t - invalid.since) / 1000), buf);
+    }
+    invalid.count = 0;
+    invalid.sources = 0;
+    invalid.since = t;
+}
+
+
+static int token_valid(int path, int token)
+{
+    if ((token < 0) || (token > ctx.paths[path].port_range))
+    {
+        return 0;
+    }
+    return (token_maps[path][token / 8] >> (token % 8)) & 1;
+}
+
+
+// 处理收到的 UDP 包
+static int udp_input(int path, int token, udpsock s, int fd, ipaddr addr, pbuf_t *pbuf, ssize_t n)
+{
+    if (n < PAYLOAD_OFFSET)
+    {
+        drop_packet(DROP_SHORT, &addr);
+        return -1;
+    }
+
+    // decrypt, decompress
+    n = decapsulate(token, pbuf, n);
+    if (n < 0)
+    {
+        // invalid packet
+        drop_packet(DROP_AUTH, &addr);
+        return -1;
+    }
+
+    ctx.snmp.in_packets++;
+    ctx.snmp.in_bytes += n;
+
+    if (ctx.sessions > 0)
+    {
+        // 每个客户端的地址记在会话里, 不改动 path
+        session_input(path, token, addr, pbuf, (int)n);
+    }
+    else
+    {
+        // update active socket, remote address
+        if (ctx.mode == MODE_SERVER)
+        {
+            ctx.paths[path].sock = s;
+            ctx.paths[path].fd = fd;
+            ctx.paths[path].remote = addr;
+            ctx.paths[path].token = token;
+            ctx.paths[path].xdp = 0;
+            ctx.paths[path].cipher = pbuf->cipher;
+        }
+        // renew path alive ttl
+        ctx.paths[path].alive = 5;
+        if (ctx.workers > 1)
+        {
+            hint_publish(path, addr, token, ctx.paths[path].cipher);
+        }
+    }
+
+    // 回显探测包; session=yes 的服务器不发送心跳包, 回复每个心跳包,
+    // 客户端据此判断 path 可用
+    int heartbeat = (n == 0) || (pbuf->flag & FLAG_IDENT);
+    if (pbuf->flag & FLAG_ECHO)
+    {
+        if (probes != NULL)
+        {
+            probe_echo(&probes[path], ntohl(pbuf->ack), probe_clock());
+        }
+    }
+    else if ((pbuf->flag & FLAG_TS) || (heartbeat && (ctx.sessions > 0)))
+    {
+        reply(path, token, s, addr, pbuf);
+    }
+
+    if (heartbeat)
+    {
+        return 0;
+    }
+
+    if (pbuf->flag & FLAG_FEC)
+    {
+        if (conf->fec)
+        {
+            fec_repair(pbuf->payload, pbuf->len, pbuf->seq);
+        }
+        return 0;
+    }
+    if ((pbuf->flag & FLAG_SEQ) && conf->fec && (fec_input(pbuf->payload, pbuf->len, pbuf->seq) < 0))
+    {
+        // 已经重建过了
+        return 0;
+    }
+    if (pbuf->flag & FLAG_SEQ)
+    {
+        tun_deliver(pbuf->payload, pbuf->len, pbuf->seq);
+        return 0;
+    }
+    tun_output(pbuf->payload, pbuf->len);
+    return 0;
+}
+
+
+// 带序号的包经过重排缓冲区
+static void tun_deliver(const uint8_t *pkt, int len, uint32_t seq)
 {
-    int64_t deadline;
-    if (timeout < 0)
+    if (!conf->reorder)
     {
-        deadline = -1;
+        tun_output(pkt, len);
     }
     else
     {
-        deadline = now() + timeout;
+        // 写出缓存的包之后缓冲区可能被下一个包覆盖, 不能留在 offload 里
+        if ((reorder_input(pkt, len, seq, now()) > 0) && ctx.offload
+            && (offload_flush(ctx.tun) != 0))
+        {
+            ERROR_RATELIMIT(1000, "tun_write");
+        }
+        if (reorder_wake.idle && (reorder_deadline() >= 0))
+        {
+            reorder_wake.idle = 0;
+            chs(reorder_wake.ch, int, 1);
+        }
     }
+}
 
-    int port = ctx.paths[path].port_start + token;
-    ipaddr addr;
-    if (ctx.mode == MODE_CLIENT)
+
+// 写入到 tun 设备, offload 模式下合并后在批次结束时写入
+static void tun_output(const uint8_t *pkt, int len)
+{
+    int n;
+    if (ctx.offload)
     {
-        // client
-        addr = iplocal(NULL, 0, IPADDR_PREF_IPV6);
-        ctx.paths[path].remote = ipremote(ctx.paths[path].server, port, 0, -1);
-        ctx.paths[path].token = token;
+        n = offload_push(ctx.tun, (uint8_t *)pkt, len);
     }
     else
     {
-        // server
-        addr = iplocal(ctx.paths[path].server, port, 0);
-        ctx.paths[path].alive = 0;
+        n = tun_write(ctx.tun, (uint8_t *)pkt, len);
+    }
+    if (n < 0)
+    {
+        ERROR_RATELIMIT(1000, "tun_write");
     }
-    udpsock s = udplisten(addr);
+}
 
-    if (s == NULL)
+
+// 发送当前一组的校验包
+static void fec_send(void)
+{
+    static pbuf_t pbuf;
+    if (!fec_parity(&pbuf))
     {
-        LOG("failed to bind udp address");
         return;
     }
+    int path = select_path();
+    if (path >= 0)
+    {
+        int n = encapsulate(ctx.paths[path].token, ctx.paths[path].cipher, &pbuf, ctx.mtu,
+                            &ctx.paths[path].obfs);
+        ctx.snmp.out_packets++;
+        ctx.snmp.out_bytes += n;
+        ctx.snmp.out_padding += pbuf.padding;
+        path_send(path, &pbuf, n);
+    }
+}
 
-    ctx.paths[path].sock = s;
 
-    pbuf_t pbuf;
-    ssize_t n;
+// 流量停下时不等一组凑满
+coroutine static void fec_worker(void)
+{
     while (1)
     {
-        if (ctx.mode == MODE_CLIENT)
-        {
-            // client
-            n = udprecv(s, NULL, &pbuf, ctx.mtu + PAYLOAD_OFFSET, deadline);
-        }
-        else
-        {
-            // server
-            n = udprecv(s, &addr, &pbuf, ctx.mtu + PAYLOAD_OFFSET, deadline);
-            int i;
-            for (i = 0; i < POOL; i++)
-            {
-                if (token == ctx.paths[path].valid_tokens[i])
-                {
-                    break;
-                }
-            }
-            if (i >= POOL)
-            {
-                char buf[IPADDR_MAXSTRLEN];
-                ipaddrstr(addr, buf);
-                int port = udpport(s);
-                if (strcmp(buf, "127.0.0.1") != 0)
-                {
-                    LOG("invalid packet from %s:%d", buf, port);
-                }
-                continue;
-            }
-        }
-        if (errno == ETIMEDOUT)
-        {
-            break;
-        }
-        else if (errno != 0)
-        {
-            ERROR("udprecv");
-            continue;
-        }
-        if (n < PAYLOAD_OFFSET)
-        {
-            continue;
-        }
-
-        // decrypt, decompress
-        n = decapsulate(token, &pbuf, n);
-        if (n < 0)
+        if (fec_due(now()))
         {
-            // invalid packet
-            if (ctx.mode == MODE_CLIENT)
-            {
-                LOG("invalid packet, drop");
-            }
-            else
-            {
-                char buf[IPADDR_MAXSTRLEN];
-                ipaddrstr(addr, buf);
-                int port = udpport(s);
-                LOG("invalid packet from %s:%d", buf, port);
-            }
-            continue;
+            fec_send();
         }
+        msleep(now() + FEC_DELAY / 2);
+    }
+}
 
-        ctx.snmp.in_packets++;
-        ctx.snmp.in_bytes += n;
 
-        // update active socket, remote address
-        if (ctx.mode == MODE_SERVER)
+// 等待空洞超时的包, 没有暂存的包时不醒来
+coroutine static void reorder_worker(void)
+{
+    reorder_wake.ch = chmake(int, 1);
+    while (1)
+    {
+        int64_t deadline = reorder_flush(now());
+        if (ctx.offload && (offload_flush(ctx.tun) != 0))
         {
-            ctx.paths[path].sock = s;
-            ctx.paths[path].remote = addr;
-            ctx.paths[path].token = token;
+            ERROR_RATELIMIT(1000, "tun_write");
         }
-        // renew path alive ttl
-        ctx.paths[path].alive = 5;
-
-        if (n == 0)
+        if (deadline < 0)
         {
-            // heartbeat
-            continue;
+            reorder_wake.idle = 1;
+            (void)chr(reorder_wake.ch, int);
         }
-
-        // 写入到 tun 设备
-        n = tun_write(ctx.tun, pbuf.payload, pbuf.len);
-        if (n < 0)
+        else
         {
-            ERROR("tun_write");
+            msleep(deadline);
         }
     }
-    udpclose(s);
 }
 
 
 // 发送心跳包
 coroutine static void heartbeat(void)
 {
-    pbuf_t pbuf;
     while (1)
     {
         for (int path = 0; path < ctx.path_count; path++)
@@ -422,17 +2198,48 @@ coroutine static void heartbeat(void)
                 int token = totp(range, -i);
                 ctx.paths[path].valid_tokens[i * 2 + 1] = token;
             }
-            if ((ctx.mode == MODE_CLIENT) || (ctx.paths[path].alive > 0))
+            crypto_prepare(ctx.paths[path].valid_tokens, POOL);
+            // 每个包只查位图, 不再线性扫描 valid_tokens
+            memset(token_maps[path], 0, ctx.paths[path].port_range / 8 + 1);
+            for (int i = 0; i < POOL; i++)
+            {
+                int token = ctx.paths[path].valid_tokens[i];
+                token_maps[path][token / 8] |= (uint8_t)(1 << (token % 8));
+            }
+            if ((ctx.mode == MODE_SERVER) && (conf->tproxy))
+            {
+                reply_gc(path);
+            }
+            if (ctx.workers > 1)
+            {
+                hint_sync(path);
+            }
+            // 多 worker 模式下只由 worker 0 发送心跳包
+            if (((ctx.mode == MODE_CLIENT) || (ctx.paths[path].alive > 0)) && (ctx.worker == 0))
             {
-                if (ctx.paths[path].sock)
+                pbuf_t *pbuf = ctx.paths[path].sock ? pool_get() : NULL;
+                if (pbuf != NULL)
                 {
-                    pbuf.len = 0;
-                    pbuf.flag = 0;
+                    pbuf->len = 0;
+                    pbuf->flag = 0;
+                    if (ident_len > 0)
+                    {
+                        memcpy(pbuf->payload, ident, ident_len);
+                        pbuf->len = (uint16_t)ident_len;
+                        pbuf->flag = FLAG_IDENT;
+                    }
+                    if (probes != NULL)
+                    {
+                        probe_mark(&probes[path], pbuf, 1, probe_clock());
+                    }
                     int token = ctx.paths[path].token;
-                    int n = encapsulate(token, &pbuf, ctx.mtu);
+                    int n = encapsulate(token, ctx.paths[path].cipher, pbuf, ctx.mtu,
+                                        &ctx.paths[path].obfs);
                     ctx.snmp.out_packets++;
                     ctx.snmp.out_bytes += n;
-                    udpsend(ctx.paths[path].sock, ctx.paths[path].remote, &pbuf, n);
+                    ctx.snmp.out_padding += pbuf->padding;
+                    path_send(path, pbuf, n);
+                    pool_put(pbuf);
                 }
             }
             if (ctx.paths[path].alive > 0)
@@ -447,12 +2254,162 @@ coroutine static void heartbeat(void)
 }
 
 
-// 发送数据包
-coroutine static void udp_sender(pbuf_t *pbuf)
+// 从发送队列取出数据包并发送
+coroutine static void udp_sender(void)
+{
+    while (1)
+    {
+        pbuf_t *pbuf = chr(sendq.ch, pbuf_t *);
+        assert(pbuf != NULL);
+        sendq.count--;
+
+        if (ctx.sessions > 0)
+        {
+            session_t *se;
+            int token;
+            ipaddr remote;
+            int cipher;
+            int path = session_lookup(pbuf, &se, &token, &remote, &cipher);
+            udpsock s = (path >= 0) ? token_sock(path, token) : NULL;
+            if (s != NULL)
+            {
+                int n = encapsulate(token, cipher, pbuf, ctx.mtu, &ctx.paths[path].obfs);
+                ctx.snmp.out_packets++;
+                ctx.snmp.out_bytes += n;
+                ctx.snmp.out_padding += pbuf->padding;
+                session_count(se, 1, n);
+                udpsend(s, remote, pbuf, n);
+            }
+            pool_put(pbuf);
+            continue;
+        }
+
+        int path = select_path();
+        if (path >= 0)
+        {
+            int token = ctx.paths[path].token;
+            if (probes != NULL)
+            {
+                probe_mark(&probes[path], pbuf, 0, probe_clock());
+            }
+            int parity = 0;
+            if (conf->reorder || conf->fec)
+            {
+                pbuf->flag |= FLAG_SEQ;
+                pbuf->seq = tx_seq++;
+                parity = conf->fec && fec_encode(pbuf->payload, pbuf->len, pbuf->seq, now());
+            }
+            int n = encapsulate(token, ctx.paths[path].cipher, pbuf, ctx.mtu,
+                                &ctx.paths[path].obfs);
+            ctx.snmp.out_packets++;
+            ctx.snmp.out_bytes += n;
+            ctx.snmp.out_padding += pbuf->padding;
+            path_send(path, pbuf, n);
+            if (parity)
+            {
+                fec_send();
+            }
+        }
+        else
+        {
+            ctx.snmp.out_drops++;
+        }
+        pool_put(pbuf);
+    }
+}
+
+
+// 后台解析服务器地址, hop 时只查缓存, 不在数据路径上等待 DNS
+coroutine static void resolver(int path)
+{
+    while (1)
+    {
+        int64_t start = now();
+        ipaddr addr = ipremote(ctx.paths[path].server, 0, 0, start + DNS_TIMEOUT);
+        int err = errno;
+        int64_t latency = now() - start;
+
+        ctx.snmp.dns_lookups++;
+        int bucket = 0;
+        for (int64_t t = 1; (bucket < DNS_HIST - 1) && (latency >= t); t *= 10)
+        {
+            bucket++;
+        }
+        ctx.snmp.dns_latency[bucket]++;
+
+        if (err == 0)
+        {
+            dns_cache[path].addr = addr;
+            dns_cache[path].valid = 1;
+            msleep(now() + DNS_TTL);
+        }
+        else
+        {
+            ctx.snmp.dns_failures++;
+            LOG("failed to resolve %s", ctx.paths[path].server);
+            msleep(now() + DNS_RETRY);
+        }
+    }
+}
+
+
+// 缓存的服务器地址加上端口, 还没有解析成功时返回 -1
+static int path_remote(int path, int port, ipaddr *remote)
+{
+    if (!dns_cache[path].valid)
+    {
+        return -1;
+    }
+    *remote = dns_cache[path].addr;
+    udpio_setport(remote, port);
+    return 0;
+}
+
+
+static void path_send(int path, pbuf_t *pbuf, int n)
 {
-    assert(pbuf != NULL);
+    if (ctx.paths[path].connected)
+    {
+        // 已 connect 的 socket 不带地址发送, 内核复用缓存的路由
+        if (send(ctx.paths[path].fd, pbuf, n, MSG_DONTWAIT) < 0)
+        {
+            ERROR_RATELIMIT(1000, "send");
+        }
+    }
+    else
+    {
+        udpsend(ctx.paths[path].sock, ctx.paths[path].remote, pbuf, n);
+    }
+}
 
+
+// 轮流选择可用的 path, 没有可用的 path 时返回 -1
+static int select_path(void)
+{
     static int path = 0;
+    if ((probes != NULL) && (conf->scheduler != SCHED_RR))
+    {
+        int alive[PATH_MAX_COUNT];
+        int count = 0;
+        for (int i = 0; i < ctx.path_count; i++)
+        {
+            if ((ctx.paths[i].alive <= 0) && (ctx.workers > 1))
+            {
+                hint_sync(i);
+            }
+            // tproxy 的服务器在收到客户端的包之前没有回复用的 socket
+            if ((ctx.paths[i].alive > 0) && (ctx.paths[i].sock != NULL))
+            {
+                alive[count++] = i;
+            }
+        }
+        int best = probe_schedule(probes, alive, count, conf->scheduler, sched_current);
+        if (best >= 0)
+        {
+            return best;
+        }
+        // 还没有测量结果, 先轮流使用
+    }
     if (ctx.path_count > 0)
     {
         int last = path;
@@ -466,18 +2423,222 @@ coroutine static void udp_sender(pbuf_t *pbuf)
         }
     }
 
-    assert(ctx.paths[path].sock != NULL);
+    if ((ctx.paths[path].alive <= 0) && (ctx.workers > 1))
+    {
+        // 其它 worker 可能刚收到过这个 path 的包
+        hint_sync(path);
+    }
+    // 客户端解析出服务器地址之前, tproxy 的服务器收到客户端的包之前,
+    // 还没有 socket
+    if ((ctx.paths[path].alive <= 0) || (ctx.paths[path].sock == NULL))
+    {
+        return -1;
+    }
+    return path;
+}
+
+
+// 把 path 最新的 remote, token 告诉其它 worker
+static void hint_publish(int path, ipaddr remote, int token, int cipher)
+{
+    hint_t *hint = &hints[path];
+    int64_t t = now();
+    if ((hint->token == token) && (hint->cipher == cipher) && (t - hint->seen < 100)
+        && udpio_addr_equal(&(hint->remote), &remote))
+    {
+        // nothing changed, avoid bouncing the cache line between cores
+        return;
+    }
+
+    uint32_t seq;
+    do
+    {
+        seq = hint->seq;
+    } while ((seq & 1) || !__sync_bool_compare_and_swap(&(hint->seq), seq, seq + 1));
+    hint->token = token;
+    hint->seen = t;
+    hint->remote = remote;
+    hint->cipher = cipher;
+    __sync_fetch_and_add(&(hint->seq), 1);
+}
+
+
+// 从其它 worker 同步 path 状态
+static void hint_sync(int path)
+{
+    hint_t hint;
+    uint32_t seq;
+    do
+    {
+        seq = hints[path].seq;
+        __sync_synchronize();
+        hint.token = hints[path].token;
+        hint.seen = hints[path].seen;
+        hint.remote = hints[path].remote;
+        hint.cipher = hints[path].cipher;
+        __sync_synchronize();
+    } while ((seq & 1) || (seq != hints[path].seq));
+
+    if (hint.seen == 0)
+    {
+        return;
+    }
+    int alive = 5 - (int)((now() - hint.seen) / TOTP_STEP);
+    if (alive <= ctx.paths[path].alive)
+    {
+        return;
+    }
+    if (ctx.mode == MODE_SERVER)
+    {
+        // reply from our own socket of the same port
+        udpsock s = token_sock(path, hint.token);
+        if (s == NULL)
+        {
+            return;
+        }
+        ctx.paths[path].sock = s;
+        ctx.paths[path].fd = ctx.paths[path].fds[hint.token];
+        ctx.paths[path].remote = hint.remote;
+        ctx.paths[path].token = hint.token;
+        ctx.paths[path].xdp = 0;
+        ctx.paths[path].cipher = hint.cipher;
+    }
+    ctx.paths[path].alive = alive;
+}
+
+
+// 本 worker 中 token 端口的 socket, tproxy 模式下按需打开
+static udpsock token_sock(int path, int token)
+{
+    udpsock s = ctx.paths[path].socks[token];
+    if ((s == NULL) && (conf->tproxy))
+    {
+        int port = ctx.paths[path].port_start + token;
+        s = reply_sock(path, token, iplocal(ctx.paths[path].server, port, 0));
+    }
+    return s;
+}
+
 
-    if (ctx.paths[path].alive <= 0)
+// session=yes 的服务器: 数据包按源地址记录会话, 心跳包记录其中的每个地址
+static void session_input(int path, int token, ipaddr addr, pbuf_t *pbuf, int n)
+{
+    int64_t t = now();
+    if ((n > 0) && !(pbuf->flag & FLAG_IDENT))
     {
+        uint8_t key[SESSION_KEY_LEN];
+        if (session_key(pbuf->payload, n, 0, key) != 0)
+        {
+            return;
+        }
+        session_t *se = session_learn(key, t);
+        if (se == NULL)
+        {
+            LOG_RATELIMIT(10 * 1000, "session table is full");
+            return;
+        }
+        session_seen(se, key, path, token, addr, pbuf->cipher, t);
+        session_count(se, 0, n);
         return;
     }
 
-    int token = ctx.paths[path].token;
-    int n = encapsulate(token, pbuf, ctx.mtu);
+    for (int i = 0; i + SESSION_KEY_LEN <= n; i += SESSION_KEY_LEN)
+    {
+        session_t *se = session_learn(pbuf->payload + i, t);
+        if (se != NULL)
+        {
+            session_seen(se, pbuf->payload + i, path, token, addr, pbuf->cipher, t);
+        }
+    }
+}
+
+
+// 立即回复一个空包, 探测包的回显带上原来的 ack
+static void reply(int path, int token, udpsock s, ipaddr addr, const pbuf_t *pbuf)
+{
+    pbuf_t *r = pool_get();
+    if (r == NULL)
+    {
+        return;
+    }
+    r->len = 0;
+    r->flag = (pbuf->flag & FLAG_TS) ? FLAG_ECHO : 0;
+    r->ack = pbuf->ack;
+    // 按请求的格式回复
+    int n = encapsulate(token, pbuf->cipher, r, ctx.mtu, &ctx.paths[path].obfs);
     ctx.snmp.out_packets++;
     ctx.snmp.out_bytes += n;
-    udpsend(ctx.paths[path].sock, ctx.paths[path].remote, pbuf, n);
+    ctx.snmp.out_padding += r->padding;
+    udpsend(s, addr, r, n);
+    pool_put(r);
+}
+
+
+// 按目的地址找到会话和可用的 path, 找不到时返回 -1
+static int session_lookup(pbuf_t *pbuf, session_t **se, int *token, ipaddr *remote, int *cipher)
+{
+    uint8_t key[SESSION_KEY_LEN];
+    int path = -1;
+    if (session_key(pbuf->payload, pbuf->len, 1, key) == 0)
+    {
+        *se = session_find(key);
+        if (*se != NULL)
+        {
+            path = session_route(*se, key, now(), token, remote, cipher);
+        }
+    }
+    if (path < 0)
+    {
+        ctx.snmp.out_noroute++;
+    }
+    return path;
+}
+
+
+// 各个 path 单程时延之差 (RTT 之差的一半) 加上抖动, ms; 没有测量时为 0
+static int path_skew(void)
+{
+    int lo = 0;
+    int hi = 0;
+    int jitter = 0;
+    for (int i = 0; (i < ctx.path_count) && (probes != NULL); i++)
+    {
+        const probe_t *p = &probes[i];
+        if ((p->srtt == 0) || (ctx.paths[i].alive <= 0))
+        {
+            continue;
+        }
+        if ((lo == 0) || (p->srtt < lo))
+        {
+            lo = p->srtt;
+        }
+        if (p->srtt > hi)
+        {
+            hi = p->srtt;
+        }
+        if (p->rttvar > jitter)
+        {
+            jitter = p->rttvar;
+        }
+    }
+    return ((hi - lo) / 2 + jitter) / 1000;
+}
+
+
+// 各个 path 丢包率的平均值, 千分之; 探测包在两个方向上都可能丢, 按一半算
+static int path_loss(void)
+{
+    int sum = 0;
+    int count = 0;
+    for (int i = 0; (i < ctx.path_count) && (probes != NULL); i++)
+    {
+        if ((probes[i].srtt != 0) && (ctx.paths[i].alive > 0))
+        {
+            sum += probes[i].loss;
+            count++;
+        }
+    }
+    return (count > 0) ? sum / count / 2 : 0;
 }
 
 
@@ -495,7 +2656,29 @@ coroutine static void snmp_logger()
         ctx.snmp.out_byte_rate = (int)((ctx.snmp.out_bytes - last.out_bytes) * 1000 / interval);
         ctx.snmp.in_packet_rate = (int)((ctx.snmp.in_packets - last.in_packets) * 1000 / interval);
         ctx.snmp.in_byte_rate = (int)((ctx.snmp.in_bytes - last.in_bytes) * 1000 / interval);
+        compress_stat_t cs;
+        compress_stat(&cs);
+        ctx.snmp.compress_tried = cs.tried;
+        ctx.snmp.compress_skipped = cs.skipped;
+        ctx.snmp.compress_evicted = cs.evicted;
+        ctx.snmp.compress_ratio = cs.ratio;
+        ctx.snmp.compress_saved_us = cs.saved_us;
+        hc_stat_t hs;
+        hc_stat(&hs);
+        ctx.snmp.hc_full = hs.full;
+        ctx.snmp.hc_compressed = hs.compressed;
+        ctx.snmp.hc_saved = hs.saved;
+        ctx.snmp.hc_misses = hs.misses;
+        if (conf->reorder)
+        {
+            reorder_tune(path_skew(), ctx.snmp.in_packet_rate);
+        }
+        if (conf->fec)
+        {
+            fec_tune(path_loss());
+        }
         memcpy(&last, &(ctx.snmp), sizeof(snmp_t));
+        drop_summary();
         msleep(ctx.snmp.timestamp + 100);
     }
 }
@@ -23,9 +23,19 @@
 #include <libmill.h>
 
 #include "conf.h"
+#include "xdp.h"
 
 #define POOL 40
 
+// reasons of dropped datagrams
+#define DROP_TOKEN 0    // port of an invalid token
+#define DROP_AUTH  1    // failed to decrypt
+#define DROP_SHORT 2    // shorter than the header
+#define DROP_MAX   3
+
+// dns latency histogram buckets: <1ms, <10ms, <100ms, <1s, >=1s
+#define DNS_HIST 5
+
 typedef struct {
     uint64_t timestamp;
     uint64_t uptime;
@@ -33,16 +43,42 @@ typedef struct {
     uint64_t out_bytes;
     int out_packet_rate;
     int out_byte_rate;
+    // tun packets dropped because the send queue was full
+    uint64_t out_drops;
+    // padding bytes of sent packets
+    uint64_t out_padding;
+    // tun packets to an address without a session
+    uint64_t out_noroute;
     uint64_t in_packets;
     uint64_t in_bytes;
     int in_packet_rate;
     int in_byte_rate;
+    uint64_t in_drops[DROP_MAX];
+    uint64_t compress_tried;
+    uint64_t compress_skipped;
+    uint64_t compress_evicted;
+    int compress_ratio;
+    uint64_t compress_saved_us;
+    uint64_t hc_full;
+    uint64_t hc_compressed;
+    uint64_t hc_saved;
+    uint64_t hc_misses;
+    uint64_t dns_lookups;
+    uint64_t dns_failures;
+    uint64_t dns_latency[DNS_HIST];
 } snmp_t;
 
 typedef struct {
     int mode;
     int mtu;
+    int batch;
+    int offload;
+    int io;
+    int workers;
+    int worker;
     int path_count;
+    // session=yes server: clients are told apart by inner address
+    int sessions;
     int running;
     int tun;
     struct {
@@ -52,7 +88,19 @@ typedef struct {
         int alive;
         int token;
         udpsock sock;
+        int fd;
         ipaddr remote;
+        // sock is connected to remote, send without an address
+        int connected;
+        // socket of each port, used by workers to reply on any token
+        udpsock *socks;
+        int *fds;
+        // last valid packet came through AF_XDP, reply with peer headers
+        int xdp;
+        xdp_peer_t peer;
+        obfs_t obfs;
+        // format of the client on this path (server), CIPHER_AUTO if unknown
+        int cipher;
         int valid_tokens[POOL];
     } paths[PATH_MAX_COUNT];
     snmp_t snmp;
@@ -0,0 +1,780 @@
+/*
+ * xdp.c - AF_XDP fast path for tunnel datagrams
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "xdp.h"
+
+#define ETH_LEN  14
+#define IPV4_LEN 20
+#define IPV6_LEN 40
+#define UDP_LEN  8
+
+
+// 解析一个帧, 返回 payload 偏移, 并生成回复用的首部
+// payload 长度按 IP 和 UDP 首部里的长度计算, 不包括以太网帧末尾的填充
+int xdp_parse(const uint8_t *frame, int len, ipaddr *addr, int *port, xdp_peer_t *peer, int *plen)
+{
+    if (len < ETH_LEN + IPV4_LEN + UDP_LEN)
+    {
+        return -1;
+    }
+    const uint8_t *ip = frame + ETH_LEN;
+    const uint8_t *udp;
+    int end;
+    uint8_t *hdr = peer->hdr;
+    memset(addr, 0, sizeof(ipaddr));
+
+    // 交换 MAC 地址
+    memcpy(hdr, frame + 6, 6);
+    memcpy(hdr + 6, frame, 6);
+    memcpy(hdr + 12, frame + 12, 2);
+
+    if ((ip[0] >> 4) == 4)
+    {
+        int ihl = (ip[0] & 0x0f) * 4;
+        end = ETH_LEN + ((ip[2] << 8) | ip[3]);
+        if ((ihl < IPV4_LEN) || (ETH_LEN + ihl + UDP_LEN > end) || (end > len))
+        {
+            return -1;
+        }
+        udp = ip + ihl;
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, ip + 12, 4);
+        memcpy(&sin->sin_port, udp, 2);
+
+        uint8_t *rip = hdr + ETH_LEN;
+        memset(rip, 0, IPV4_LEN);
+        rip[0] = 0x45;
+        rip[6] = 0x40;
+        rip[8] = 64;
+        rip[9] = IPPROTO_UDP;
+        memcpy(rip + 12, ip + 16, 4);
+        memcpy(rip + 16, ip + 12, 4);
+        peer->len = ETH_LEN + IPV4_LEN + UDP_LEN;
+    }
+    else if ((ip[0] >> 4) == 6)
+    {
+        end = ETH_LEN + IPV6_LEN + ((ip[4] << 8) | ip[5]);
+        if ((ETH_LEN + IPV6_LEN + UDP_LEN > end) || (end > len))
+        {
+            return -1;
+        }
+        udp = ip + IPV6_LEN;
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, ip + 8, 16);
+        memcpy(&sin6->sin6_port, udp, 2);
+
+        uint8_t *rip = hdr + ETH_LEN;
+        memset(rip, 0, IPV6_LEN);
+        rip[0] = 0x60;
+        rip[6] = IPPROTO_UDP;
+        rip[7] = 64;
+        memcpy(rip + 8, ip + 24, 16);
+        memcpy(rip + 24, ip + 8, 16);
+        peer->len = ETH_LEN + IPV6_LEN + UDP_LEN;
+    }
+    else
+    {
+        return -1;
+    }
+
+    int off = (int)(udp + UDP_LEN - frame);
+    int ulen = (udp[4] << 8) | udp[5];
+    if ((ulen < UDP_LEN) || (off - UDP_LEN + ulen > end))
+    {
+        return -1;
+    }
+    *plen = ulen - UDP_LEN;
+
+    uint8_t *rudp = hdr + peer->len - UDP_LEN;
+    memcpy(rudp, udp + 2, 2);
+    memcpy(rudp + 2, udp, 2);
+    *port = (udp[2] << 8) | udp[3];
+    return off;
+}
+
+
+#if defined(TARGET_LINUX) && defined(HAVE_LINUX_IF_XDP_H) && defined(HAVE_LINUX_BPF_H)
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#  define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#  define SOL_XDP 283
+#endif
+#ifndef BPF_JMP32
+#  define BPF_JMP32 0x06
+#endif
+
+// UMEM: 前一半帧用于接收, 后一半用于发送
+#define FRAME_SIZE  2048
+#define RING_SIZE   2048
+#define FRAME_COUNT (RING_SIZE * 2)
+#define QUEUE_MAX   64
+
+
+typedef struct
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *ring;
+    uint32_t mask;
+    void *map;
+    size_t map_len;
+} ring_t;
+
+struct xdp
+{
+    int fd;
+    int queue;
+    uint8_t *umem;
+    ring_t rx;
+    ring_t tx;
+    ring_t fill;
+    ring_t comp;
+    // 空闲的发送帧
+    uint64_t frames[RING_SIZE];
+    int nframes;
+};
+
+static int ifindex = 0;
+static int map_fd = -1;
+static int link_fd = -1;
+
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+
+// 简单的 BPF 汇编
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define LDX(size, d, s, o)  INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define MOV(d, s)           INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOVI(d, i)          INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD(d, s)           INSN(BPF_ALU64 | BPF_ADD | BPF_X, d, s, 0, 0)
+#define ADDI(d, i)          INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define ANDI(d, i)          INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LSHI(d, i)          INSN(BPF_ALU64 | BPF_LSH | BPF_K, d, 0, 0, i)
+#define BE16(d)             INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define JMP(op, d, i, o)    INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMPX(op, d, s, o)   INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define JMP32(op, d, i, o)  INSN(BPF_JMP32 | (op) | BPF_K, d, 0, o, i)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+enum { L_PASS, L_V6, L_PORT, L_REDIRECT, L_MAX };
+
+typedef struct
+{
+    struct bpf_insn insns[512];
+    int len;
+    int labels[L_MAX];
+    int jumps[64][2];
+    int njumps;
+} prog_t;
+
+static void emit(prog_t *p, struct bpf_insn insn)
+{
+    p->insns[p->len++] = insn;
+}
+
+// 跳转到 label, 偏移量最后统一填写
+static void emit_jump(prog_t *p, struct bpf_insn insn, int label)
+{
+    p->jumps[p->njumps][0] = p->len;
+    p->jumps[p->njumps][1] = label;
+    p->njumps++;
+    emit(p, insn);
+}
+
+
+// 监听地址, family 为 0 表示通配地址
+typedef struct
+{
+    int family;
+    uint32_t words[4];
+} dst_t;
+
+static void dst_parse(dst_t *d, const char *addr)
+{
+    uint8_t buf[16];
+    memset(d, 0, sizeof(dst_t));
+    if ((inet_pton(AF_INET, addr, buf) == 1) && (memcmp(buf, "\0\0\0\0", 4) != 0))
+    {
+        d->family = 4;
+        memcpy(d->words, buf, 4);
+    }
+    else if ((inet_pton(AF_INET6, addr, buf) == 1) && !IN6_IS_ADDR_UNSPECIFIED((struct in6_addr *)buf))
+    {
+        d->family = 6;
+        memcpy(d->words, buf, 16);
+    }
+    else if ((inet_pton(AF_INET, addr, buf) != 1) && (inet_pton(AF_INET6, addr, buf) != 1))
+    {
+        LOG("xdp: %s is not an address, matching port only", addr);
+    }
+}
+
+
+/*
+ * 目的地址和端口在 ranges 内的 UDP 包重定向到当前队列的 AF_XDP socket,
+ * 队列上没有 socket 时按 XDP_PASS 交给内核协议栈
+ */
+static int prog_build(prog_t *p, const char *const *addrs, const int ranges[][2], int count)
+{
+    memset(p, 0, sizeof(prog_t));
+    if (count > 16)
+    {
+        return -1;
+    }
+
+    emit(p, LDX(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)));
+    emit(p, LDX(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)));
+    emit(p, MOV(BPF_REG_4, BPF_REG_2));
+    emit(p, ADDI(BPF_REG_4, ETH_LEN));
+    emit_jump(p, JMPX(BPF_JGT, BPF_REG_4, BPF_REG_3, 0), L_PASS);
+    emit(p, LDX(BPF_H, BPF_REG_5, BPF_REG_2, 12));
+    emit_jump(p, JMP(BPF_JEQ, BPF_REG_5, htons(0x86dd), 0), L_V6);
+    emit_jump(p, JMP(BPF_JNE, BPF_REG_5, htons(0x0800), 0), L_PASS);
+
+    // IPv4, 不处理分片
+    emit(p, MOV(BPF_REG_4, BPF_REG_2));
+    emit(p, ADDI(BPF_REG_4, ETH_LEN + IPV4_LEN));
+    emit_jump(p, JMPX(BPF_JGT, BPF_REG_4, BPF_REG_3, 0), L_PASS);
+    emit(p, LDX(BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN + 9));
+    emit_jump(p, JMP(BPF_JNE, BPF_REG_5, IPPROTO_UDP, 0), L_PASS);
+    emit(p, LDX(BPF_H, BPF_REG_5, BPF_REG_2, ETH_LEN + 6));
+    emit(p, ANDI(BPF_REG_5, htons(0x3fff)));
+    emit_jump(p, JMP(BPF_JNE, BPF_REG_5, 0, 0), L_PASS);
+    emit(p, LDX(BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN));
+    emit(p, ANDI(BPF_REG_5, 0x0f));
+    emit(p, LSHI(BPF_REG_5, 2));
+    emit(p, MOV(BPF_REG_4, BPF_REG_2));
+    emit(p, ADDI(BPF_REG_4, ETH_LEN));
+    emit(p, ADD(BPF_REG_4, BPF_REG_5));
+    emit(p, MOV(BPF_REG_5, BPF_REG_4));
+    emit(p, ADDI(BPF_REG_5, UDP_LEN));
+    emit_jump(p, JMPX(BPF_JGT, BPF_REG_5, BPF_REG_3, 0), L_PASS);
+    emit(p, LDX(BPF_H, BPF_REG_6, BPF_REG_4, 2));
+    emit(p, MOVI(BPF_REG_7, 4));
+    emit_jump(p, JMP(BPF_JA, 0, 0, 0), L_PORT);
+
+    // IPv6, 不处理扩展首部
+    p->labels[L_V6] = p->len;
+    emit(p, MOV(BPF_REG_4, BPF_REG_2));
+    emit(p, ADDI(BPF_REG_4, ETH_LEN + IPV6_LEN + UDP_LEN));
+    emit_jump(p, JMPX(BPF_JGT, BPF_REG_4, BPF_REG_3, 0), L_PASS);
+    emit(p, LDX(BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN + 6));
+    emit_jump(p, JMP(BPF_JNE, BPF_REG_5, IPPROTO_UDP, 0), L_PASS);
+    emit(p, LDX(BPF_H, BPF_REG_6, BPF_REG_2, ETH_LEN + IPV6_LEN + 2));
+    emit(p, MOVI(BPF_REG_7, 6));
+
+    // 端口范围和目的地址, r6 为目的端口, r7 为 IP 版本
+    p->labels[L_PORT] = p->len;
+    emit(p, BE16(BPF_REG_6));
+    for (int i = 0; i < count; i++)
+    {
+        dst_t d;
+        dst_parse(&d, addrs[i]);
+        // 不匹配时跳到下一个范围
+        int next[8];
+        int nnext = 0;
+        next[nnext++] = p->len;
+        emit(p, JMP(BPF_JLT, BPF_REG_6, ranges[i][0], 0));
+        next[nnext++] = p->len;
+        emit(p, JMP(BPF_JGT, BPF_REG_6, ranges[i][1], 0));
+        if (d.family != 0)
+        {
+            int off = (d.family == 4) ? ETH_LEN + 16 : ETH_LEN + 24;
+            next[nnext++] = p->len;
+            emit(p, JMP(BPF_JNE, BPF_REG_7, d.family, 0));
+            for (int k = 0; k < ((d.family == 4) ? 1 : 4); k++)
+            {
+                emit(p, LDX(BPF_W, BPF_REG_5, BPF_REG_2, off + 4 * k));
+                next[nnext++] = p->len;
+                emit(p, JMP32(BPF_JNE, BPF_REG_5, (int32_t)d.words[k], 0));
+            }
+        }
+        emit_jump(p, JMP(BPF_JA, 0, 0, 0), L_REDIRECT);
+        for (int k = 0; k < nnext; k++)
+        {
+            p->insns[next[k]].off = (int16_t)(p->len - next[k] - 1);
+        }
+    }
+    emit_jump(p, JMP(BPF_JA, 0, 0, 0), L_PASS);
+
+    p->labels[L_REDIRECT] = p->len;
+    emit(p, LDX(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index)));
+    emit(p, INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd));
+    emit(p, INSN(0, 0, 0, 0, 0));
+    emit(p, MOVI(BPF_REG_3, XDP_PASS));
+    emit(p, CALL(BPF_FUNC_redirect_map));
+    emit(p, EXIT());
+
+    p->labels[L_PASS] = p->len;
+    emit(p, MOVI(BPF_REG_0, XDP_PASS));
+    emit(p, EXIT());
+
+    for (int i = 0; i < p->njumps; i++)
+    {
+        int at = p->jumps[i][0];
+        p->insns[at].off = (int16_t)(p->labels[p->jumps[i][1]] - at - 1);
+    }
+    return 0;
+}
+
+
+int xdp_attach(const char *ifname, const char *const *addrs, const int ranges[][2], int count)
+{
+    ifindex = (int)if_nametoindex(ifname);
+    if (ifindex == 0)
+    {
+        LOG("xdp: no such interface: %s", ifname);
+        return -1;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = QUEUE_MAX;
+    map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0)
+    {
+        ERROR("bpf_map_create");
+        return -1;
+    }
+
+    prog_t prog;
+    if (prog_build(&prog, addrs, ranges, count) != 0)
+    {
+        LOG("xdp: too many port ranges");
+        xdp_detach();
+        return -1;
+    }
+    static char vlog[4096];
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)prog.insns;
+    attr.insn_cnt = prog.len;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)vlog;
+    attr.log_size = sizeof(vlog);
+    attr.log_level = 1;
+    int prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0)
+    {
+        ERROR("bpf_prog_load");
+        LOG("%s", vlog);
+        xdp_detach();
+        return -1;
+    }
+
+    // 先尝试驱动模式, 不支持时用 generic (skb) 模式
+    const uint32_t modes[] = { 0, XDP_FLAGS_SKB_MODE };
+    for (int i = 0; (i < 2) && (link_fd < 0); i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = modes[i];
+        link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    }
+    close(prog_fd);
+    if (link_fd < 0)
+    {
+        ERROR("bpf_link_create");
+        xdp_detach();
+        return -1;
+    }
+    return 0;
+}
+
+
+void xdp_detach(void)
+{
+    // 关闭 link 即卸载程序
+    if (link_fd >= 0)
+    {
+        close(link_fd);
+        link_fd = -1;
+    }
+    if (map_fd >= 0)
+    {
+        close(map_fd);
+        map_fd = -1;
+    }
+}
+
+
+static int ring_map(int fd, ring_t *r, const struct xdp_ring_offset *off,
+                    size_t entry, uint64_t pgoff)
+{
+    r->map_len = off->desc + RING_SIZE * entry;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, (off_t)pgoff);
+    if (r->map == MAP_FAILED)
+    {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+    r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+    r->ring = (uint8_t *)r->map + off->desc;
+    r->mask = RING_SIZE - 1;
+    return 0;
+}
+
+
+xdp_t *xdp_open(int queue)
+{
+    if ((map_fd < 0) || (queue >= QUEUE_MAX))
+    {
+        return NULL;
+    }
+    xdp_t *xdp = calloc(1, sizeof(xdp_t));
+    if (xdp == NULL)
+    {
+        return NULL;
+    }
+    xdp->queue = queue;
+    xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd < 0)
+    {
+        free(xdp);
+        return NULL;
+    }
+
+    // socket 在 fork 之前创建, 私有映射在 fork 后会被复制, 子进程看到的帧不是内核写入的那份
+    xdp->umem = mmap(NULL, (size_t)FRAME_COUNT * FRAME_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (xdp->umem == MAP_FAILED)
+    {
+        xdp->umem = NULL;
+        xdp_close(xdp);
+        return NULL;
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)xdp->umem;
+    reg.len = (uint64_t)FRAME_COUNT * FRAME_SIZE;
+    reg.chunk_size = FRAME_SIZE;
+    int size = RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if ((setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0)
+        || (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) != 0)
+        || (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) != 0)
+        || (setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) != 0)
+        || (setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) != 0)
+        || (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0)
+        || (ring_map(xdp->fd, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0)
+        || (ring_map(xdp->fd, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0)
+        || (ring_map(xdp->fd, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0)
+        || (ring_map(xdp->fd, &xdp->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0))
+    {
+        xdp_close(xdp);
+        return NULL;
+    }
+
+    // 接收帧全部放入 fill ring, 发送帧放入空闲列表
+    uint64_t *fill = xdp->fill.ring;
+    for (int i = 0; i < RING_SIZE; i++)
+    {
+        fill[i] = (uint64_t)i * FRAME_SIZE;
+        xdp->frames[i] = (uint64_t)(RING_SIZE + i) * FRAME_SIZE;
+    }
+    xdp->nframes = RING_SIZE;
+    __atomic_store_n(xdp->fill.producer, RING_SIZE, __ATOMIC_RELEASE);
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_COPY;
+    if (bind(xdp->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) != 0)
+    {
+        xdp_close(xdp);
+        return NULL;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)&xdp->queue;
+    attr.value = (uint64_t)(uintptr_t)&xdp->fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0)
+    {
+        xdp_close(xdp);
+        return NULL;
+    }
+    return xdp;
+}
+
+
+void xdp_close(xdp_t *xdp)
+{
+    if (xdp == NULL)
+    {
+        return;
+    }
+    ring_t *rings[] = { &xdp->rx, &xdp->tx, &xdp->fill, &xdp->comp };
+    for (int i = 0; i < 4; i++)
+    {
+        if (rings[i]->map != NULL)
+        {
+            munmap(rings[i]->map, rings[i]->map_len);
+        }
+    }
+    if (xdp->fd >= 0)
+    {
+        close(xdp->fd);
+    }
+    if (xdp->umem != NULL)
+    {
+        munmap(xdp->umem, (size_t)FRAME_COUNT * FRAME_SIZE);
+    }
+    free(xdp);
+}
+
+
+int xdp_fd(const xdp_t *xdp)
+{
+    return xdp->fd;
+}
+
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, int len)
+{
+    while (len > 1)
+    {
+        sum += (uint32_t)((p[0] << 8) | p[1]);
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        sum += (uint32_t)p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+
+int xdp_recv(xdp_t *xdp, pbuf_t **pbufs, ipaddr *addrs, int *ports,
+             xdp_peer_t *peers, int *lens, int count)
+{
+    uint32_t cons = *xdp->rx.consumer;
+    uint32_t prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t fprod = *xdp->fill.producer;
+    struct xdp_desc *descs = xdp->rx.ring;
+    uint64_t *fill = xdp->fill.ring;
+
+    int n = 0;
+    while ((cons != prod) && (n < count))
+    {
+        struct xdp_desc *desc = &descs[cons & xdp->rx.mask];
+        const uint8_t *frame = xdp->umem + desc->addr;
+        int len;
+        int off = xdp_parse(frame, (int)desc->len, &addrs[n], &ports[n], &peers[n], &len);
+        if ((off > 0) && (len <= PAYLOAD_OFFSET + PAYLOAD_MAX))
+        {
+            memcpy(pbufs[n], frame + off, len);
+            lens[n] = len;
+            n++;
+        }
+        // 帧立即还给 fill ring
+        fill[fprod & xdp->fill.mask] = desc->addr & ~(uint64_t)(FRAME_SIZE - 1);
+        fprod++;
+        cons++;
+    }
+    __atomic_store_n(xdp->fill.producer, fprod, __ATOMIC_RELEASE);
+    __atomic_store_n(xdp->rx.consumer, cons, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+int xdp_send(xdp_t *xdp, const xdp_peer_t *peer, pbuf_t **pbufs, const int *lens, int count)
+{
+    // 回收已发送的帧
+    uint32_t ccons = *xdp->comp.consumer;
+    uint32_t cprod = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    uint64_t *comp = xdp->comp.ring;
+    while (ccons != cprod)
+    {
+        xdp->frames[xdp->nframes++] = comp[ccons & xdp->comp.mask];
+        ccons++;
+    }
+    __atomic_store_n(xdp->comp.consumer, ccons, __ATOMIC_RELEASE);
+
+    uint32_t prod = *xdp->tx.producer;
+    struct xdp_desc *descs = xdp->tx.ring;
+    int sent = 0;
+    for (; (sent < count) && (xdp->nframes > 0); sent++)
+    {
+        int len = peer->len + lens[sent];
+        if (len > FRAME_SIZE)
+        {
+            break;
+        }
+        uint64_t addr = xdp->frames[--xdp->nframes];
+        uint8_t *frame = xdp->umem + addr;
+        memcpy(frame, peer->hdr, peer->len);
+        memcpy(frame + peer->len, pbufs[sent], lens[sent]);
+
+        uint8_t *ip = frame + ETH_LEN;
+        uint8_t *udp = frame + peer->len - UDP_LEN;
+        int ulen = UDP_LEN + lens[sent];
+        udp[4] = (uint8_t)(ulen >> 8);
+        udp[5] = (uint8_t)ulen;
+        udp[6] = 0;
+        udp[7] = 0;
+        if ((ip[0] >> 4) == 4)
+        {
+            // IPv4 的 UDP 校验和可以为 0
+            int tot = IPV4_LEN + ulen;
+            ip[2] = (uint8_t)(tot >> 8);
+            ip[3] = (uint8_t)tot;
+            ip[10] = 0;
+            ip[11] = 0;
+            uint16_t sum = csum_fold(csum_add(0, ip, IPV4_LEN));
+            ip[10] = (uint8_t)(sum >> 8);
+            ip[11] = (uint8_t)sum;
+        }
+        else
+        {
+            ip[4] = (uint8_t)(ulen >> 8);
+            ip[5] = (uint8_t)ulen;
+            uint32_t pseudo = csum_add(0, ip + 8, 32) + IPPROTO_UDP + (uint32_t)ulen;
+            uint16_t sum = csum_fold(csum_add(pseudo, udp, ulen));
+            if (sum == 0)
+            {
+                sum = 0xffff;
+            }
+            udp[6] = (uint8_t)(sum >> 8);
+            udp[7] = (uint8_t)sum;
+        }
+
+        struct xdp_desc *desc = &descs[prod & xdp->tx.mask];
+        desc->addr = addr;
+        desc->len = (uint32_t)len;
+        desc->options = 0;
+        prod++;
+    }
+    if (sent > 0)
+    {
+        __atomic_store_n(xdp->tx.producer, prod, __ATOMIC_RELEASE);
+        // copy 模式需要系统调用触发发送, 每批一次
+        sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+    return sent;
+}
+
+
+#else
+
+
+int xdp_attach(const char *ifname, const char *const *addrs, const int ranges[][2], int count)
+{
+    (void)ifname;
+    (void)addrs;
+    (void)ranges;
+    (void)count;
+    LOG("xdp: not supported on this platform");
+    return -1;
+}
+
+void xdp_detach(void)
+{
+}
+
+xdp_t *xdp_open(int queue)
+{
+    (void)queue;
+    return NULL;
+}
+
+void xdp_close(xdp_t *xdp)
+{
+    (void)xdp;
+}
+
+int xdp_fd(const xdp_t *xdp)
+{
+    (void)xdp;
+    return -1;
+}
+
+int xdp_recv(xdp_t *xdp, pbuf_t **pbufs, ipaddr *addrs, int *ports,
+             xdp_peer_t *peers, int *lens, int count)
+{
+    (void)xdp;
+    (void)pbufs;
+    (void)addrs;
+    (void)ports;
+    (void)peers;
+    (void)lens;
+    (void)count;
+    return 0;
+}
+
+int xdp_send(xdp_t *xdp, const xdp_peer_t *peer, pbuf_t **pbufs, const int *lens, int count)
+{
+    (void)xdp;
+    (void)peer;
+    (void)pbufs;
+    (void)lens;
+    (void)count;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * xdp.h - AF_XDP fast path for tunnel datagrams
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XDP_H
+#define XDP_H
+
+#include <stdint.h>
+
+#include <libmill.h>
+
+#include "encapsulate.h"
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+// ethernet + IPv6 + UDP
+#define XDP_HDR_MAX 62
+
+// reply headers of a peer, built from its last datagram
+typedef struct
+{
+    uint8_t hdr[XDP_HDR_MAX];
+    int len;
+} xdp_peer_t;
+
+typedef struct xdp xdp_t;
+
+// load the redirect program on ifname for UDP datagrams to addrs[i] and a
+// port in ranges[i], a wildcard address matches any destination address
+extern int xdp_attach(const char *ifname, const char *const *addrs,
+                      const int ranges[][2], int count);
+extern void xdp_detach(void);
+
+// open an AF_XDP socket (copy mode) on one rx queue of the attached interface
+extern xdp_t *xdp_open(int queue);
+extern void xdp_close(xdp_t *xdp);
+extern int xdp_fd(const xdp_t *xdp);
+
+// receive up to count datagrams without blocking, return number received
+extern int xdp_recv(xdp_t *xdp, pbuf_t **pbufs, ipaddr *addrs, int *ports,
+                    xdp_peer_t *peers, int *lens, int count);
+
+// parse an ethernet frame, return the payload offset and its length in plen
+// (bounded by the IP and UDP lengths), -1 if it is not a UDP datagram
+extern int xdp_parse(const uint8_t *frame, int len, ipaddr *addr, int *port,
+                     xdp_peer_t *peer, int *plen);
+
+// send count datagrams to peer, return number sent
+extern int xdp_send(xdp_t *xdp, const xdp_peer_t *peer, pbuf_t **pbufs,
+                    const int *lens, int count);
+
+#endif // XDP_H
@@ -18,21 +18,909 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <lz4.h>
 #include <sodium.h>
 
+#include "../src/compress.h"
+#include "../src/conf.h"
 #include "../src/crypto.h"
 #include "../src/encapsulate.h"
+#include "../src/fec.h"
+#include "../src/hc.h"
+#include "../src/probe.h"
+#include "../src/reorder.h"
+#include "../src/session.h"
+#include "../src/udpio.h"
+#include "../src/uring.h"
 
 
 const int count = 50000;
 
 
+static int64_t mstime(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+// udp packets per second over loopback, by batch size
+static void perf_batch(int offload)
+{
+    const int packets = 200000;
+    const int len = 1400 + PAYLOAD_OFFSET;
+
+    offload = udpio_init(offload);
+
+    ipaddr addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int tx = udpio_bind(addr, 0);
+    int rx = udpio_bind(addr, 0);
+    socklen_t slen = sizeof(struct sockaddr_in);
+    if ((tx < 0) || (rx < 0) || (getsockname(rx, (struct sockaddr *)sin, &slen) != 0))
+    {
+        printf("udp socket not available, skip batch test\n");
+        return;
+    }
+
+    static pbuf_t pbufs[BATCH_MAX];
+    pbuf_t *ptrs[BATCH_MAX];
+    int lens[BATCH_MAX];
+    for (int i = 0; i < BATCH_MAX; i++)
+    {
+        memset(&pbufs[i], 0, sizeof(pbuf_t));
+        ptrs[i] = &pbufs[i];
+        lens[i] = len;
+    }
+
+    printf("\nudp send+recv over loopback, %d packets of %dB%s%s\n", packets, len,
+           (offload & UDPIO_GSO) ? ", gso" : "", (offload & UDPIO_GRO) ? ", gro" : "");
+    printf(" batch |    pps\n"
+           "-------+---------\n");
+    double base = 0.0;
+    for (int batch = 1; batch <= BATCH_MAX; batch *= 2)
+    {
+        int total = 0;
+        int64_t start = mstime();
+        while (total < packets)
+        {
+            int sent = udpio_send(tx, &addr, ptrs, lens, batch);
+            int got = 0;
+            while (got < sent)
+            {
+                int n = udpio_recv(rx, ptrs, NULL, lens, sent - got);
+                if (n <= 0)
+                {
+                    break;
+                }
+                got += n;
+            }
+            for (int i = 0; i < batch; i++)
+            {
+                lens[i] = len;
+            }
+            // 只算真正发出去的包
+            total += sent;
+        }
+        int64_t end = mstime();
+        double pps = (double)total * 1000.0 / (double)((end > start) ? (end - start) : 1);
+        if (base == 0.0)
+        {
+            base = pps;
+        }
+        printf("%6d |%8.0f ", batch, pps);
+        for (int i = 0; i < (int)(pps * 10.0 / base) && i < 60; i++)
+        {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+    close(tx);
+    close(rx);
+}
+
+
+// udp receive loop: poll + recvmmsg vs io_uring multishot recvmsg
+static void perf_io(void)
+{
+    const int packets = 200000;
+    const int burst = 32;
+    const int len = 1400 + PAYLOAD_OFFSET;
+
+    udpio_init(0);
+    ipaddr addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int tx = udpio_bind(addr, 0);
+    int rx = udpio_bind(addr, 0);
+    socklen_t slen = sizeof(struct sockaddr_in);
+    if ((tx < 0) || (rx < 0) || (getsockname(rx, (struct sockaddr *)sin, &slen) != 0))
+    {
+        printf("udp socket not available, skip io test\n");
+        return;
+    }
+
+    static pbuf_t pbufs[BATCH_MAX];
+    pbuf_t *ptrs[BATCH_MAX];
+    int lens[BATCH_MAX];
+    for (int i = 0; i < burst; i++)
+    {
+        memset(&pbufs[i], 0, sizeof(pbuf_t));
+        ptrs[i] = &pbufs[i];
+        lens[i] = len;
+    }
+
+    printf("\nudp receive loop over loopback, %d packets of %dB, burst %d\n",
+           packets, len, burst);
+    printf(" backend |    pps\n"
+           "---------+---------\n");
+
+    // poll + recvmmsg
+    int64_t start = mstime();
+    for (int total = 0; total < packets; total += burst)
+    {
+        int sent = udpio_send(tx, &addr, ptrs, lens, burst);
+        int got = 0;
+        while (got < sent)
+        {
+            struct pollfd pfd = { .fd = rx, .events = POLLIN };
+            poll(&pfd, 1, 1000);
+            int rlens[BATCH_MAX];
+            int n = udpio_recv(rx, ptrs, NULL, rlens, sent - got);
+            if (n < 0)
+            {
+                break;
+            }
+            got += n;
+        }
+    }
+    int64_t end = mstime();
+    printf("    poll |%8.0f\n", (double)packets * 1000.0 / (double)((end > start) ? (end - start) : 1));
+
+    // io_uring multishot recvmsg
+    const unsigned nbufs = 256;
+    const unsigned size = (URING_MSG_OVERHEAD + sizeof(pbuf_t) + 63) & ~63U;
+    uint8_t *bufs = mmap(NULL, nbufs * size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = sizeof(ipaddr);
+    if ((bufs == MAP_FAILED) || (uring_init(256) < 0) || (uring_provide(bufs, size, nbufs) != 0)
+        || (uring_recvmsg(rx, &msg, 1) != 0))
+    {
+        printf("   uring |     n/a\n");
+    }
+    else
+    {
+        uring_event_t events[256];
+        start = mstime();
+        for (int total = 0; total < packets; total += burst)
+        {
+            int sent = udpio_send(tx, &addr, ptrs, lens, burst);
+            int got = 0;
+            while (got < sent)
+            {
+                if (uring_submit(1) < 0)
+                {
+                    break;
+                }
+                int n = uring_reap(events, 256);
+                for (int i = 0; i < n; i++)
+                {
+                    if (events[i].bid >= 0)
+                    {
+                        uring_recycle(events[i].bid);
+                        got++;
+                    }
+                    if (!events[i].more)
+                    {
+                        uring_recvmsg(rx, &msg, 1);
+                    }
+                }
+            }
+        }
+        end = mstime();
+        printf("   uring |%8.0f\n", (double)packets * 1000.0 / (double)((end > start) ? (end - start) : 1));
+        uring_close();
+    }
+    if (bufs != MAP_FAILED)
+    {
+        munmap(bufs, nbufs * size);
+    }
+    close(tx);
+    close(rx);
+}
+
+
+// 各格式加解密一个不可压缩的包
+static void perf_cipher(void)
+{
+    const int packets = 200000;
+    static const int ciphers[] = { CIPHER_LEGACY, CIPHER_CHACHA20POLY1305, CIPHER_AES256GCM };
+    static const int sizes[] = { 64, 512, 1400 };
+
+    printf("\nencapsulate+decapsulate by cipher, %d packets\n", packets);
+    printf("           cipher |  64B(ns) | 512B(ns) | 1400B(ns)\n"
+           "------------------+----------+----------+----------\n");
+
+    static pbuf_t tmpl;
+    static pbuf_t pbuf;
+    randombytes_buf(tmpl.payload, sizeof(tmpl.payload));
+    for (int i = 0; i < 3; i++)
+    {
+        if (crypto_setup(ciphers[i], 1) < 0)
+        {
+            continue;
+        }
+        printf("%17s", crypto_name(ciphers[i]));
+        for (int j = 0; j < 3; j++)
+        {
+            int64_t start = mstime();
+            for (int k = 0; k < packets; k++)
+            {
+                memcpy(pbuf.payload, tmpl.payload, sizes[j]);
+                pbuf.len = sizes[j];
+                pbuf.flag = 0;
+                int n = encapsulate(0, CIPHER_AUTO, &pbuf, 1452, NULL);
+                decapsulate(0, &pbuf, n);
+            }
+            int64_t end = mstime();
+            printf(" | %8.0f", (double)(end - start) * 1e6 / packets);
+        }
+        printf("\n");
+    }
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+}
+
+
+// 丢弃随机数据 (伪造包, 扫描) 的开销, 先收到一个有效包确定格式
+static void perf_reject(void)
+{
+    const int packets = 200000;
+    static const int ciphers[] = { CIPHER_LEGACY, CIPHER_CHACHA20POLY1305, CIPHER_AES256GCM };
+    static const int sizes[] = { 64, 512, 1400 };
+
+    printf("\nrejecting random datagrams by cipher, %d packets\n", packets);
+    printf("           cipher |  64B(ns) | 512B(ns) | 1400B(ns) | ns/byte\n"
+           "------------------+----------+----------+-----------+--------\n");
+
+    static pbuf_t garbage;
+    static pbuf_t pbuf;
+    randombytes_buf(&garbage, sizeof(garbage));
+    for (int i = 0; i < 3; i++)
+    {
+        if (crypto_setup(ciphers[i], 1) < 0)
+        {
+            continue;
+        }
+        pbuf.len = 0;
+        pbuf.flag = 0;
+        int n = encapsulate(0, CIPHER_AUTO, &pbuf, 1452, NULL);
+        assert(decapsulate(0, &pbuf, n) == 0);
+
+        printf("%17s", crypto_name(ciphers[i]));
+        double ns[3];
+        for (int j = 0; j < 3; j++)
+        {
+            int64_t start = mstime();
+            for (int k = 0; k < packets; k++)
+            {
+                memcpy(&pbuf, &garbage, sizes[j]);
+                assert(decapsulate(0, &pbuf, sizes[j]) < 0);
+            }
+            int64_t end = mstime();
+            ns[j] = (double)(end - start) * 1e6 / packets;
+        }
+        printf(" | %8.0f | %8.0f | %9.0f | %6.2f\n", ns[0], ns[1], ns[2],
+               (ns[2] - ns[0]) / (1400 - 64));
+    }
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+}
+
+
+// 不可压缩的流 (TLS/QUIC): 每个包都跑 LZ4 vs 自适应跳过
+static void perf_adaptive(void)
+{
+    const int packets = 500000;
+    static uint8_t pkt[1400];
+    static uint8_t out[2048];
+
+    printf("\nincompressible 1400B flow, %d packets\n", packets);
+    printf(" always(ns) | adaptive(ns)\n"
+           "------------+-------------\n");
+
+    // IPv4 UDP header, 随机 payload
+    randombytes_buf(pkt, sizeof(pkt));
+    pkt[0] = 0x45;
+    pkt[9] = 17;
+
+    int64_t start = mstime();
+    for (int k = 0; k < packets; k++)
+    {
+        pkt[100] = (uint8_t)k;
+        LZ4_compress_default((const char *)pkt, (char *)out, sizeof(pkt), sizeof(out));
+    }
+    int64_t mid = mstime();
+    for (int k = 0; k < packets; k++)
+    {
+        pkt[100] = (uint8_t)k;
+        compress(pkt, sizeof(pkt), out, pkt, sizeof(pkt));
+    }
+    int64_t end = mstime();
+    printf(" %10.0f | %12.0f\n", (double)(mid - start) * 1e6 / packets,
+           (double)(end - mid) * 1e6 / packets);
+
+    compress_stat_t stat;
+    compress_stat(&stat);
+    printf("tried: %" PRIu64 ", skipped: %" PRIu64 ", ratio: %d%%, saved: %" PRIu64 "us\n",
+           stat.tried, stat.skipped, stat.ratio, stat.saved_us);
+}
+
+
+// 压缩/解压: 写到临时缓冲区再拷贝回 pbuf (原实现) vs 直接写到目标缓冲区
+static void perf_compress(void)
+{
+    const int packets = 500000;
+    static const char *words[] = { "GET ", "HTTP/1.1 ", "Host: ", "example.com\r\n",
+                                   "Accept: ", "text/html ", "Cookie: ", "id=" };
+
+    printf("\ncompress+decompress of compressible packets, %d packets\n", packets);
+    printf(" size |  copy(ns) | direct(ns) | saved\n"
+           "------+-----------+------------+-------\n");
+
+    static pbuf_t tmpl;
+    static pbuf_t pbuf;
+    static uint8_t scratch[2048];
+    static const int sizes[] = { 128, 256, 512, 1024, 1400 };
+    for (int i = 0; i < 5; i++)
+    {
+        int len = sizes[i];
+        int off = 0;
+        while (off < len)
+        {
+            const char *w = words[randombytes_uniform(8)];
+            int n = (int)strlen(w);
+            n = (n < len - off) ? n : len - off;
+            memcpy(tmpl.payload + off, w, n);
+            off += n;
+        }
+        memcpy(pbuf.payload, tmpl.payload, len);
+
+        int64_t start = mstime();
+        for (int k = 0; k < packets; k++)
+        {
+            uint8_t out[2048];
+            int n = LZ4_compress_default((const char *)pbuf.payload, (char *)out, len, sizeof(out));
+            memcpy(pbuf.payload, out, n);
+            n = LZ4_decompress_safe((const char *)pbuf.payload, (char *)out, n, sizeof(out));
+            memcpy(pbuf.payload, out, n);
+        }
+        int64_t mid = mstime();
+        for (int k = 0; k < packets; k++)
+        {
+            int n = compress(pbuf.payload, len, scratch, pbuf.payload, len);
+            decompress(scratch, n, pbuf.payload, sizeof(pbuf.payload), 0);
+        }
+        int64_t end = mstime();
+        assert(memcmp(pbuf.payload, tmpl.payload, len) == 0);
+
+        double copy = (double)(mid - start) * 1e6 / packets;
+        double direct = (double)(end - mid) * 1e6 / packets;
+        printf("%5d | %9.0f | %10.0f | %4.1f%%\n", len, copy, direct,
+               (copy > 0.0) ? (copy - direct) * 100.0 / copy : 0.0);
+    }
+}
+
+
+// 头部压缩: 模拟的包混合, 每 100 个包中 40 个 TCP ACK (带时间戳),
+// 20 个 TCP 数据包, 30 个 RTP 语音包, 10 个 IPv6 DNS 查询
+static void perf_hc(void)
+{
+    const int packets = 500000;
+    static uint8_t pkt[1500];
+    static uint8_t out[1500 + HC_OVERHEAD];
+
+    printf("\nheader compression of a packet mix, %d packets\n", packets);
+    printf(" type       |  size | sent |  ns\n"
+           "------------+-------+------+-----\n");
+
+    static const struct
+    {
+        const char *name;
+        int v6;
+        int tcp;
+        int len;
+        int share;
+    } mix[] = {
+        { "tcp ack", 0, 1, 52, 40 },
+        { "tcp data", 0, 1, 1400, 20 },
+        { "rtp", 0, 0, 200, 30 },
+        { "dns6", 1, 0, 90, 10 },
+    };
+    hc_enable(1);
+    uint64_t total_in = 0, total_out = 0;
+    for (int m = 0; m < 4; m++)
+    {
+        int len = mix[m].len;
+        int ip_len = mix[m].v6 ? 40 : 20;
+        randombytes_buf(pkt, len);
+        if (mix[m].v6)
+        {
+            pkt[0] = 0x60;
+            pkt[4] = (uint8_t)((len - 40) >> 8);
+            pkt[5] = (uint8_t)(len - 40);
+            pkt[6] = mix[m].tcp ? 6 : 17;
+        }
+        else
+        {
+            pkt[0] = 0x45;
+            pkt[2] = (uint8_t)(len >> 8);
+            pkt[3] = (uint8_t)len;
+            pkt[6] = 0x40;
+            pkt[7] = 0;
+            pkt[9] = mix[m].tcp ? 6 : 17;
+        }
+        if (mix[m].tcp)
+        {
+            // 时间戳选项
+            pkt[ip_len + 12] = 0x80;
+        }
+        else
+        {
+            pkt[ip_len + 4] = (uint8_t)((len - ip_len) >> 8);
+            pkt[ip_len + 5] = (uint8_t)(len - ip_len);
+        }
+
+        int n = packets * mix[m].share / 100;
+        uint64_t in = 0, sent = 0;
+        int64_t start = mstime();
+        for (int k = 0; k < n; k++)
+        {
+            // 8 个流, 可变字段每个包都变
+            pkt[ip_len] = (uint8_t)(k & 7);
+            pkt[ip_len + 7] = (uint8_t)k;
+            if (!mix[m].v6)
+            {
+                pkt[5] = (uint8_t)k;
+            }
+            int len2 = hc_compress(pkt, len, out, 1500);
+            in += (uint64_t)len;
+            sent += (uint64_t)len2;
+            hc_decompress(out, len2, sizeof(out));
+        }
+        int64_t end = mstime();
+        printf(" %-10s | %5d | %4" PRIu64 " | %3.0f\n", mix[m].name, len, sent / (uint64_t)n,
+               (double)(end - start) * 1e6 / n);
+        total_in += in + (uint64_t)n * PAYLOAD_OFFSET;
+        total_out += sent + (uint64_t)n * PAYLOAD_OFFSET;
+    }
+    hc_enable(0);
+
+    hc_stat_t stat;
+    hc_stat(&stat);
+    printf("full: %" PRIu64 ", compressed: %" PRIu64 ", misses: %" PRIu64 "\n",
+           stat.full, stat.compressed, stat.misses);
+    printf("bytes with muon header: %" PRIu64 " -> %" PRIu64 " (%.1f%% saved)\n",
+           total_in, total_out, (double)(total_in - total_out) * 100.0 / (double)total_in);
+}
+
+
+// 混淆: 每种 profile 的带宽开销和 CPU 时间, 不可压缩的包混合,
+// 每 10 个包中 4 个 52B, 3 个 200B, 1 个 576B, 2 个 1400B
+static void perf_obfs(void)
+{
+    const int packets = 200000;
+    const int mtu = 1452;
+    static const int sizes[10] = { 52, 52, 52, 52, 200, 200, 200, 576, 1400, 1400 };
+    static const char *names[] = { "off", "bucket", "random", "distribution", "old random" };
+    static pbuf_t pbuf;
+
+    printf("\nobfuscation profiles, %d incompressible packets\n", packets);
+    printf(" profile      | overhead | ns/packet\n"
+           "--------------+----------+----------\n");
+
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+    randombytes_buf(pbuf.payload, sizeof(pbuf.payload));
+    uint64_t base = 0;
+    for (int p = 0; p < 5; p++)
+    {
+        obfs_t obfs;
+        memset(&obfs, 0, sizeof(obfs));
+        obfs.profile = (p == 0) ? OBFS_OFF : (p == 1) ? OBFS_BUCKET
+                       : (p == 2) ? OBFS_RANDOM : (p == 3) ? OBFS_DISTRIBUTION : OBFS_OFF;
+        obfs_parse(&obfs, OBFS_DIST_DEFAULT);
+        uint64_t bytes = 0;
+        int64_t start = mstime();
+        for (int k = 0; k < packets; k++)
+        {
+            int len = sizes[k % 10];
+            memcpy(pbuf.payload, &k, sizeof(k));
+            pbuf.len = (uint16_t)len;
+            pbuf.flag = 0;
+            if (p == 4)
+            {
+                // 原实现: 每个包调用 randombytes_uniform, 按字节生成 padding
+                int pad = (int)randombytes_uniform(mtu - len > 897 ? 554 : 342);
+                randombytes_buf(pbuf.payload + len, pad);
+                bytes += (uint64_t)pad;
+            }
+            bytes += (uint64_t)encapsulate(0, CIPHER_AUTO, &pbuf, mtu, &obfs);
+        }
+        int64_t end = mstime();
+        if (p == 0)
+        {
+            base = bytes;
+        }
+        printf(" %-12s | %7.1f%% | %8.0f\n", names[p],
+               (double)(bytes - base) * 100.0 / (double)base, (double)(end - start) * 1e6 / packets);
+    }
+}
+
+
+// 调度器: 一条 20ms 的有线 path 和一条拥塞的移动网络 path (120ms +-60ms, 3% 丢包),
+// 每 ms 一个包, 按测得的 RTT 和丢包率选择 path, 统计包的单向延迟和丢包
+static void perf_sched(void)
+{
+    const int packets = 20000;
+    static const char *names[] = { "rr", "minrtt", "weighted", "lowloss" };
+    static const struct
+    {
+        int rtt;
+        int jitter;
+        int loss;
+    } model[2] = { { 20000, 2000, 1 }, { 120000, 60000, 30 } };
+
+    printf("\nschedulers, %d packets over a wired and a congested mobile path\n", packets);
+    printf(" scheduler | delay(ms) | loss  | mobile\n"
+           "-----------+-----------+-------+-------\n");
+
+    for (int sched = SCHED_RR; sched <= SCHED_LOWLOSS; sched++)
+    {
+        static probe_t probes[2];
+        static struct
+        {
+            uint32_t arrive;
+            uint32_t ts;
+            int path;
+        } echoes[1024];
+        int pending = 0;
+        int64_t current[2] = { 0, 0 };
+        int paths[2] = { 0, 1 };
+        memset(probes, 0, sizeof(probes));
+        uint64_t delay = 0;
+        int lost = 0;
+        int mobile = 0;
+        uint32_t t = 1000000;
+        for (int k = 0; k < packets; k++)
+        {
+            t += 1000;
+            for (int i = 0; i < pending; i++)
+            {
+                if ((int32_t)(t - echoes[i].arrive) >= 0)
+                {
+                    probe_echo(&probes[echoes[i].path], echoes[i].ts, echoes[i].arrive);
+                    echoes[i--] = echoes[--pending];
+                }
+            }
+
+            // 心跳包每 500ms 探测一次每个 path, 数据包最多每 100ms 一次
+            pbuf_t pbuf;
+            for (int path = 0; path < 2; path++)
+            {
+                pbuf.flag = 0;
+                if (k % 500 == 0)
+                {
+                    probe_mark(&probes[path], &pbuf, 1, t);
+                }
+                int rtt = model[path].rtt - model[path].jitter
+                          + (int)randombytes_uniform(2 * model[path].jitter + 1);
+                if ((pbuf.flag & FLAG_TS) && (randombytes_uniform(1000) >= (uint32_t)model[path].loss)
+                    && (pending < 1024))
+                {
+                    echoes[pending].arrive = t + (uint32_t)rtt;
+                    echoes[pending].ts = t;
+                    echoes[pending++].path = path;
+                }
+            }
+            int path = (sched == SCHED_RR) ? -1 : probe_schedule(probes, paths, 2, sched, current);
+            if (path < 0)
+            {
+                path = k % 2;
+            }
+            pbuf.flag = 0;
+            probe_mark(&probes[path], &pbuf, 0, t);
+            int rtt = model[path].rtt - model[path].jitter
+                      + (int)randombytes_uniform(2 * model[path].jitter + 1);
+            if (randombytes_uniform(1000) < (uint32_t)model[path].loss)
+            {
+                lost++;
+            }
+            else
+            {
+                delay += (uint64_t)(rtt / 2);
+                if ((pbuf.flag & FLAG_TS) && (pending < 1024))
+                {
+                    echoes[pending].arrive = t + (uint32_t)rtt;
+                    echoes[pending].ts = t;
+                    echoes[pending++].path = path;
+                }
+            }
+            mobile += path;
+        }
+        printf(" %-9s | %9.1f | %4.1f%% | %4.1f%%\n", names[sched],
+               (double)delay / 1000.0 / (packets - lost), lost * 100.0 / packets,
+               mobile * 100.0 / packets);
+    }
+}
+
+
+// 会话表: 按目的地址查找会话和 path 的耗时, 随客户端数量的变化
+static void perf_session(void)
+{
+    const int packets = 1000000;
+    static const int clients[] = { 1000, 4000, 16000, 64000 };
+    static uint8_t pkt[40];
+
+    printf("\nsession lookup, %d packets to random clients\n", packets);
+    printf(" clients | ns/packet\n"
+           "---------+----------\n");
+
+    if (session_init(SESSION_MAX, 2) != 0)
+    {
+        printf("mmap failed\n");
+        return;
+    }
+    ipaddr remote;
+    memset(&remote, 0, sizeof(remote));
+    int learned = 0;
+    uint64_t found = 0;
+    for (int c = 0; c < (int)(sizeof(clients) / sizeof(clients[0])); c++)
+    {
+        // 10.0.0.0/8 里的客户端, 每个都在两个 path 上出现过
+        for (; learned < clients[c]; learned++)
+        {
+            uint8_t key[SESSION_KEY_LEN];
+            pkt[0] = 0x45;
+            uint32_t addr = htonl(0x0a000002 + (uint32_t)learned);
+            memcpy(pkt + 12, &addr, 4);
+            session_key(pkt, 20, 0, key);
+            session_t *s = session_learn(key, 1);
+            assert(s != NULL);
+            session_seen(s, key, 0, 1, remote, CIPHER_CHACHA20POLY1305, 1);
+            session_seen(s, key, 1, 2, remote, CIPHER_CHACHA20POLY1305, 1);
+        }
+        uint32_t r = 1;
+        int64_t start = mstime();
+        for (int k = 0; k < packets; k++)
+        {
+            uint8_t key[SESSION_KEY_LEN];
+            r = r * 1103515245u + 12345u;
+            uint32_t addr = htonl(0x0a000002 + (r >> 8) % (uint32_t)learned);
+            memcpy(pkt + 16, &addr, 4);
+            session_key(pkt, 20, 1, key);
+            session_t *s = session_find(key);
+            int token;
+            int cipher;
+            if ((s != NULL) && (session_route(s, key, 2, &token, &remote, &cipher) >= 0))
+            {
+                found++;
+            }
+        }
+        int64_t end = mstime();
+        printf(" %7d | %8.1f\n", learned, (double)(end - start) * 1e6 / packets);
+    }
+    assert(found == (uint64_t)packets * (sizeof(clients) / sizeof(clients[0])));
+}
+
+
+static struct
+{
+    uint32_t max;
+    int started;
+    uint64_t inversions;
+    uint64_t written;
+    uint64_t wait;
+    int64_t now;
+    int64_t *arrive;
+} rs;
+
+
+static void reorder_output(const uint8_t *pkt, int len)
+{
+    uint32_t seq;
+    assert(len == 4);
+    memcpy(&seq, pkt, 4);
+    if (rs.started && ((int32_t)(seq - rs.max) < 0))
+    {
+        rs.inversions++;
+    }
+    else
+    {
+        rs.max = seq;
+        rs.started = 1;
+    }
+    rs.written++;
+    rs.wait += (uint64_t)(rs.now - rs.arrive[seq]);
+}
+
+
+static int by_arrival(const void *a, const void *b)
+{
+    const int64_t *x = (const int64_t *)a;
+    const int64_t *y = (const int64_t *)b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+
+// 两个 path 轮流发送, 单程时延 10ms 和 25ms, 慢的那个丢 1%
+static void perf_reorder(void)
+{
+    const int packets = 1000000;
+    const int rate = 10000;
+    int64_t *events = (int64_t *)malloc(sizeof(int64_t) * 2 * packets);
+    rs.arrive = (int64_t *)malloc(sizeof(int64_t) * packets);
+    assert((events != NULL) && (rs.arrive != NULL));
+
+    printf("\nreorder, %d packets at %d/s round-robin over 10ms and 25ms (1%% loss) paths\n",
+           packets, rate);
+    printf(" mode | out of order | late  | skipped | wait(ms) | timeout | ns/packet\n"
+           "------+--------------+-------+---------+----------+---------+----------\n");
+
+    // 到达时间 us
+    uint32_t r = 1;
+    int count = 0;
+    for (int k = 0; k < packets; k++)
+    {
+        r = r * 1103515245u + 12345u;
+        int64_t delay = (k % 2 == 0) ? 9000 + (r >> 8) % 2000 : 20000 + (r >> 8) % 10000;
+        if ((k % 2 == 1) && ((r >> 16) % 100 == 0))
+        {
+            continue;
+        }
+        events[count * 2] = (int64_t)k * 1000000 / rate + delay;
+        events[count * 2 + 1] = k;
+        count++;
+    }
+    qsort(events, (size_t)count, sizeof(int64_t) * 2, by_arrival);
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        int64_t *arrive = rs.arrive;
+        memset(&rs, 0, sizeof(rs));
+        rs.arrive = arrive;
+        assert(reorder_init(4, reorder_output) == 0);
+        // (25 - 10) / 2 + 抖动
+        reorder_tune(10, rate);
+        int64_t tick = 0;
+        int64_t start = mstime();
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t seq = (uint32_t)events[i * 2 + 1];
+            rs.now = events[i * 2] / 1000;
+            rs.arrive[seq] = rs.now;
+            if (mode == 0)
+            {
+                reorder_output((uint8_t *)&seq, 4);
+                continue;
+            }
+            // reorder_worker 按 deadline 醒来, 这里每 ms 检查一次
+            for (; tick < rs.now; tick++)
+            {
+                int64_t now = rs.now;
+                rs.now = tick;
+                reorder_flush(tick);
+                rs.now = now;
+            }
+            reorder_input((uint8_t *)&seq, 4, seq, rs.now);
+        }
+        int64_t end = mstime();
+        reorder_stat_t stat;
+        reorder_stat(&stat);
+        printf(" %-4s | %12" PRIu64 " | %5" PRIu64 " | %7" PRIu64 " | %8.2f | %5dms | %9.1f\n",
+               mode ? "on" : "off", rs.inversions, stat.late, stat.skipped,
+               (double)rs.wait / (double)rs.written, (mode == 0) ? 0 : stat.timeout,
+               (double)(end - start) * 1e6 / count);
+    }
+    free(events);
+    free(rs.arrive);
+}
+
+
+static uint64_t fec_rebuilt;
+
+
+static void fec_output(const uint8_t *pkt, int len, uint32_t seq)
+{
+    (void)pkt;
+    (void)len;
+    (void)seq;
+    fec_rebuilt++;
+}
+
+
+// 1400 字节的包, 每组丢一个, 校验包最后到达
+static void perf_fec(void)
+{
+    const int packets = 1000000;
+    const int len = 1400;
+    static const int losses[] = { 100, 50, 25, 12, 7 };
+    static uint8_t pkts[FEC_GROUP_MAX][1400];
+    for (int i = 0; i < FEC_GROUP_MAX; i++)
+    {
+        randombytes_buf(pkts[i], len);
+    }
+
+    printf("\nfec, %d packets of %d bytes, one lost per group\n", packets, len);
+    printf(" group | overhead | encode(MB/s) | decode(MB/s)\n"
+           "-------+----------+--------------+-------------\n");
+
+    pbuf_t parity;
+    for (int l = 0; l < (int)(sizeof(losses) / sizeof(losses[0])); l++)
+    {
+        assert(fec_init(len, fec_output) == 0);
+        fec_tune(losses[l]);
+        fec_stat_t stat;
+        fec_stat(&stat);
+        int group = stat.group;
+        int groups = packets / group;
+        static uint8_t payloads[1024][FEC_HEADER_LEN + 1400];
+        static int sizes[1024];
+
+        int64_t start = mstime();
+        for (int g = 0; g < groups; g++)
+        {
+            for (int i = 0; i < group; i++)
+            {
+                fec_encode(pkts[i], len, (uint32_t)(g * group + i), 0);
+            }
+            fec_parity(&parity);
+            memcpy(payloads[g % 1024], parity.payload, parity.len);
+            sizes[g % 1024] = parity.len;
+        }
+        int64_t end = mstime();
+        double encode = (double)groups * group * len / 1024.0 / 1024.0 * 1000.0 / (double)(end - start + 1);
+
+        fec_rebuilt = 0;
+        start = mstime();
+        for (int g = 0; g < groups; g++)
+        {
+            int lost = g % group;
+            for (int i = 0; i < group; i++)
+            {
+                if (i != lost)
+                {
+                    fec_input(pkts[i], len, (uint32_t)(g * group + i));
+                }
+            }
+            fec_repair(payloads[g % 1024], sizes[g % 1024], (uint32_t)(g * group));
+        }
+        end = mstime();
+        double decode = (double)groups * group * len / 1024.0 / 1024.0 * 1000.0 / (double)(end - start + 1);
+        assert(fec_rebuilt == (uint64_t)groups);
+        printf(" %5d | %7.1f%% | %12.0f | %12.0f\n", group, 100.0 / group, encode, decode);
+    }
+}
+
+
 int main()
 {
     const char *key = "8556085d7ff5655a5e09a385c152ea2a";
@@ -81,7 +969,7 @@ int main()
 
             for (int k = 0; k < count; k++)
             {
-                int n = encapsulate(0, &copy, mtu);
+                int n = encapsulate(0, CIPHER_AUTO, &copy, mtu, NULL);
                 decapsulate(0, &copy, n);
             }
 
@@ -102,5 +990,23 @@ int main()
             }
         }
     }
+
+    perf_cipher();
+    perf_reject();
+    perf_compress();
+    perf_adaptive();
+    perf_hc();
+    perf_obfs();
+    perf_sched();
+    perf_session();
+    perf_reorder();
+    perf_fec();
+
+    perf_batch(0);
+    if (udpio_init(UDPIO_GSO | UDPIO_GRO))
+    {
+        perf_batch(UDPIO_GSO | UDPIO_GRO);
+    }
+    perf_io();
     return 0;
 }
@@ -0,0 +1,147 @@
+/*
+ * test_compress.c - test per flow compression skipping
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lz4.h>
+
+#include "../src/compress.h"
+
+#define LEN 1000
+
+// compress.c: 连续失败 4 次后跳过 16 个包, 每次重新尝试失败翻倍
+#define FAIL_LIMIT 4
+#define SKIP_MIN   16
+
+static uint8_t noise[LEN];
+static uint8_t text[LEN];
+static uint8_t out[LZ4_COMPRESSBOUND(LEN)];
+
+
+// IPv4/UDP 首部, 源地址区分不同的流
+static void flow_pkt(uint8_t *pkt, uint32_t src)
+{
+    memset(pkt, 0, 28);
+    pkt[0] = 0x45;
+    pkt[9] = 17;
+    pkt[12] = (uint8_t)(src >> 24);
+    pkt[13] = (uint8_t)(src >> 16);
+    pkt[14] = (uint8_t)(src >> 8);
+    pkt[15] = (uint8_t)src;
+    pkt[16] = 10;
+    pkt[19] = 1;
+    pkt[21] = 53;
+    pkt[23] = 53;
+}
+
+
+// 压缩 n 个不可压缩的包, 检查其中尝试和跳过的次数
+static void run(const uint8_t *pkt, int n, int tried, int skipped)
+{
+    compress_stat_t before, after;
+    compress_stat(&before);
+    for (int i = 0; i < n; i++)
+    {
+        assert(compress(noise, LEN, out, pkt, 28) == 0);
+    }
+    compress_stat(&after);
+    assert(after.tried - before.tried == (uint64_t)tried);
+    assert(after.skipped - before.skipped == (uint64_t)skipped);
+}
+
+
+static void test_skip(void)
+{
+    uint8_t a[28], b[28];
+    flow_pkt(a, 0x0a000001);
+    flow_pkt(b, 0x0a000002);
+
+    // 连续失败后跳过
+    run(a, FAIL_LIMIT, FAIL_LIMIT, 0);
+    run(a, SKIP_MIN, 0, SKIP_MIN);
+    // 其他流不受影响
+    assert(compress(text, LEN, out, b, 28) > 0);
+    // 重新尝试仍失败, 跳过的包数翻倍
+    run(a, 1, 1, 0);
+    run(a, SKIP_MIN * 2, 0, SKIP_MIN * 2);
+    run(a, 1, 1, 0);
+    run(a, SKIP_MIN * 4, 0, SKIP_MIN * 4);
+    // 重新尝试成功后恢复, 再失败从头计数
+    assert(compress(text, LEN, out, a, 28) > 0);
+    run(a, FAIL_LIMIT, FAIL_LIMIT, 0);
+    run(a, SKIP_MIN, 0, SKIP_MIN);
+    assert(compress(text, LEN, out, a, 28) > 0);
+}
+
+
+static void test_evict(void)
+{
+    // 有状态的流比槽位多, 一定有流被替换
+    compress_stat_t stat;
+    uint8_t pkt[28];
+    for (uint32_t i = 0; i < 4096; i++)
+    {
+        flow_pkt(pkt, 0x0b000000 + i);
+        for (int k = 0; k < FAIL_LIMIT; k++)
+        {
+            compress(noise, LEN, out, pkt, 28);
+        }
+    }
+    compress_stat(&stat);
+    assert(stat.evicted > 0);
+}
+
+
+static void test_saved(void)
+{
+    // 采样得到每字节耗时后, 跳过的包计入省下的时间
+    uint8_t pkt[28];
+    flow_pkt(pkt, 0x0c000001);
+    for (int i = 0; i < 1024; i++)
+    {
+        assert(compress(text, LEN, out, pkt, 28) > 0);
+    }
+    compress_stat_t before, after;
+    compress_stat(&before);
+    for (int i = 0; i < 1000000; i++)
+    {
+        compress(text, 100, out, pkt, 28);
+    }
+    compress_stat(&after);
+    assert(after.skipped - before.skipped == 1000000);
+    assert(after.saved_us > before.saved_us);
+}
+
+
+int main()
+{
+    uint32_t x = 12345;
+    for (int i = 0; i < LEN; i++)
+    {
+        x = x * 1103515245 + 12345;
+        noise[i] = (uint8_t)(x >> 16);
+        text[i] = (uint8_t)("abcdefgh"[i % 8] + (i / 200));
+    }
+    test_skip();
+    test_evict();
+    test_saved();
+    return 0;
+}
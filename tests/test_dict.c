@@ -0,0 +1,170 @@
+/*
+ * test_dict.c - test dictionary training with muon-dict
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lz4.h>
+
+#include "../src/compress.h"
+
+#define PACKETS 200
+
+static const char *request = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+                             "User-Agent: Mozilla/5.0\r\nAccept: text/html\r\n\r\n";
+
+static char dir[] = "/tmp/muon-test-XXXXXX";
+static char pcap[64];
+static char dict_path[64];
+
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+
+// IPv4/TCP 包, 载荷是 HTTP 请求, 每个包的端口和序号不同
+static int http_packet(uint8_t *pkt, int i)
+{
+    int len = 40 + (int)strlen(request);
+    memset(pkt, 0, 40);
+    pkt[0] = 0x45;
+    pkt[2] = (uint8_t)(len >> 8);
+    pkt[3] = (uint8_t)len;
+    pkt[8] = 64;
+    pkt[9] = 6;
+    pkt[12] = 10;
+    pkt[15] = 2;
+    pkt[16] = 10;
+    pkt[19] = 1;
+    pkt[20] = (uint8_t)(40000 + i);
+    pkt[21] = (uint8_t)i;
+    pkt[23] = 80;
+    pkt[24] = (uint8_t)(i * 7);
+    pkt[32] = 0x50;
+    memcpy(pkt + 40, request, strlen(request));
+    return len;
+}
+
+
+// raw IP (linktype 101) 的 pcap
+static void write_pcap(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL);
+    uint8_t hdr[24];
+    memset(hdr, 0, sizeof(hdr));
+    put32(hdr, 0xa1b2c3d4);
+    hdr[4] = 2;
+    hdr[6] = 4;
+    put32(hdr + 16, 65535);
+    put32(hdr + 20, 101);
+    assert(fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr));
+    for (int i = 0; i < PACKETS; i++)
+    {
+        uint8_t rec[16];
+        uint8_t pkt[256];
+        int len = http_packet(pkt, i);
+        memset(rec, 0, sizeof(rec));
+        put32(rec + 8, (uint32_t)len);
+        put32(rec + 12, (uint32_t)len);
+        assert(fwrite(rec, 1, sizeof(rec), f) == sizeof(rec));
+        assert(fwrite(pkt, 1, len, f) == (size_t)len);
+    }
+    fclose(f);
+}
+
+
+// 运行 muon-dict, 返回退出码
+static int run(const char *size, const char *in, const char *out)
+{
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(MUON_DICT, MUON_DICT, "-s", size, in, out, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+
+int main()
+{
+    assert(mkdtemp(dir) != NULL);
+    snprintf(pcap, sizeof(pcap), "%s/sample.pcap", dir);
+    snprintf(dict_path, sizeof(dict_path), "%s/dict.bin", dir);
+    write_pcap(pcap);
+
+    // 大小限制和 compress.c 使用的一致
+    char max[16];
+    char over[16];
+    snprintf(max, sizeof(max), "%d", DICT_MAX);
+    snprintf(over, sizeof(over), "%d", DICT_MAX + 1);
+    assert(run(over, pcap, dict_path) != 0);
+    assert(access(dict_path, F_OK) != 0);
+    // 不是 pcap
+    assert(run("1024", dict_path, pcap) != 0);
+    assert(run("1024", "/dev/null", dict_path) != 0);
+    assert(run(max, pcap, dict_path) == 0);
+
+    // 字典包含重复的请求, 不超过指定大小
+    assert(run("1024", pcap, dict_path) == 0);
+    struct stat st;
+    assert((stat(dict_path, &st) == 0) && (st.st_size > 0) && (st.st_size <= 1024));
+    static char dict[1024];
+    FILE *f = fopen(dict_path, "rb");
+    assert(f != NULL);
+    size_t size = fread(dict, 1, sizeof(dict), f);
+    fclose(f);
+    assert(memmem(dict, size, "Host: www.example.com", 21) != NULL);
+
+    // 有字典时小包压缩得更短
+    uint8_t pkt[256];
+    uint8_t plain[LZ4_COMPRESSBOUND(256)];
+    uint8_t out[LZ4_COMPRESSBOUND(256)];
+    uint8_t back[256];
+    int len = http_packet(pkt, PACKETS);
+    int without = compress(pkt, len, plain, pkt, len);
+    uint32_t id;
+    assert(compress_dict(dict_path, &id) == (int)size);
+    int with = compress(pkt, len, out, pkt, len);
+    assert((with > 0) && ((without == 0) || (with < without / 2)));
+    assert(decompress(out, with, back, sizeof(back), 1) == len);
+    assert(memcmp(back, pkt, len) == 0);
+
+    remove(pcap);
+    remove(dict_path);
+    assert(rmdir(dir) == 0);
+    return 0;
+}
@@ -22,11 +22,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 #include <sodium.h>
 
+#include "../src/compress.h"
+#include "../src/conf.h"
 #include "../src/crypto.h"
 #include "../src/encapsulate.h"
+#include "../src/hc.h"
 
 
 int main()
@@ -47,7 +52,7 @@ int main()
     pbuf.len = 1024;
     pbuf.flag = 0x0000;
     pbuf.ack = 0;
-    n = encapsulate(0, &pbuf, mtu);
+    n = encapsulate(0, CIPHER_AUTO, &pbuf, mtu, NULL);
     printf("%d\n", n);
     for (int i = 0; i < n; i++)
     {
@@ -63,7 +68,7 @@ int main()
     pbuf.len = 512;
     pbuf.flag = 0x0000;
     pbuf.ack = 0;
-    n = encapsulate(0, &pbuf, mtu);
+    n = encapsulate(0, CIPHER_AUTO, &pbuf, mtu, NULL);
     printf("%d\n", n);
     for (int i = 0; i < n; i++)
     {
@@ -95,6 +100,9 @@ int main()
         assert((pbuf.payload[i]) == (c & 0xffu));
     }
 
+    // v1 vectors above, round trips below use v2
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+
     for (int len = 0; len <= mtu; len++)
     {
         for (int data = 0; data <=2; data++)
@@ -124,8 +132,8 @@ int main()
             copy.len = pbuf.len;
             memcpy(copy.payload, pbuf.payload, pbuf.len);
 
-            n = encapsulate(0, &copy, mtu);
-            assert(n <= mtu + PAYLOAD_OFFSET);
+            n = encapsulate(0, CIPHER_AUTO, &copy, mtu, NULL);
+            assert(n <= mtu + PAYLOAD_OFFSET + CRYPTO_TAG_LEN);
 
             n = decapsulate(0, &copy, n);
             assert(n >= 0);
@@ -133,5 +141,302 @@ int main()
             assert(memcmp(copy.payload, pbuf.payload, copy.len) == 0);
         }
     }
+
+    // every format round trips
+    int ciphers[] = { CIPHER_LEGACY, CIPHER_AES256GCM, CIPHER_CHACHA20POLY1305, CIPHER_LEGACY };
+    for (int i = 0; i < 4; i++)
+    {
+        if (crypto_setup(ciphers[i], 1) < 0)
+        {
+            // no AES-NI
+            continue;
+        }
+        for (int len = 0; len <= mtu; len += 7)
+        {
+            for (int j = 0; j < len; j++)
+            {
+                pbuf.payload[j] = (len % 2) ? (uint8_t)(randombytes_uniform(256)) : (uint8_t)(j & 0xffU);
+            }
+            pbuf.len = len;
+            pbuf.flag = 0x0000;
+            pbuf.ack = 0;
+
+            pbuf_t copy;
+            memcpy(&copy, &pbuf, sizeof(pbuf));
+            n = encapsulate(0, CIPHER_AUTO, &copy, mtu, NULL);
+            assert(n <= mtu + PAYLOAD_OFFSET + CRYPTO_TAG_LEN);
+            assert(decapsulate(0, &copy, n) == len);
+            assert(memcmp(copy.payload, pbuf.payload, len) == 0);
+        }
+    }
+
+    // peers using different formats at the same time: every packet decodes,
+    // and reports its format so replies can follow it
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+    for (int i = 0; i < 30; i++)
+    {
+        int c = ciphers[i % 3];
+        if ((c == CIPHER_AES256GCM) && !crypto_aead_aes256gcm_is_available())
+        {
+            continue;
+        }
+        pbuf.len = 100;
+        pbuf.flag = 0x0000;
+        pbuf.ack = 0;
+        pbuf_t copy;
+        memcpy(&copy, &pbuf, sizeof(pbuf));
+        n = encapsulate(0, c, &copy, mtu, NULL);
+        assert(decapsulate(0, &copy, n) == 100);
+        assert(copy.cipher == c);
+        assert(memcmp(copy.payload, pbuf.payload, 100) == 0);
+    }
+    // legacy=no rejects v1 only
+    crypto_setup(CIPHER_CHACHA20POLY1305, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        pbuf.len = 100;
+        pbuf.flag = 0x0000;
+        pbuf.ack = 0;
+        pbuf_t copy;
+        memcpy(&copy, &pbuf, sizeof(pbuf));
+        n = encapsulate(0, ciphers[i], &copy, mtu, NULL);
+        assert((decapsulate(0, &copy, n) < 0) == (ciphers[i] == CIPHER_LEGACY));
+    }
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+
+    // tokens sharing a slot of the key cache must not share keys
+    int tokens[] = { 1, 257, 513, 1 };
+    crypto_prepare(tokens, 3);
+    for (int i = 0; i < 3; i++)
+    {
+        pbuf.len = 100;
+        pbuf.flag = 0x0000;
+        pbuf.ack = 0;
+        n = encapsulate(tokens[i], CIPHER_AUTO, &pbuf, mtu, NULL);
+        pbuf_t copy;
+        memcpy(&copy, &pbuf, n);
+        assert(decapsulate(tokens[i + 1], &copy, n) < 0);
+        assert(decapsulate(tokens[i], &pbuf, n) == 100);
+    }
+
+    // small packets compress with a shared dictionary
+    const char *text = "GET / HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n\r\n";
+    int text_len = (int)strlen(text);
+    char dict_path[] = "/tmp/muon-dict-XXXXXX";
+    int fd = mkstemp(dict_path);
+    assert(fd >= 0);
+    assert(write(fd, text, text_len) == text_len);
+    close(fd);
+    uint32_t id;
+    assert(compress_dict(dict_path, &id) == text_len);
+    remove(dict_path);
+    memcpy(pbuf.payload, text, text_len);
+    pbuf.len = text_len;
+    pbuf.flag = 0x0000;
+    pbuf.ack = 0;
+    n = encapsulate(0, CIPHER_AUTO, &pbuf, mtu, NULL);
+    assert(n < PAYLOAD_OFFSET + text_len);
+    assert(decapsulate(0, &pbuf, n) == text_len);
+    assert(memcmp(pbuf.payload, text, text_len) == 0);
+
+    // header compression: IPv4/TCP and IPv6/UDP flows round trip exactly,
+    // full headers are sent until acknowledged, so losing them drops nothing
+    hc_enable(1);
+    for (int v6 = 0; v6 <= 1; v6++)
+    {
+        uint8_t pkt[200];
+        int len = v6 ? 40 + 8 + 100 : 20 + 32 + 100;
+        memset(pkt, 0, sizeof(pkt));
+        for (int j = 0; j < len; j++)
+        {
+            pkt[j] = (uint8_t)randombytes_uniform(256);
+        }
+        if (v6)
+        {
+            pkt[0] = 0x60;
+            pkt[4] = 0;
+            pkt[5] = (uint8_t)(len - 40);
+            pkt[6] = 17;
+            pkt[44] = 0;
+            pkt[45] = (uint8_t)(len - 40);
+        }
+        else
+        {
+            pkt[0] = 0x45;
+            pkt[2] = 0;
+            pkt[3] = (uint8_t)len;
+            pkt[6] = 0x40;
+            pkt[7] = 0;
+            pkt[9] = 6;
+            pkt[32] = 0x80;
+        }
+        int lost = 0;
+        hc_stat_t before, after;
+        hc_stat(&before);
+        for (int i = 0; i < 40; i++)
+        {
+            // changing fields
+            pkt[v6 ? 46 : 24] = (uint8_t)i;
+            if (!v6)
+            {
+                pkt[5] = (uint8_t)i;
+                pkt[10] = 0;
+                pkt[11] = 0;
+                uint32_t sum = 0;
+                for (int j = 0; j < 20; j += 2)
+                {
+                    sum += (uint32_t)((pkt[j] << 8) | pkt[j + 1]);
+                }
+                sum = (sum & 0xffff) + (sum >> 16);
+                sum = (sum & 0xffff) + (sum >> 16);
+                pkt[10] = (uint8_t)(~sum >> 8);
+                pkt[11] = (uint8_t)~sum;
+            }
+            memcpy(pbuf.payload, pkt, len);
+            pbuf.len = len;
+            pbuf.flag = 0x0000;
+            pbuf.ack = 0;
+            n = encapsulate(0, CIPHER_AUTO, &pbuf, mtu, NULL);
+            if (v6 && (i < 3))
+            {
+                // full headers lost
+                continue;
+            }
+            n = decapsulate(0, &pbuf, n);
+            if (n < 0)
+            {
+                lost++;
+                continue;
+            }
+            assert(n == len);
+            assert(memcmp(pbuf.payload, pkt, len) == 0);
+        }
+        assert(lost == 0);
+        // the ack rides on the next packet, then all but the 32nd are compressed
+        hc_stat(&after);
+        assert(after.compressed - before.compressed == (v6 ? 34 : 37));
+    }
+
+    // a miss asks for full headers again; a packet reordered across a change
+    // of the headers is restored with the previous context
+    {
+        uint8_t pkt[100];
+        uint8_t out[100 + HC_OVERHEAD];
+        uint8_t buf[256];
+        uint8_t fb[HC_FEEDBACK_MAX];
+        int len = 20 + 8 + 50;
+        memset(pkt, 0, sizeof(pkt));
+        pkt[0] = 0x45;
+        pkt[3] = (uint8_t)len;
+        pkt[8] = 64;
+        pkt[9] = 17;
+        pkt[12] = 10;
+        pkt[15] = 7;
+        pkt[16] = 10;
+        pkt[19] = 8;
+        pkt[21] = 53;
+        pkt[25] = (uint8_t)(len - 20);
+        n = hc_compress(pkt, len, out, sizeof(out));
+        assert((n == len + HC_OVERHEAD) && (out[0] & 0x80));
+        int cid = out[0] & 0x7f;
+        uint8_t gen = out[1];
+        memcpy(buf, out, n);
+        assert(hc_decompress(buf, n, sizeof(buf)) == len);
+        int fb_len = hc_feedback(fb, sizeof(fb));
+        assert((fb_len == 3) && (fb[0] == cid) && (fb[1] == gen) && (fb[2] == 1));
+        assert(hc_feedback(fb, sizeof(fb)) == 0);
+        assert(hc_feedback_input(fb, fb_len) == fb_len);
+        n = hc_compress(pkt, len, out, sizeof(out));
+        assert((n < len) && !(out[0] & 0x80));
+
+        // unknown generation
+        memcpy(buf, out, n);
+        buf[1] = (uint8_t)(gen + 50);
+        hc_stat_t stat;
+        hc_stat(&stat);
+        assert(hc_decompress(buf, n, sizeof(buf)) < 0);
+        uint64_t misses = stat.misses;
+        hc_stat(&stat);
+        assert(stat.misses == misses + 1);
+        fb_len = hc_feedback(fb, sizeof(fb));
+        assert((fb_len == 3) && (fb[0] == (0x80 | cid)) && (fb[1] == (uint8_t)(gen + 50)));
+        // feedback for another generation is ignored
+        assert(hc_feedback_input(fb, fb_len) == fb_len);
+        assert(!(out[0] & 0x80) && (hc_compress(pkt, len, out, sizeof(out)) < len));
+        fb[1] = gen;
+        assert(hc_feedback_input(fb, fb_len) == fb_len);
+        assert(hc_compress(pkt, len, out, sizeof(out)) == len + HC_OVERHEAD);
+        assert(out[0] & 0x80);
+        memcpy(buf, out, len + HC_OVERHEAD);
+        assert(hc_decompress(buf, len + HC_OVERHEAD, sizeof(buf)) == len);
+        assert(hc_feedback(fb, sizeof(fb)) == 3);
+        assert(hc_feedback_input(fb, 3) == 3);
+
+        // a compressed packet arrives after the full headers of the next context
+        pkt[30] = 1;
+        n = hc_compress(pkt, len, out, sizeof(out));
+        assert((n < len) && !(out[0] & 0x80));
+        uint8_t late[100 + HC_OVERHEAD];
+        int late_len = n;
+        memcpy(late, out, n);
+        uint8_t old = pkt[8];
+        pkt[8] = 32;
+        n = hc_compress(pkt, len, out, sizeof(out));
+        assert((n == len + HC_OVERHEAD) && ((out[0] & 0x7f) == cid) && (out[1] != gen));
+        memcpy(buf, out, n);
+        assert(hc_decompress(buf, n, sizeof(buf)) == len);
+        memcpy(buf, late, late_len);
+        assert(hc_decompress(buf, late_len, sizeof(buf)) == len);
+        assert((buf[8] == old) && (buf[30] == 1));
+        hc_feedback(fb, sizeof(fb));
+
+        // malformed feedback
+        fb[0] = 0;
+        assert(hc_feedback_input(fb, 1) < 0);
+        fb[2] = 9;
+        assert(hc_feedback_input(fb, 3) < 0);
+        fb[2] = 1;
+        assert(hc_feedback_input(fb, 2) < 0);
+    }
+    hc_enable(0);
+
+    // obfuscation profiles: padding never exceeds mtu, packets round trip
+    crypto_setup(CIPHER_CHACHA20POLY1305, 1);
+    obfs_t obfs;
+    memset(&obfs, 0, sizeof(obfs));
+    assert(obfs_parse(&obfs, "1:1,200:x") < 0);
+    assert(obfs_parse(&obfs, "300:1,200:1") < 0);
+    assert(obfs_parse(&obfs, "200:1,1000:3") == 0);
+    int profiles[] = { OBFS_OFF, OBFS_BUCKET, OBFS_RANDOM, OBFS_DISTRIBUTION };
+    for (int i = 0; i < 4; i++)
+    {
+        obfs.profile = profiles[i];
+        for (int len = 0; len <= mtu; len += 11)
+        {
+            randombytes_buf(pbuf.payload, len);
+            pbuf.len = len;
+            pbuf.flag = 0x0000;
+            pbuf.ack = 0;
+            pbuf_t copy;
+            memcpy(&copy, &pbuf, sizeof(pbuf));
+            n = encapsulate(0, CIPHER_AUTO, &copy, mtu, &obfs);
+            int size = n - PAYLOAD_OFFSET - CRYPTO_TAG_LEN;
+            assert(size <= ((len > mtu) ? len : mtu));
+            if (obfs.profile == OBFS_OFF)
+            {
+                assert(size == len);
+            }
+            else if (obfs.profile == OBFS_BUCKET)
+            {
+                assert((size == mtu) || (size % OBFS_BUCKET_SIZE == 0));
+            }
+            else if (obfs.profile == OBFS_DISTRIBUTION)
+            {
+                assert((size == len) || (size == 200) || (size == 1000));
+            }
+            assert(decapsulate(0, &copy, n) == len);
+            assert(memcmp(copy.payload, pbuf.payload, len) == 0);
+        }
+    }
     return 0;
 }
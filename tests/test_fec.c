@@ -0,0 +1,169 @@
+/*
+ * test_fec.c - test forward error correction
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "../src/conf.h"
+#include "../src/crypto.h"
+#include "../src/encapsulate.h"
+#include "../src/fec.h"
+
+#define MTU 1452
+
+static uint8_t rebuilt[1500];
+static int rebuilt_len;
+static uint32_t rebuilt_seq;
+
+static uint8_t group[5][1500];
+static int lens[5] = { 1400, 60, 1000, 1, 700 };
+
+
+static void fec_output(const uint8_t *pkt, int len, uint32_t seq)
+{
+    memcpy(rebuilt, pkt, len);
+    rebuilt_len = len;
+    rebuilt_seq = seq;
+}
+
+
+static void test_tune(void)
+{
+    // 分组大小随丢包率变化, 几乎不丢包时不发冗余
+    uint8_t pkt[100];
+    memset(pkt, 0, sizeof(pkt));
+    fec_tune(1);
+    assert(fec_encode(pkt, sizeof(pkt), 0, 0) == 0);
+    assert(!fec_due(1000));
+    fec_tune(200);
+    fec_stat_t fs;
+    fec_stat(&fs);
+    assert(fs.group == FEC_GROUP_MIN);
+    fec_tune(10);
+    fec_stat(&fs);
+    assert(fs.group == 25);
+}
+
+
+static void test_repair(void)
+{
+    // 一组丢一个包可以重建, 即使冗余包先到, 之后到达的原包算重复
+    fec_tune(50);
+    for (int i = 0; i < 5; i++)
+    {
+        randombytes_buf(group[i], lens[i]);
+        assert(fec_encode(group[i], lens[i], 1000 + i, 2000) == (i == 4));
+    }
+    assert(fec_due(2000 + FEC_DELAY));
+    pbuf_t parity;
+    assert(fec_parity(&parity) == 1);
+    assert(!fec_due(2000 + FEC_DELAY) && (fec_parity(&parity) == 0));
+    int n = encapsulate(0, CIPHER_AUTO, &parity, MTU, NULL);
+    assert(decapsulate(0, &parity, n) == FEC_HEADER_LEN + 1400);
+    assert((parity.flag & FLAG_FEC) && (parity.seq == 1000));
+    assert(fec_repair(parity.payload, parity.len, parity.seq) == 0);
+    for (int i = 0; i < 5; i++)
+    {
+        if (i != 2)
+        {
+            assert(fec_input(group[i], lens[i], 1000 + i) == (i == 4));
+        }
+    }
+    assert((rebuilt_seq == 1002) && (rebuilt_len == 1000));
+    assert(memcmp(rebuilt, group[2], 1000) == 0);
+    assert(fec_input(group[2], lens[2], 1002) < 0);
+
+    // 一组丢两个包无法重建
+    for (int i = 0; i < 5; i++)
+    {
+        fec_encode(group[i], lens[i], 2000 + i, 3000);
+    }
+    assert(fec_parity(&parity) == 1);
+    for (int i = 2; i < 5; i++)
+    {
+        assert(fec_input(group[i], lens[i], 2000 + i) == 0);
+    }
+    assert(fec_repair(parity.payload, parity.len, parity.seq) == 0);
+    fec_stat_t fs;
+    fec_stat(&fs);
+    assert((fs.recovered == 1) && (fs.duplicates == 1) && (fs.parity_sent == 2));
+    assert(fs.unrecoverable == 0);
+
+    // 缺的包移出窗口之后才算作无法重建, 在那之前迟到的包还可能补上
+    uint8_t pkt[100];
+    memset(pkt, 0, sizeof(pkt));
+    for (uint32_t seq = 2005; seq < 2000 + FEC_SLOTS; seq++)
+    {
+        assert(fec_input(pkt, sizeof(pkt), seq) == 0);
+    }
+    fec_stat(&fs);
+    assert(fs.unrecoverable == 0);
+    assert(fec_input(pkt, sizeof(pkt), 2000 + FEC_SLOTS) == 0);
+    fec_stat(&fs);
+    assert((fs.unrecoverable == 1) && (fs.recovered == 1));
+
+    // 组的第一个包移出窗口后到达的校验包不再使用
+    assert(fec_repair(parity.payload, parity.len, parity.seq) == 0);
+    fec_stat(&fs);
+    assert(fs.unrecoverable == 1);
+}
+
+
+static void test_gap(void)
+{
+    // 序号不连续时结束当前的组, 这个包开始新的一组
+    fec_tune(50);
+    assert(fec_encode(group[0], lens[0], 5000, 6000) == 0);
+    assert(fec_encode(group[1], lens[1], 5001, 6000) == 0);
+    assert(fec_encode(group[2], lens[2], 5003, 6001) == 1);
+    assert(fec_due(6001));
+    pbuf_t parity;
+    assert(fec_parity(&parity) == 1);
+    assert((parity.seq == 5000) && (parity.payload[0] == 2));
+    assert(parity.len == FEC_HEADER_LEN + lens[0]);
+    assert(!fec_due(6001));
+    for (int i = 3; i < 5; i++)
+    {
+        assert(fec_encode(group[i], lens[i], 5001 + i, 6002) == 0);
+    }
+    assert(fec_due(6001 + FEC_DELAY));
+    assert(fec_parity(&parity) == 1);
+    assert((parity.seq == 5003) && (parity.payload[0] == 3));
+
+    // 新的组可以重建
+    assert(fec_repair(parity.payload, parity.len, parity.seq) == 0);
+    assert(fec_input(group[2], lens[2], 5003) == 0);
+    assert(fec_input(group[4], lens[4], 5005) == 1);
+    assert((rebuilt_seq == 5004) && (rebuilt_len == lens[3]));
+    assert(memcmp(rebuilt, group[3], lens[3]) == 0);
+}
+
+
+int main()
+{
+    crypto_init("8556085d7ff5655a5e09a385c152ea2a");
+    assert(fec_init(MTU, fec_output) == 0);
+    test_tune();
+    test_repair();
+    test_gap();
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * test_log.c - test asynchronous logging and rate limiting
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/log.h"
+
+#define MESSAGES 4000
+
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+
+static void test_ratelimit(void)
+{
+    log_limit_t limit;
+    memset(&limit, 0, sizeof(limit));
+    assert(__log_allow(&limit, 100) == 1);
+    assert(__log_allow(&limit, 100) == 0);
+    assert(__log_allow(&limit, 100) == 0);
+    sleep_ms(120);
+    // 放行时带上期间压下的条数
+    assert(__log_allow(&limit, 100) == 3);
+    sleep_ms(120);
+    assert(__log_allow(&limit, 100) == 1);
+}
+
+
+// 读到 EOF, 返回行数
+static void *count_lines(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[4096];
+    long lines = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t i = 0; i < n; i++)
+        {
+            lines += (buf[i] == '\n');
+        }
+    }
+    return (void *)lines;
+}
+
+
+static void test_ring(void)
+{
+    int fds[2];
+    assert(pipe(fds) == 0);
+    int saved = dup(STDOUT_FILENO);
+    assert(dup2(fds[1], STDOUT_FILENO) == STDOUT_FILENO);
+    close(fds[1]);
+
+    assert(log_start() == 0);
+
+    // 后台线程空闲时阻塞, 新消息要立即唤醒它
+    sleep_ms(50);
+    LOG("hello");
+    LOG_CONT("world");
+    char buf[256];
+    int len = 0;
+    int lines = 0;
+    while (lines < 2)
+    {
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        assert(poll(&pfd, 1, 1000) == 1);
+        ssize_t n = read(fds[0], buf + len, sizeof(buf) - 1 - len);
+        assert(n > 0);
+        for (int i = len; i < len + n; i++)
+        {
+            lines += (buf[i] == '\n');
+        }
+        len += (int)n;
+    }
+    assert((lines == 2) && (buf[len - 1] == '\n'));
+    buf[len - 1] = '\0';
+    char *second = strchr(buf, '\n');
+    assert((buf[0] == '[') && (second != NULL));
+    *second++ = '\0';
+    assert(strstr(buf, "] hello") != NULL);
+    // 续行没有时间
+    assert(strcmp(second, "world") == 0);
+
+    // 没人读 pipe, 后台线程写满 pipe 后阻塞, 队列满了之后的消息丢弃
+    char msg[201];
+    memset(msg, 'x', 200);
+    msg[200] = '\0';
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        LOG("%s", msg);
+    }
+    uint64_t dropped = log_dropped();
+    assert((dropped > 0) && (dropped < MESSAGES));
+
+    // 其余消息全部写出
+    pthread_t reader;
+    assert(pthread_create(&reader, NULL, count_lines, &fds[0]) == 0);
+    log_stop();
+    assert(dup2(saved, STDOUT_FILENO) == STDOUT_FILENO);
+    close(saved);
+    void *total;
+    pthread_join(reader, &total);
+    assert((long)total == MESSAGES - (long)dropped);
+    assert(log_dropped() == dropped);
+    close(fds[0]);
+}
+
+
+int main()
+{
+    test_ratelimit();
+    test_ring();
+    return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * test_offload.c - test TSO segmentation and GRO coalescing
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/offload.h"
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static uint16_t csum(uint32_t sum, const uint8_t *p, int len)
+{
+    for (; len > 1; p += 2, len -= 2)
+    {
+        sum += get16(p);
+    }
+    if (len > 0)
+    {
+        sum += (uint32_t)p[0] << 8;
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)sum;
+}
+
+
+// TCP 校验和正确时整个段加上伪首部的和为 0xffff
+static int tcp_csum_ok(const uint8_t *pkt, int iphl, int len)
+{
+    uint32_t sum;
+    if (iphl == 20)
+    {
+        sum = csum(0, pkt + 12, 8);
+    }
+    else
+    {
+        sum = csum(0, pkt + 8, 32);
+    }
+    sum += 6 + (uint32_t)(len - iphl);
+    return csum(sum, pkt + iphl, len - iphl) == 0xffff;
+}
+
+
+// IPv4 (v6 = 0) 或 IPv6 的 TCP 包, 返回长度
+static int tcp_packet(uint8_t *pkt, int v6, uint32_t seq, int payload, uint8_t flags)
+{
+    int iphl = v6 ? 40 : 20;
+    int len = iphl + 20 + payload;
+    memset(pkt, 0, iphl + 20);
+    if (v6)
+    {
+        pkt[0] = 0x60;
+        put16(pkt + 4, (uint16_t)(len - 40));
+        pkt[6] = 6;
+        pkt[7] = 64;
+        pkt[8] = 0xfd;
+        pkt[23] = 1;
+        pkt[24] = 0xfd;
+        pkt[39] = 2;
+    }
+    else
+    {
+        pkt[0] = 0x45;
+        put16(pkt + 2, (uint16_t)len);
+        put16(pkt + 4, 0x1234);
+        pkt[6] = 0x40;
+        pkt[8] = 64;
+        pkt[9] = 6;
+        pkt[12] = 10;
+        pkt[15] = 1;
+        pkt[16] = 10;
+        pkt[19] = 2;
+        put16(pkt + 10, (uint16_t)~csum(0, pkt, 20));
+    }
+    uint8_t *tcp = pkt + iphl;
+    put16(tcp, 40000);
+    put16(tcp + 2, 80);
+    tcp[4] = (uint8_t)(seq >> 24);
+    tcp[5] = (uint8_t)(seq >> 16);
+    tcp[6] = (uint8_t)(seq >> 8);
+    tcp[7] = (uint8_t)seq;
+    tcp[11] = 1;
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    put16(tcp + 14, 0xffff);
+    for (int i = 0; i < payload; i++)
+    {
+        tcp[20 + i] = (uint8_t)(seq + (uint32_t)i);
+    }
+    uint32_t sum = v6 ? csum(0, pkt + 8, 32) : csum(0, pkt + 12, 8);
+    put16(tcp + 16, (uint16_t)~csum(sum + 6 + (uint32_t)(len - iphl), tcp, len - iphl));
+    return len;
+}
+
+
+// 模拟 tun 读到的超大包, 切成 mss 大小的段
+static void test_tso(int v6)
+{
+    static uint8_t buf[OFFLOAD_BUF_SIZE];
+    static uint8_t out[2048];
+    const int mss = 1000;
+    const int payload = 3500;
+    const uint32_t seq = 0xfffffc00;
+    int iphl = v6 ? 40 : 20;
+
+    vnet_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.gso_type = v6 ? 4 : 1;
+    hdr.gso_size = mss;
+    hdr.hdr_len = (uint16_t)(iphl + 20);
+    memcpy(buf, &hdr, VNET_HDR_LEN);
+    int n = tcp_packet(buf + VNET_HDR_LEN, v6, seq, payload, TCP_ACK | TCP_PSH | TCP_FIN | TCP_CWR);
+
+    offload_t it;
+    assert(offload_begin(&it, buf, VNET_HDR_LEN + n) == 0);
+    assert(offload_next(&it, out, 100) < 0);
+    int segs = 0;
+    int total = 0;
+    int len;
+    while ((len = offload_next(&it, out, sizeof(out))) > 0)
+    {
+        int data = len - iphl - 20;
+        assert(data == ((segs < 3) ? mss : payload - 3 * mss));
+        const uint8_t *tcp = out + iphl;
+        if (v6)
+        {
+            assert(get16(out + 4) == len - 40);
+        }
+        else
+        {
+            assert(get16(out + 2) == len);
+            assert(get16(out + 4) == 0x1234 + segs);
+            assert(csum(0, out, 20) == 0xffff);
+        }
+        // 序号连续, 跨过 2^32 回绕
+        assert(get32(tcp + 4) == seq + (uint32_t)total);
+        assert(tcp[20] == (uint8_t)(seq + (uint32_t)total));
+        assert(tcp_csum_ok(out, iphl, len));
+        // PSH/FIN 只留在最后一段, CWR 只留在第一段
+        int last = (total + data == payload);
+        assert(!!(tcp[13] & (TCP_PSH | TCP_FIN)) == last);
+        assert(!!(tcp[13] & TCP_CWR) == (segs == 0));
+        total += data;
+        segs++;
+    }
+    assert((len == 0) && (segs == 4) && (total == payload));
+}
+
+
+// 没有 GSO 时只补全校验和
+static void test_csum(void)
+{
+    static uint8_t buf[2048];
+    static uint8_t out[2048];
+    vnet_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = 1;
+    hdr.csum_start = 20;
+    hdr.csum_offset = 16;
+    memcpy(buf, &hdr, VNET_HDR_LEN);
+    uint8_t *pkt = buf + VNET_HDR_LEN;
+    int n = tcp_packet(pkt, 0, 1, 501, TCP_ACK);
+    // 内核只填伪首部的和
+    put16(pkt + 36, csum(csum(0, pkt + 12, 8) + 6 + (uint32_t)(n - 20), NULL, 0));
+
+    offload_t it;
+    assert(offload_begin(&it, buf, VNET_HDR_LEN + n) == 0);
+    assert(offload_next(&it, out, sizeof(out)) == n);
+    assert(tcp_csum_ok(out, 20, n));
+    assert(offload_next(&it, out, sizeof(out)) == 0);
+}
+
+
+// 读出一次写入 tun 的内容
+static int tun_read(int fd, vnet_hdr_t *hdr, uint8_t *pkt)
+{
+    static uint8_t buf[OFFLOAD_BUF_SIZE];
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < VNET_HDR_LEN)
+    {
+        return -1;
+    }
+    memcpy(hdr, buf, VNET_HDR_LEN);
+    memcpy(pkt, buf + VNET_HDR_LEN, n - VNET_HDR_LEN);
+    return (int)n - VNET_HDR_LEN;
+}
+
+
+static void test_gro(int v6)
+{
+    // datagram socket 保留每次 writev 的边界
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+    static uint8_t pkts[8][2048];
+    static uint8_t got[OFFLOAD_BUF_SIZE];
+    vnet_hdr_t hdr;
+    int iphl = v6 ? 40 : 20;
+    int hlen = iphl + 20;
+
+    // 连续的三段合并成一个 GSO 包, 最后一段带 PSH 结束合并
+    int lens[3];
+    lens[0] = tcp_packet(pkts[0], v6, 1000, 1000, TCP_ACK);
+    lens[1] = tcp_packet(pkts[1], v6, 2000, 1000, TCP_ACK);
+    lens[2] = tcp_packet(pkts[2], v6, 3000, 400, TCP_ACK | TCP_PSH);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(offload_push(fds[0], pkts[i], lens[i]) == 0);
+    }
+    assert(tun_read(fds[1], &hdr, got) < 0);
+    assert(offload_flush(fds[0]) == 0);
+    int n = tun_read(fds[1], &hdr, got);
+    assert(n == hlen + 2400);
+    assert((hdr.gso_type == (v6 ? 4 : 1)) && (hdr.gso_size == 1000) && (hdr.hdr_len == hlen));
+    assert((hdr.flags & 1) && (hdr.csum_start == iphl) && (hdr.csum_offset == 16));
+    if (v6)
+    {
+        assert(get16(got + 4) == n - 40);
+    }
+    else
+    {
+        assert(get16(got + 2) == n);
+        assert(csum(0, got, 20) == 0xffff);
+    }
+    assert((get32(got + iphl + 4) == 1000) && (got[iphl + 13] & TCP_PSH));
+    assert(got[hlen + 1000] == (uint8_t)2000);
+    assert(got[hlen + 2399] == (uint8_t)(3000 + 399));
+    assert(tun_read(fds[1], &hdr, got) < 0);
+
+    // 不合并: 序号不连续, 非纯 ACK, 不同的流
+    lens[0] = tcp_packet(pkts[0], v6, 1000, 1000, TCP_ACK);
+    lens[1] = tcp_packet(pkts[1], v6, 3000, 1000, TCP_ACK);
+    lens[2] = tcp_packet(pkts[2], v6, 4000, 1000, TCP_ACK | TCP_SYN);
+    int len3 = tcp_packet(pkts[3], v6, 5000, 1000, TCP_ACK);
+    int len4 = tcp_packet(pkts[4], v6, 6000, 1000, TCP_ACK);
+    put16(pkts[4] + iphl, 40001);
+    for (int i = 0; i < 3; i++)
+    {
+        offload_push(fds[0], pkts[i], lens[i]);
+    }
+    offload_push(fds[0], pkts[3], len3);
+    offload_push(fds[0], pkts[4], len4);
+    assert(offload_flush(fds[0]) == 0);
+    for (int i = 0; i < 5; i++)
+    {
+        assert(tun_read(fds[1], &hdr, got) == hlen + 1000);
+        assert((hdr.gso_type == 0) && (hdr.flags == 0));
+    }
+    assert(tun_read(fds[1], &hdr, got) < 0);
+
+    // 较短的段结束合并, 之后的包另起
+    lens[0] = tcp_packet(pkts[0], v6, 1000, 1000, TCP_ACK);
+    lens[1] = tcp_packet(pkts[1], v6, 2000, 500, TCP_ACK);
+    lens[2] = tcp_packet(pkts[2], v6, 2500, 1000, TCP_ACK);
+    for (int i = 0; i < 3; i++)
+    {
+        offload_push(fds[0], pkts[i], lens[i]);
+    }
+    assert(offload_flush(fds[0]) == 0);
+    assert(tun_read(fds[1], &hdr, got) == hlen + 1500);
+    assert(tun_read(fds[1], &hdr, got) == hlen + 1000);
+    assert(tun_read(fds[1], &hdr, got) < 0);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+int main()
+{
+    test_tso(0);
+    test_tso(1);
+    test_csum();
+    test_gro(0);
+    test_gro(1);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * test_probe.c - test RTT probes and path schedulers
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <sodium.h>
+
+#include "../src/conf.h"
+#include "../src/crypto.h"
+#include "../src/encapsulate.h"
+#include "../src/probe.h"
+
+#define MTU 1452
+
+
+static void test_probe(void)
+{
+    static probe_t probes[1];
+    pbuf_t pbuf;
+    memset(probes, 0, sizeof(probes));
+
+    // 时间戳经过加密后不变, 回显得到 RTT
+    pbuf.len = 100;
+    pbuf.flag = 0;
+    randombytes_buf(pbuf.payload, pbuf.len);
+    probe_mark(&probes[0], &pbuf, 0, 500000);
+    assert((pbuf.flag & FLAG_TS) && (ntohl(pbuf.ack) == 500000));
+    int n = encapsulate(0, CIPHER_AUTO, &pbuf, MTU, NULL);
+    assert(decapsulate(0, &pbuf, n) == 100);
+    assert((pbuf.flag & FLAG_TS) && (ntohl(pbuf.ack) == 500000));
+    probe_echo(&probes[0], ntohl(pbuf.ack), 530000);
+    assert((probes[0].srtt == 30000) && (probes[0].echoed == 1));
+
+    // 间隔内不再探测, 除非强制
+    pbuf.flag = 0;
+    probe_mark(&probes[0], &pbuf, 0, 550000);
+    assert(!(pbuf.flag & FLAG_TS));
+    probe_mark(&probes[0], &pbuf, 1, 550000);
+    assert(pbuf.flag & FLAG_TS);
+
+    // 没有回显的探测算作丢失, 迟到的回显仍然更新 RTT
+    for (uint32_t t = 600000; t < 4000000; t += 100000)
+    {
+        probe_mark(&probes[0], &pbuf, 0, t);
+    }
+    assert((probes[0].lost > 0) && (probes[0].loss > 500));
+    uint64_t lost = probes[0].lost;
+    probe_echo(&probes[0], 2800000, 4300000);
+    assert((probes[0].srtt > 200000) && (probes[0].echoed == 1) && (probes[0].lost == lost));
+}
+
+
+static void test_lock(void)
+{
+    static probe_t probe;
+    pbuf_t pbuf;
+    memset(&probe, 0, sizeof(probe));
+
+    // 拿不到锁时跳过, 不会一直等下去
+    probe.lock = getpid();
+    pbuf.flag = 0;
+    probe_mark(&probe, &pbuf, 1, 1000000);
+    assert(!(pbuf.flag & FLAG_TS) && (probe.sent == 0));
+    probe.lock = 0;
+    probe_mark(&probe, &pbuf, 1, 1000000);
+    assert((pbuf.flag & FLAG_TS) && (probe.sent == 1) && (probe.lock == 0));
+    probe_echo(&probe, 1000000, 1020000);
+    assert((probe.srtt == 20000) && (probe.lock == 0));
+}
+
+
+static void test_schedule(void)
+{
+    // path 1 慢, path 2 快但是丢包
+    static probe_t probes[3];
+    int paths[3] = { 0, 1, 2 };
+    int64_t current[3] = { 0, 0, 0 };
+    memset(probes, 0, sizeof(probes));
+    assert(probe_schedule(probes, paths, 3, SCHED_MINRTT, current) < 0);
+    probes[0].srtt = 50000;
+    probes[0].loss = 10;
+    probes[1].srtt = 300000;
+    probes[1].loss = 0;
+    probes[2].srtt = 20000;
+    probes[2].loss = 200;
+    assert(probe_schedule(probes, paths, 3, SCHED_MINRTT, current) == 2);
+    assert(probe_schedule(probes, paths, 3, SCHED_LOWLOSS, current) == 1);
+    int picks[3] = { 0, 0, 0 };
+    for (int i = 0; i < 1000; i++)
+    {
+        picks[probe_schedule(probes, paths, 3, SCHED_WEIGHTED, current)]++;
+    }
+    assert((picks[0] > picks[2]) && (picks[2] > picks[1]) && (picks[1] > 0));
+}
+
+
+int main()
+{
+    crypto_init("8556085d7ff5655a5e09a385c152ea2a");
+    test_probe();
+    test_lock();
+    test_schedule();
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * test_reorder.c - test sequence numbers and the reorder buffer
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "../src/conf.h"
+#include "../src/crypto.h"
+#include "../src/encapsulate.h"
+#include "../src/reorder.h"
+
+#define MTU 1452
+
+static uint32_t written[64];
+static int written_count;
+
+
+static void reorder_output(const uint8_t *pkt, int len)
+{
+    assert(len == 4);
+    memcpy(&written[written_count++], pkt, 4);
+}
+
+
+static void test_seq(void)
+{
+    // 序号经过压缩, 填充和加密后不变
+    obfs_t obfs;
+    memset(&obfs, 0, sizeof(obfs));
+    assert(obfs_parse(&obfs, "200:1,1000:3") == 0);
+    obfs.profile = OBFS_BUCKET;
+    for (int i = 0; i < 2; i++)
+    {
+        pbuf_t pbuf;
+        pbuf.len = 1000;
+        if (i == 0)
+        {
+            memset(pbuf.payload, 'a', pbuf.len);
+        }
+        else
+        {
+            randombytes_buf(pbuf.payload, pbuf.len);
+        }
+        pbuf.flag = FLAG_SEQ;
+        pbuf.seq = 0xdeadbeef;
+        pbuf_t copy;
+        memcpy(&copy, &pbuf, sizeof(pbuf));
+        int n = encapsulate(0, CIPHER_AUTO, &copy, MTU, &obfs);
+        copy.seq = 0;
+        assert(decapsulate(0, &copy, n) == 1000);
+        assert((copy.flag & FLAG_SEQ) && (copy.seq == 0xdeadbeef));
+        assert(memcmp(copy.payload, pbuf.payload, 1000) == 0);
+    }
+}
+
+
+static void test_reorder(void)
+{
+    // 暂存的包按顺序发出, 超时后跳过空洞, 空洞之后到达的包算迟到,
+    // 重复的包丢弃
+    assert(reorder_init(MTU, reorder_output) == 0);
+    assert(reorder_deadline() < 0);
+    uint32_t arrivals[] = { 100, 102, 101, 103, 105, 106, 105, 107 };
+    for (int i = 0; i < 8; i++)
+    {
+        reorder_input((uint8_t *)&arrivals[i], 4, arrivals[i], 1000 + i);
+    }
+    assert(written_count == 4);
+    reorder_stat_t rs;
+    reorder_stat(&rs);
+    assert(reorder_deadline() == 1004 + rs.timeout);
+    assert(reorder_flush(1008) == 1004 + rs.timeout);
+    int64_t deadline = reorder_flush(1004 + rs.timeout);
+    assert((deadline < 0) && (reorder_deadline() < 0));
+    assert(written_count == 7);
+    uint32_t late = 104;
+    reorder_input((uint8_t *)&late, 4, late, 1100);
+    uint32_t expected[] = { 100, 101, 102, 103, 105, 106, 107, 104 };
+    assert(written_count == 8);
+    assert(memcmp(written, expected, sizeof(expected)) == 0);
+    reorder_stat(&rs);
+    assert((rs.reordered == 4) && (rs.late == 1) && (rs.dropped == 1) && (rs.skipped == 1));
+
+    // 已经写出过的包, 不论按顺序写出的还是迟到的, 再收到都是重复的
+    uint32_t dups[] = { 104, 100, 106 };
+    for (int i = 0; i < 3; i++)
+    {
+        reorder_input((uint8_t *)&dups[i], 4, dups[i], 1200);
+    }
+    assert(written_count == 8);
+    reorder_stat(&rs);
+    assert((rs.late == 1) && (rs.dropped == 4));
+
+    // 跳到很远之后, 中间的包还可以迟到, 比窗口还旧的丢弃
+    uint32_t ahead = 108 + REORDER_SLOTS * 2;
+    reorder_input((uint8_t *)&ahead, 4, ahead, 1300);
+    uint32_t behind[] = { ahead - 1, ahead - 1, 108 };
+    for (int i = 0; i < 3; i++)
+    {
+        reorder_input((uint8_t *)&behind[i], 4, behind[i], 1300);
+    }
+    assert((written_count == 10) && (written[8] == ahead) && (written[9] == ahead - 1));
+    reorder_stat(&rs);
+    assert((rs.late == 2) && (rs.dropped == 6) && (rs.skipped == 2));
+
+    // 重启的发送端从头开始, 不会一直算迟到
+    uint32_t restart = 0xfffff000;
+    reorder_input((uint8_t *)&restart, 4, restart, 1200);
+    assert((written_count == 11) && (written[10] == restart));
+    reorder_stat(&rs);
+    assert(rs.late == 2);
+}
+
+
+int main()
+{
+    crypto_init("8556085d7ff5655a5e09a385c152ea2a");
+    test_seq();
+    test_reorder();
+    return 0;
+}
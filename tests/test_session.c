@@ -0,0 +1,199 @@
+/*
+ * test_session.c - test the shared session table
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "../src/session.h"
+#include "../src/spinlock.h"
+
+#define MAX 8
+
+
+static void key_of(uint8_t *key, int i)
+{
+    char addr[32];
+    snprintf(addr, sizeof(addr), "10.0.%d.%d/24", i / 256, i % 256);
+    assert(session_addr(addr, key) == 0);
+}
+
+
+static ipaddr remote_of(int port)
+{
+    ipaddr remote;
+    memset(&remote, 0, sizeof(remote));
+    struct sockaddr_in *sin = (struct sockaddr_in *)&remote;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons((uint16_t)port);
+    sin->sin_addr.s_addr = htonl(0xc0000201);
+    return remote;
+}
+
+
+static void test_keys(void)
+{
+    uint8_t key[SESSION_KEY_LEN];
+    uint8_t pkt[40];
+    char buf[SESSION_ADDRSTRLEN];
+
+    assert(session_addr("10.1.2.3/24", key) == 0);
+    assert(strcmp(session_addrstr(key, buf), "10.1.2.3") == 0);
+    assert(session_addr("fd00::2/64", key) == 0);
+    assert(strcmp(session_addrstr(key, buf), "fd00::2") == 0);
+    assert(session_addr("example", key) < 0);
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x45;
+    memcpy(pkt + 12, "\x0a\x00\x00\x05\x0a\x00\x00\x01", 8);
+    assert(session_key(pkt, 20, 0, key) == 0);
+    assert(strcmp(session_addrstr(key, buf), "10.0.0.5") == 0);
+    assert(session_key(pkt, 20, 1, key) == 0);
+    assert(strcmp(session_addrstr(key, buf), "10.0.0.1") == 0);
+    assert(session_key(pkt, 19, 0, key) < 0);
+    pkt[0] = 0x60;
+    assert(session_key(pkt, 20, 0, key) < 0);
+}
+
+
+static void test_table(void)
+{
+    uint8_t keys[MAX + 1][SESSION_KEY_LEN];
+    session_t *s[MAX + 1];
+    session_stat_t stat;
+    int token;
+    int cipher;
+    ipaddr remote;
+    int64_t t = 1000;
+
+    // 插入和查找, 负载一半的线性探测表里冲突的键也都能找到
+    for (int i = 0; i <= MAX; i++)
+    {
+        key_of(keys[i], i);
+    }
+    assert(session_find(keys[0]) == NULL);
+    for (int i = 0; i < MAX; i++)
+    {
+        s[i] = session_learn(keys[i], t);
+        assert(s[i] != NULL);
+        assert(session_learn(keys[i], t) == s[i]);
+    }
+    for (int i = 0; i < MAX; i++)
+    {
+        assert(session_find(keys[i]) == s[i]);
+    }
+    session_info_t info;
+    int n = 0;
+    for (int i = session_next(0, &info); i >= 0; i = session_next(i + 1, &info))
+    {
+        n++;
+    }
+    assert(n == MAX);
+
+    // 表满
+    assert(session_learn(keys[MAX], t) == NULL);
+    session_stat(&stat, t);
+    assert((stat.active == MAX) && (stat.created == MAX) && (stat.full == 1));
+
+    // 最近出现过的 path
+    assert(session_route(s[0], keys[0], t, &token, &remote, &cipher) < 0);
+    session_seen(s[0], keys[0], 1, 7, remote_of(4000), 2, t);
+    assert(session_route(s[0], keys[0], t + 10, &token, &remote, &cipher) == 1);
+    assert((token == 7) && (cipher == 2));
+    assert(((struct sockaddr_in *)&remote)->sin_port == htons(4000));
+    session_seen(s[0], keys[0], 0, 8, remote_of(4001), 1, t + 20);
+    int a = session_route(s[0], keys[0], t + 30, &token, &remote, &cipher);
+    int b = session_route(s[0], keys[0], t + 30, &token, &remote, &cipher);
+    assert((a >= 0) && (b >= 0) && (a != b));
+    assert(session_route(s[0], keys[0], t + 60 * 1000, &token, &remote, &cipher) < 0);
+    // 用别的地址找到的指针
+    assert(session_route(s[0], keys[1], t + 30, &token, &remote, &cipher) < 0);
+
+    // 过期的槽位给探测链经过它的新地址, 旧指针不再属于原来的地址
+    t += SESSION_TIMEOUT + 100;
+    uint8_t key[SESSION_KEY_LEN];
+    session_t *fresh = NULL;
+    for (int i = MAX + 1; (fresh == NULL) && (i < 1000); i++)
+    {
+        key_of(key, i);
+        fresh = session_learn(key, t);
+    }
+    int old = 0;
+    while ((old < MAX) && (s[old] != fresh))
+    {
+        old++;
+    }
+    assert(old < MAX);
+    assert(session_find(keys[old]) == NULL);
+    assert(session_find(key) == fresh);
+    for (int i = 0; i < MAX; i++)
+    {
+        assert((i == old) || (session_find(keys[i]) == s[i]));
+    }
+    session_seen(fresh, keys[old], 1, 9, remote_of(6000), 1, t);
+    assert(session_route(fresh, key, t, &token, &remote, &cipher) < 0);
+    session_seen(fresh, key, 0, 3, remote_of(6001), 1, t);
+    assert(session_route(fresh, key, t, &token, &remote, &cipher) == 0);
+    assert(session_route(fresh, keys[old], t, &token, &remote, &cipher) < 0);
+    session_stat(&stat, t);
+    assert((stat.active == 1) && (stat.created == MAX + 1));
+}
+
+
+static void test_dead_owner(void)
+{
+    spinlock_t *lock = mmap(NULL, sizeof(spinlock_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(lock != MAP_FAILED);
+    *lock = 0;
+    assert(spin_lock(lock) == 0);
+    spin_unlock(lock);
+    assert(*lock == 0);
+
+    // 持有锁的进程退出, 其它进程接手
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        _exit(spin_lock(lock) == 0 ? 0 : 1);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    assert(*lock == pid);
+    assert(spin_lock(lock) == 0);
+    assert(*lock == getpid());
+    spin_unlock(lock);
+    munmap((void *)lock, sizeof(spinlock_t));
+}
+
+
+int main()
+{
+    assert(session_init(MAX, 2) == 0);
+    test_keys();
+    test_table();
+    test_dead_owner();
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * test_xdp.c - test AF_XDP frame parsing
+ *
+ * Copyright (C) 2014 - 2017, Xiaoxiao <i@pxx.io>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "../src/xdp.h"
+
+
+static void put16(uint8_t *p, int v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+
+// 以太网帧, 末尾补 pad 字节的填充, 返回帧长度
+static int frame(uint8_t *f, int v6, const uint8_t *payload, int len, int pad)
+{
+    memset(f, 0, 128);
+    memcpy(f, "\x02\x00\x00\x00\x00\x01", 6);
+    memcpy(f + 6, "\x02\x00\x00\x00\x00\x02", 6);
+    uint8_t *ip = f + 14;
+    uint8_t *udp;
+    if (v6)
+    {
+        put16(f + 12, 0x86dd);
+        ip[0] = 0x60;
+        put16(ip + 4, 8 + len);
+        ip[6] = IPPROTO_UDP;
+        ip[7] = 64;
+        ip[8] = 0xfd;
+        ip[23] = 2;
+        ip[24] = 0xfd;
+        ip[39] = 1;
+        udp = ip + 40;
+    }
+    else
+    {
+        put16(f + 12, 0x0800);
+        ip[0] = 0x45;
+        put16(ip + 2, 20 + 8 + len);
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(ip + 12, "\x0a\x00\x00\x02", 4);
+        memcpy(ip + 16, "\x0a\x00\x00\x01", 4);
+        udp = ip + 20;
+    }
+    put16(udp, 40000);
+    put16(udp + 2, 1194);
+    put16(udp + 4, 8 + len);
+    memcpy(udp + 8, payload, len);
+    memset(udp + 8 + len, 0xee, pad);
+    return (int)(udp + 8 + len + pad - f);
+}
+
+
+static void test_parse(int v6)
+{
+    static uint8_t f[128];
+    const uint8_t payload[] = { 1, 2, 3, 4 };
+    ipaddr addr;
+    xdp_peer_t peer;
+    int port;
+    int len;
+    int hlen = v6 ? 62 : 42;
+
+    // 短帧补齐到 60 字节, 填充不能算进 payload
+    int n = frame(f, v6, payload, 4, v6 ? 0 : 14);
+    assert(n >= 60);
+    assert(xdp_parse(f, n, &addr, &port, &peer, &len) == hlen);
+    assert((len == 4) && (memcmp(f + hlen, payload, 4) == 0));
+    assert(port == 1194);
+    assert(peer.len == hlen);
+    // 回复首部交换了 MAC, 地址和端口
+    assert(memcmp(peer.hdr, f + 6, 6) == 0);
+    assert(memcmp(peer.hdr + 6, f, 6) == 0);
+    if (v6)
+    {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&addr;
+        assert(sin6->sin6_family == AF_INET6);
+        assert(memcmp(&sin6->sin6_addr, f + 22, 16) == 0);
+        assert(ntohs(sin6->sin6_port) == 40000);
+        assert(memcmp(peer.hdr + 22, f + 38, 16) == 0);
+        assert(memcmp(peer.hdr + 38, f + 22, 16) == 0);
+    }
+    else
+    {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&addr;
+        assert(sin->sin_family == AF_INET);
+        assert(memcmp(&sin->sin_addr, f + 26, 4) == 0);
+        assert(ntohs(sin->sin_port) == 40000);
+        assert(memcmp(peer.hdr + 26, f + 30, 4) == 0);
+        assert(memcmp(peer.hdr + 30, f + 26, 4) == 0);
+    }
+    assert((peer.hdr[hlen - 8] == f[hlen - 6]) && (peer.hdr[hlen - 7] == f[hlen - 5]));
+    assert((peer.hdr[hlen - 6] == f[hlen - 8]) && (peer.hdr[hlen - 5] == f[hlen - 7]));
+
+    // 空 payload
+    n = frame(f, v6, payload, 0, 0);
+    assert((xdp_parse(f, n, &addr, &port, &peer, &len) == hlen) && (len == 0));
+
+    // 帧被截断, IP 长度超出帧
+    n = frame(f, v6, payload, 4, 0);
+    assert(xdp_parse(f, n - 1, &addr, &port, &peer, &len) < 0);
+
+    // UDP 长度超出 IP 长度, 或小于 UDP 首部
+    n = frame(f, v6, payload, 4, 8);
+    put16(f + hlen - 4, 8 + 5);
+    assert(xdp_parse(f, n, &addr, &port, &peer, &len) < 0);
+    put16(f + hlen - 4, 7);
+    assert(xdp_parse(f, n, &addr, &port, &peer, &len) < 0);
+
+    // UDP 长度比 IP 长度短时以 UDP 为准
+    put16(f + hlen - 4, 8 + 2);
+    assert((xdp_parse(f, n, &addr, &port, &peer, &len) == hlen) && (len == 2));
+
+    // 不是 IP
+    n = frame(f, v6, payload, 4, 0);
+    f[14] = 0x50;
+    assert(xdp_parse(f, n, &addr, &port, &peer, &len) < 0);
+}
+
+
+int main()
+{
+    test_parse(0);
+    test_parse(1);
+
+    // IPv4 首部长度小于 20
+    static uint8_t f[128];
+    ipaddr addr;
+    xdp_peer_t peer;
+    int port;
+    int len;
+    int n = frame(f, 0, (const uint8_t *)"abcd", 4, 0);
+    f[14] = 0x44;
+    assert(xdp_parse(f, n, &addr, &port, &peer, &len) < 0);
+    return 0;
+}